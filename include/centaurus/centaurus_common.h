@@ -112,8 +112,14 @@ struct _device_bin {
     size_t bin_size;
 
     struct _device_bin_static_info static_info;
+
+    /*  the fastest local size that acl --autotune found, all 0 if not tuned  */
+    /*  used by the runtime if it divides the global size of the launch  */
+    size_t tuned_local[3];
 };
 
+struct _kernel_struct;
+
 /*  per platform low level bits  */
 struct _platform_bin {
     /*  as clGetDeviceIDs() returns them for each platform  */
@@ -122,6 +128,10 @@ struct _platform_bin {
 
     /*  number of devices  */
     size_t device_num;
+
+    /*  the vectorised kernel for the CPU devices of the platform, or NULL  */
+    /*  see acl --cpu-vector-width and _kernel_struct::vector_width  */
+    struct _kernel_struct *cpu_variant;
 };
 
 /*  supported platforms  */
@@ -164,6 +174,12 @@ struct _kernel_struct {
     //has size ACL_SUPPORTED_PLATFORMS_NUM
     struct _platform_bin *platform_table;
 
+    /*  elements per work-item of a cpu_variant, 0 otherwise  */
+    /*  the variant is used only if the global size of dimension 0 is a  */
+    /*  multiple of it, the global size is divided by it and the local  */
+    /*  size is left to the driver  */
+    unsigned int vector_width;
+
 } kernel_t;
 
 typedef struct _task_executable {
@@ -196,6 +212,36 @@ void acl_centaurus_finish();
  */
 void acl_create_task( int approx, memory_object *args, int num_args, task_exe_t oclexe, geom geometry, const char *group_name, const char *sourcelocation_id );
 
+/* A task site of the static site table of a translation unit, see acl --static-task-sites */
+struct _task_site {
+    unsigned id;                                /* index in the site table */
+    const char *file;
+    unsigned line;
+    const char *taskid;                         /* NULL if the task has no taskid */
+    const char * const *iteration_vars;         /* names of the enclosing loop variables */
+    unsigned num_iteration_vars;
+    /* the dependencies acl proves from the data clauses: the last task of each
+     * site of deps, earlier sites of the same function, must finish first */
+    const unsigned *deps;
+    unsigned num_deps;
+    int dynamic_deps;                           /* non zero if the runtime must still check the memory objects */
+};
+
+/* Same as acl_create_task(), the source location is given by the static site.
+ * Inputs:
+ *         site             : task site  --  (static storage, the runtime may keep the pointer)
+ *         iteration        : site->num_iteration_vars values of the loop variables, NULL if none
+ */
+void acl_create_task_site( int approx, memory_object *args, int num_args, task_exe_t oclexe, geom geometry, const char *group_name, const struct _task_site *site, const long long *iteration );
+
+/* Create num_tasks tasks of the same kernel at once, see acl --batch-tasks.
+ * Task k takes the num_args memory objects at args + k*num_args, the other
+ * inputs are the ones of acl_create_task() and acl_create_task_site(), the
+ * source location of task k is the one of the batch followed by <k>.
+ */
+void acl_create_task_range( int approx, memory_object *args, int num_args, task_exe_t oclexe, geom geometry, const char *group_name, const char *sourcelocation_id, size_t num_tasks );
+void acl_create_task_site_range( int approx, memory_object *args, int num_args, task_exe_t oclexe, geom geometry, const char *group_name, const struct _task_site *site, const long long *iteration, size_t num_tasks );
+
 void acl_taskwait_all();
 void acl_taskwait_on(int varnum, ...);
 void acl_taskwait_label(const char *label);
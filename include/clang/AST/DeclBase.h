@@ -49,6 +49,7 @@ class ObjCInterfaceDecl;
 class ObjCMethodDecl;
 class ObjCProtocolDecl;
 struct PrintingPolicy;
+class PrinterHelper;
 class RecordDecl;
 class Stmt;
 class StoredDeclsMap;
@@ -981,10 +982,12 @@ public:
              unsigned Indentation = 0, bool PrintInstantiation = false) const;
   void printAccurateVersion(raw_ostream &Out, const PrintingPolicy &Policy,
                             std::string AlternativeName,
-                            unsigned Indentation = 0, bool PrintInstantiation = false) const;
+                            unsigned Indentation = 0, bool PrintInstantiation = false,
+                            PrinterHelper *Helper = nullptr) const;
   void printApproximateVersion(raw_ostream &Out, const PrintingPolicy &Policy,
                                std::string AlternativeName,
-                               unsigned Indentation = 0, bool PrintInstantiation = false) const;
+                               unsigned Indentation = 0, bool PrintInstantiation = false,
+                               PrinterHelper *Helper = nullptr) const;
   static void printGroup(Decl** Begin, unsigned NumDecls,
                          raw_ostream &Out, const PrintingPolicy &Policy,
                          unsigned Indentation = 0);
@@ -86,6 +86,12 @@ public:
   typedef llvm::SetVector<CallGraphNode *>::iterator nodes_iterator;
   typedef llvm::SetVector<CallGraphNode *>::const_iterator const_nodes_iterator;
 
+  /// \brief The strongly connected components of the graph in bottom-up
+  /// order: a callee comes before its callers unless they are in the same
+  /// component. The virtual root is not included.
+  typedef std::vector<CallGraphNode *> SCCTy;
+  void getSCCs(std::vector<SCCTy> &SCCs);
+
   void print(raw_ostream &os) const;
   void dump() const;
   void viewGraph() const;
@@ -141,6 +147,10 @@ private:
   /// \brief The list of functions called from this node.
   SmallVector<CallRecord, 5> CalledFunctions;
 
+  /// \brief The list of functions that call this node, including the virtual
+  /// root.
+  SmallVector<CallRecord, 5> CallingFunctions;
+
 public:
   CallGraphNode(Decl *D) : FD(D) {}
 
@@ -156,8 +166,15 @@ public:
   inline bool empty() const {return CalledFunctions.empty(); }
   inline unsigned size() const {return CalledFunctions.size(); }
 
+  /// Iterators through all the callers/parents of the node.
+  inline iterator caller_begin() { return CallingFunctions.begin(); }
+  inline iterator caller_end() { return CallingFunctions.end(); }
+  inline const_iterator caller_begin() const { return CallingFunctions.begin(); }
+  inline const_iterator caller_end()   const { return CallingFunctions.end();   }
+
   void addCallee(CallGraphNode *N, CallGraph *CG) {
     CalledFunctions.push_back(N);
+    N->CallingFunctions.push_back(this);
   }
 
   Decl *getDecl() const { return FD; }
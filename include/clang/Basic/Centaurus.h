@@ -60,11 +60,13 @@ enum ClauseKind {
     CK_BIND_APPROXIMATE,
     CK_SUGGEST,
     CK_ENERGY_JOULE,
-    CK_RATIO
+    CK_RATIO,
+    CK_PERFORATE,
+    CK_RELAXED_MATH
 };
 
 const unsigned CK_START = CK_LABEL;
-const unsigned CK_END = CK_RATIO + 1;
+const unsigned CK_END = CK_RELAXED_MATH + 1;
 
 enum ArgKind {
     A_RawExpr,
@@ -315,6 +317,8 @@ public:
     }
     bool hasNoArgs() const {
         switch (CK) {
+        case CK_RELAXED_MATH:
+            return true;
         default:
             return false;
         }
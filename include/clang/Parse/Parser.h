@@ -574,6 +574,8 @@ private:
     ParseClauseFn ParseClauseSuggest;
     ParseClauseFn ParseClauseEnergy_joule;
     ParseClauseFn ParseClauseRatio;
+    ParseClauseFn ParseClausePerforate;
+    ParseClauseFn ParseClauseRelaxed_math;
 
     //Parse Directives
 
@@ -72,6 +72,8 @@ public:
     isValidClauseFn isValidClauseSuggest;
     isValidClauseFn isValidClauseEnergy_joule;
     isValidClauseFn isValidClauseRatio;
+    isValidClauseFn isValidClausePerforate;
+    isValidClauseFn isValidClauseRelaxed_math;
 
     //wrapper
     isValidDirectiveFn isValidDirectiveWrapper;
@@ -28,7 +28,9 @@ const unsigned DirectiveInfo::ValidDirective[DK_END] = {
         BITMASK(CK_GROUPS) |
         BITMASK(CK_BIND) |
         BITMASK(CK_BIND_APPROXIMATE) |
-        BITMASK(CK_SUGGEST),
+        BITMASK(CK_SUGGEST) |
+        BITMASK(CK_PERFORATE) |
+        BITMASK(CK_RELAXED_MATH),
 
         //taskgroup
         BITMASK(CK_LABEL) |
@@ -77,6 +79,8 @@ const std::string ClauseInfo::Name[CK_END] = {
     "suggest",
     "energy_joule",
     "ratio",
+    "perforate",
+    "relaxed_math",
 };
 
 static std::string printArgList(const ArgVector &Args, const PrintingPolicy &Policy) {
@@ -54,10 +54,13 @@ namespace {
         PrintInstantiation(PrintInstantiation)
       {
           SubtaskPrintMode = centaurus::K_PRINT_ALL;
+          BodyHelper = nullptr;
       }
 
     enum centaurus::PrintSubtaskType SubtaskPrintMode;
     std::string AlternativeName;
+    // consulted for the statements of the body of the printed function
+    PrinterHelper *BodyHelper;
 
     void VisitDeclContext(DeclContext *DC, bool Indent = true);
 
@@ -120,21 +123,25 @@ void Decl::print(raw_ostream &Out, const PrintingPolicy &Policy,
 
 void Decl::printAccurateVersion(raw_ostream &Out, const PrintingPolicy &Policy,
                                 std::string AlternativeName,
-                                unsigned Indentation, bool PrintInstantiation) const {
+                                unsigned Indentation, bool PrintInstantiation,
+                                PrinterHelper *Helper) const {
   assert(isa<FunctionDecl>(this));
   DeclPrinter Printer(Out, Policy, Indentation, PrintInstantiation);
   Printer.SubtaskPrintMode = centaurus::K_PRINT_ACCURATE_SUBTASK;
   Printer.AlternativeName = AlternativeName;
+  Printer.BodyHelper = Helper;
   Printer.Visit(const_cast<Decl*>(this));
 }
 
 void Decl::printApproximateVersion(raw_ostream &Out, const PrintingPolicy &Policy,
                                    std::string AlternativeName,
-                                   unsigned Indentation, bool PrintInstantiation) const {
+                                   unsigned Indentation, bool PrintInstantiation,
+                                   PrinterHelper *Helper) const {
   assert(isa<FunctionDecl>(this));
   DeclPrinter Printer(Out, Policy, Indentation, PrintInstantiation);
   Printer.SubtaskPrintMode = centaurus::K_PRINT_APPROXIMATE_SUBTASK;
   Printer.AlternativeName = AlternativeName;
+  Printer.BodyHelper = Helper;
   Printer.Visit(const_cast<Decl*>(this));
 }
 
@@ -675,10 +682,10 @@ void DeclPrinter::VisitFunctionDecl(FunctionDecl *D) {
         Body->printPretty(Out, nullptr, SubPolicy, Indentation);
         break;
     case centaurus::K_PRINT_ACCURATE_SUBTASK:
-        Body->printPrettyAccurateVersion(Out, nullptr, SubPolicy, Indentation);
+        Body->printPrettyAccurateVersion(Out, BodyHelper, SubPolicy, Indentation);
         break;
     case centaurus::K_PRINT_APPROXIMATE_SUBTASK:
-        Body->printPrettyApproximateVersion(Out, nullptr, SubPolicy, Indentation);
+        Body->printPrettyApproximateVersion(Out, BodyHelper, SubPolicy, Indentation);
         break;
     }
     Out << '\n';
@@ -17,6 +17,7 @@
 #include "clang/AST/Decl.h"
 #include "clang/AST/StmtVisitor.h"
 #include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Support/GraphWriter.h"
 
@@ -191,6 +192,18 @@ CallGraphNode *CallGraph::getOrInsertNode(Decl *F) {
   return Node;
 }
 
+void CallGraph::getSCCs(std::vector<SCCTy> &SCCs) {
+  // The root reaches every node, scc_iterator visits the components in
+  // reverse topological order.
+  for (llvm::scc_iterator<CallGraph *> I = llvm::scc_begin(this),
+                                       E = llvm::scc_end(this); I != E; ++I) {
+    const SCCTy &SCC = *I;
+    if (SCC.size() == 1 && SCC.front() == Root)
+      continue;
+    SCCs.push_back(SCC);
+  }
+}
+
 void CallGraph::print(raw_ostream &OS) const {
   OS << " --- Call graph Dump --- \n";
 
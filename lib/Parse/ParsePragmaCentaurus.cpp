@@ -75,6 +75,8 @@ static bool mustBeUnique(ClauseKind CK) {
     case CK_SUGGEST:
     case CK_ENERGY_JOULE:
     case CK_RATIO:
+    case CK_PERFORATE:
+    case CK_RELAXED_MATH:
         return true;
     default:
         return false;
@@ -557,6 +559,19 @@ Parser::ParseClauseRatio(DirectiveKind DK, ClauseInfo *CI) {
     return true;
 }
 
+bool
+Parser::ParseClausePerforate(DirectiveKind DK, ClauseInfo *CI) {
+    if (!ParseArgScalarIntExpr(DK,CI))
+        return false;
+    return true;
+}
+
+bool
+Parser::ParseClauseRelaxed_math(DirectiveKind DK, ClauseInfo *CI) {
+    //no arguments, see ClauseInfo::hasNoArgs()
+    return true;
+}
+
 //Parse Directives
 
 bool
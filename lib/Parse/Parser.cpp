@@ -546,6 +546,8 @@ void Parser::Initialize() {
       ParseClause[CK_SUGGEST] = &Parser::ParseClauseSuggest;
       ParseClause[CK_ENERGY_JOULE] = &Parser::ParseClauseEnergy_joule;
       ParseClause[CK_RATIO] = &Parser::ParseClauseRatio;
+      ParseClause[CK_PERFORATE] = &Parser::ParseClausePerforate;
+      ParseClause[CK_RELAXED_MATH] = &Parser::ParseClauseRelaxed_math;
 
       ParseDirective[DK_TASK] = &Parser::ParseDirectiveTask;
       ParseDirective[DK_TASKGROUP] = &Parser::ParseDirectiveTaskgroup;
@@ -296,6 +296,8 @@ Centaurus::Centaurus(Sema &s) : S(s), PendingDirective(0), Valid(false),
     isValidClause[CK_SUGGEST] = &Centaurus::isValidClauseSuggest;
     isValidClause[CK_ENERGY_JOULE] = &Centaurus::isValidClauseEnergy_joule;
     isValidClause[CK_RATIO] = &Centaurus::isValidClauseRatio;
+    isValidClause[CK_PERFORATE] = &Centaurus::isValidClausePerforate;
+    isValidClause[CK_RELAXED_MATH] = &Centaurus::isValidClauseRelaxed_math;
 
     isValidDirective[DK_TASK] = &Centaurus::isValidDirectiveTask;
     isValidDirective[DK_TASKGROUP] = &Centaurus::isValidDirectiveTaskgroup;
@@ -914,6 +916,27 @@ Centaurus::isValidClauseRatio(DirectiveKind DK, ClauseInfo *CI) {
     return true;
 }
 
+bool
+Centaurus::isValidClausePerforate(DirectiveKind DK, ClauseInfo *CI) {
+    Arg *A = CI->getArg();
+    if (!A->isICE()) {
+        S.Diag(A->getLocStart(),diag::err_pragma_acc_test)
+            << "expected integer constant expression";
+        return false;
+    }
+    if (A->getICE().getSExtValue() < 1) {
+        S.Diag(A->getLocStart(),diag::err_pragma_acc_test)
+            << "perforation rate must be positive";
+        return false;
+    }
+    return true;
+}
+
+bool
+Centaurus::isValidClauseRelaxed_math(DirectiveKind DK, ClauseInfo *CI) {
+    return true;
+}
+
 bool
 Centaurus::isValidDirectiveTask(DirectiveInfo *DI) {
     //check for missing clauses and apply implementation defaults
@@ -925,6 +948,9 @@ Centaurus::isValidDirectiveTask(DirectiveInfo *DI) {
     ClauseInfo *EvalFun = NULL;
     ClauseInfo *Estimation = NULL;
 
+    ClauseInfo *ApproxFun = NULL;
+    ClauseInfo *Approximation = NULL;
+
     ClauseList &CList = DI->getClauseList();
     for (ClauseList::iterator II = CList.begin(), EE = CList.end(); II != EE; ++II) {
         ClauseInfo *CI = *II;
@@ -936,6 +962,11 @@ Centaurus::isValidDirectiveTask(DirectiveInfo *DI) {
             EvalFun = CI;
         else if (!Estimation && CI->getKind() == CK_ESTIMATION)
             Estimation = CI;
+        else if (!ApproxFun && CI->getKind() == CK_APPROXFUN)
+            ApproxFun = CI;
+        else if (!Approximation &&
+                 (CI->getKind() == CK_PERFORATE || CI->getKind() == CK_RELAXED_MATH))
+            Approximation = CI;
     }
 
     bool status = true;
@@ -945,8 +976,17 @@ Centaurus::isValidDirectiveTask(DirectiveInfo *DI) {
         status = false;
     }
 
+    // the approximate kernel is either written by the user or generated by acl
+    if (ApproxFun && Approximation) {
+        S.Diag(Approximation->getLocStart(),diag::err_pragma_acc_test)
+            << "invalid combination of clauses";
+        S.Diag(ApproxFun->getLocStart(),diag::note_pragma_acc_test)
+            << "the approximate kernel is already given by approxfun() clause";
+        status = false;
+    }
+
     if (!EvalFun && !Estimation)
-        return true;  //ok
+        return status;  //ok
 #if 0
     // postpone check for CreateRgion() method, when SubStmt is known
     else if (!EvalFun) {
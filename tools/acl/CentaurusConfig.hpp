@@ -11,9 +11,31 @@ struct CentaurusConfig {
     bool CompileOnly;
     bool isCXX;
     bool NoArgs;
+    bool UseKernelCache;
+    bool SingleObject;
+    bool SyntaxCheck;
+    bool FuseTasks;
+    bool StaticTaskSites;
+    bool BatchTasks;
+    bool ElideTransfers;
+    bool SpecializeKernels;
+    bool StripKernelSources;
+    bool Autotune;
 
     int NvidiaDriverVersion;
 
+    //max number of parallel jobs
+    unsigned Jobs;
+
+    //one work-group in ProfileSample counts the basic blocks in profile mode
+    unsigned ProfileSample;
+
+    //elements per work-item of the CPU variants of the kernels, 0 for none
+    unsigned CPUVectorWidth;
+
+    //position of the current translation unit in InputFiles
+    unsigned TUIndex;
+
     std::string InstallPath;
     std::string IncludePath;
     std::string CustomSystemHeaders;
@@ -21,6 +43,16 @@ struct CentaurusConfig {
     std::string LinkerPath;
     std::string ClangPath;
     std::string SPIRToolPath;
+    std::string KernelCachePath;
+
+    //"opencl", "spir" or empty to use SPIR only if there is no OpenCL platform
+    std::string KernelBackend;
+
+    //JSON/CSV report of the kernel resources, empty for none
+    std::string ResourceReport;
+
+    //JSON report of -acl-time-report, empty for none
+    std::string TimeReport;
 
     std::string UserDefinedOutputFile;
 
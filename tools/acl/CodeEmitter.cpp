@@ -0,0 +1,104 @@
+#include "llvm/Support/FileSystem.h"
+
+#include "CodeEmitter.hpp"
+
+using namespace llvm;
+using namespace acl;
+
+size_t
+acl::getCStringLiteralSize(StringRef Src) {
+    size_t Size = 0;
+    for (StringRef::iterator II = Src.begin(), EE = Src.end(); II != EE; ++II) {
+        switch (*II) {
+        case '\r': case '\t':
+            break;
+        case '\\': case '"': case '\n':
+            Size += 2;
+            break;
+        default:
+            ++Size;
+        }
+    }
+    return Size;
+}
+
+void
+acl::writeCStringLiteral(raw_ostream &OS, StringRef Src) {
+    // copy the runs without special characters as they are
+    size_t Start = 0;
+    for (size_t i = 0, e = Src.size(); i != e; ++i) {
+        const char C = Src[i];
+        if (C != '\r' && C != '\t' && C != '\\' && C != '"' && C != '\n')
+            continue;
+        OS << Src.slice(Start,i);
+        Start = i + 1;
+        if (C == '\\')
+            OS << "\\\\";
+        else if (C == '"')
+            OS << "\\\"";
+        else if (C == '\n')
+            OS << "\\n";
+    }
+    OS << Src.substr(Start);
+}
+
+GeneratedFile::GeneratedFile(const std::string &File)
+    : raw_ostream(), File(File), Pos(0), Done(false)
+{
+    int FD;
+    if (sys::fs::createUniqueFile(File + "-%%%%%%.tmp",FD,TmpFile))
+        return;
+    // this stream buffers, the file only gets whole buffers
+    OS.reset(new raw_fd_ostream(FD,/*shouldClose=*/true,/*unbuffered=*/true));
+    SetBufferSize(1 << 16);
+}
+
+GeneratedFile::~GeneratedFile() {
+    if (!Done)
+        discard();
+}
+
+void
+GeneratedFile::write_impl(const char *Ptr, size_t Size) {
+    Pos += Size;
+    if (!OS)
+        return;
+    Hash.update(ArrayRef<uint8_t>((const uint8_t *)Ptr,Size));
+    OS->write(Ptr,Size);
+}
+
+std::string
+GeneratedFile::getHash() {
+    flush();
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Str;
+    MD5::stringifyResult(Result,Str);
+    return Str.str().str();
+}
+
+bool
+GeneratedFile::commit() {
+    flush();
+    Done = true;
+    if (!OS)
+        return false;
+    OS->close();
+    if (OS->has_error() || sys::fs::rename(TmpFile,File)) {
+        OS->clear_error();
+        sys::fs::remove(TmpFile);
+        return false;
+    }
+    return true;
+}
+
+void
+GeneratedFile::discard() {
+    flush();
+    Done = true;
+    if (!OS)
+        return;
+    OS->close();
+    OS->clear_error();
+    sys::fs::remove(TmpFile);
+}
@@ -0,0 +1,57 @@
+#ifndef ACL_CODE_EMITTER_HPP_
+#define ACL_CODE_EMITTER_HPP_
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <string>
+
+namespace acl {
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Code Emitter
+///////////////////////////////////////////////////////////////////////////////
+
+//size of Src in the body of a C string literal, see writeCStringLiteral()
+size_t getCStringLiteralSize(llvm::StringRef Src);
+
+//write Src as the body of a C string literal in one pass, '\r' and '\t' are
+//dropped as the OpenCL compilers do not need them
+void writeCStringLiteral(llvm::raw_ostream &OS, llvm::StringRef Src);
+
+//A generated source that is written to disk while it is emitted. The
+//contents go to a temporary file next to File and are hashed on the way, so
+//no copy of the file is kept in memory. commit() moves the temporary file
+//over File, discard() keeps File as it is.
+class GeneratedFile : public llvm::raw_ostream {
+private:
+    std::string File;
+    llvm::SmallString<128> TmpFile;
+    std::unique_ptr<llvm::raw_fd_ostream> OS;
+    llvm::MD5 Hash;
+    uint64_t Pos;
+    bool Done;
+
+    void write_impl(const char *Ptr, size_t Size);
+    uint64_t current_pos() const { return Pos; }
+
+public:
+    explicit GeneratedFile(const std::string &File);
+    ~GeneratedFile();
+
+    //false if the temporary file cannot be created, nothing is written then
+    bool isOpen() const { return OS != nullptr; }
+
+    //the MD5 of the contents, call once after the last write
+    std::string getHash();
+
+    bool commit();
+    void discard();
+};
+
+}
+
+#endif
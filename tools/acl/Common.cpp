@@ -39,3 +39,14 @@ GetBasename(const std::string &filename) {
     if (lastslash == std::string::npos) return filename;
     return filename.substr(lastslash+1,std::string::npos-1);
 }
+
+std::string
+quoteJSON(const std::string &Str) {
+    std::string Out("\"");
+    for (std::string::const_iterator II = Str.begin(), EE = Str.end(); II != EE; ++II) {
+        if (*II == '"' || *II == '\\')
+            Out += '\\';
+        Out += *II;
+    }
+    return Out + "\"";
+}
@@ -28,6 +28,9 @@ std::string RemoveDotExtension(const std::string &filename);
 std::string GetDotExtension(const std::string &filename);
 std::string GetBasename(const std::string &filename);
 
+//Str as a JSON string, with the quotes
+std::string quoteJSON(const std::string &Str);
+
 template <typename T>
 std::string toString(const T &x) {
     std::stringstream OS;
@@ -0,0 +1,64 @@
+#ifndef ACL_COMPILE_BACKEND_HPP_
+#define ACL_COMPILE_BACKEND_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+#include "CentaurusConfig.hpp"
+
+namespace acl {
+
+class KernelCache;
+struct KernelCacheEntry;
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Compile Backend
+///////////////////////////////////////////////////////////////////////////////
+
+//builds the OpenCL source of a kernel for the devices of one target
+//
+//The built-in backends are the OpenCL driver, one target per installed
+//platform, and SPIR, which uses the OpenCL front end of acl itself and needs
+//no device at all. compile() is called concurrently for different kernels.
+//A failed build returns createFailedPlatformBin().
+class CompileBackend {
+public:
+    virtual ~CompileBackend() {}
+
+    virtual const char *getName() const = 0;
+    virtual size_t getNumTargets() const = 0;
+
+    virtual PlatformBin compile(const std::string &Src, const std::string &SymbolName,
+                                const std::string &PrefixDef,
+                                const std::vector<std::string> &Options,
+                                size_t Target, const KernelCache &Cache) = 0;
+
+    //run the built kernel on every device of Bin with the launch of Spec and
+    //set the fastest local size of each device, or the one of Cache, see
+    //--autotune. false if the backend cannot run kernels.
+    virtual bool autotune(PlatformBin &Bin, size_t Target, const AutotuneSpec &Spec,
+                          const KernelCache &Cache) {
+        return false;
+    }
+};
+
+//return NULL if the backend has no targets
+CompileBackend *createOpenCLBackend(const CentaurusConfig &Config);
+CompileBackend *createSPIRBackend(const CentaurusConfig &Config);
+
+//the backend selected by --kernel-backend, by default the OpenCL driver and
+//SPIR if no OpenCL platform is installed
+CompileBackend *createCompileBackend(const CentaurusConfig &Config);
+
+//the _platform_bin of one built kernel, the device order of Entry is kept
+PlatformBin createPlatformBin(std::string &PlatformName, std::string &SymbolName,
+                              std::string &PrefixDef, KernelCacheEntry &Entry);
+
+//a failed build, compile() must not print or exit as other builds may be
+//running, Log is printed by CompileScheduler::run()
+PlatformBin createFailedPlatformBin(const std::string &Log);
+
+}
+
+#endif
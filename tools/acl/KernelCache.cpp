@@ -0,0 +1,329 @@
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <fstream>
+
+#include "Common.hpp"
+#include "KernelCache.hpp"
+
+using namespace llvm;
+using namespace acl;
+
+// bump on any change of the entry layout
+#define ACL_KERNEL_CACHE_MAGIC "ACL_KERNEL_CACHE_1"
+#define ACL_KERNEL_TUNE_MAGIC "ACL_KERNEL_TUNE_1"
+
+KernelCache::KernelCache(const CentaurusConfig &Config) :
+    CachePath(Config.KernelCachePath), Enabled(Config.UseKernelCache)
+{
+    if (!Enabled || CachePath.empty()) {
+        Enabled = false;
+        return;
+    }
+
+    if (std::error_code EC = sys::fs::create_directories(CachePath)) {
+        llvm::outs() << WARNING
+                     << "cannot create kernel cache directory '" << CachePath
+                     << "': " << EC.message() << "  -  disable kernel cache\n";
+        Enabled = false;
+    }
+}
+
+namespace {
+
+// the directories of the -I options, where the OpenCL compiler looks for the
+// included headers
+void getIncludeDirs(StringRef BuildOptions, std::vector<std::string> &Dirs) {
+    SmallVector<StringRef, 16> Options;
+    BuildOptions.split(Options," ",-1,false);
+    for (size_t i=0; i<Options.size(); ++i) {
+        if (!Options[i].startswith("-I"))
+            continue;
+        if (Options[i].size() > 2)
+            Dirs.push_back(Options[i].substr(2).str());
+        else if (i+1 < Options.size())
+            Dirs.push_back(Options[++i].str());
+    }
+}
+
+// return the file name of an '#include "file"' or '#include <file>' line
+StringRef getIncludedName(StringRef Line) {
+    Line = Line.ltrim();
+    if (!Line.startswith("#"))
+        return StringRef();
+    Line = Line.drop_front().ltrim();
+    if (!Line.startswith("include"))
+        return StringRef();
+    Line = Line.drop_front(7).ltrim();
+    if (Line.empty() || (Line[0] != '"' && Line[0] != '<'))
+        return StringRef();
+    size_t End = Line.find(Line[0] == '"' ? '"' : '>',1);
+    if (End == StringRef::npos)
+        return StringRef();
+    return Line.slice(1,End);
+}
+
+// hash the contents of every header Src includes, recursively, so that the
+// key changes when one of them does. The directive is not evaluated, a header
+// under a false #if is hashed as well: that only costs a spurious rebuild.
+void hashIncludes(StringRef Src, StringRef Dir, const std::vector<std::string> &IncludeDirs,
+                  StringSet<> &Visited, MD5 &Hash) {
+    const StringRef Separator("\0",1);
+
+    SmallVector<StringRef, 256> Lines;
+    Src.split(Lines,"\n",-1,false);
+    for (SmallVectorImpl<StringRef>::iterator
+             II = Lines.begin(), EE = Lines.end(); II != EE; ++II) {
+        StringRef Name = getIncludedName(*II);
+        if (Name.empty())
+            continue;
+
+        std::vector<std::string> Candidates;
+        if (sys::path::is_absolute(Name))
+            Candidates.push_back(Name.str());
+        else {
+            SmallString<256> Path(Dir);
+            sys::path::append(Path,Name);
+            Candidates.push_back(Path.str().str());
+            for (std::vector<std::string>::const_iterator
+                     DI = IncludeDirs.begin(), DE = IncludeDirs.end(); DI != DE; ++DI) {
+                Path = *DI;
+                sys::path::append(Path,Name);
+                Candidates.push_back(Path.str().str());
+            }
+        }
+
+        std::vector<std::string>::const_iterator CI = Candidates.begin(), CE = Candidates.end();
+        for (; CI != CE; ++CI)
+            if (sys::fs::is_regular_file(*CI))
+                break;
+
+        // an unknown header is left to the compiler, only its name is hashed
+        Hash.update(Separator);
+        if (CI == CE) {
+            Hash.update(Name);
+            continue;
+        }
+
+        Hash.update(*CI);
+        if (!Visited.insert(*CI).second)
+            continue;
+
+        ErrorOr<std::unique_ptr<MemoryBuffer> > Header = MemoryBuffer::getFile(*CI);
+        if (!Header)
+            continue;
+
+        Hash.update(Separator);
+        Hash.update((*Header)->getBuffer());
+        hashIncludes((*Header)->getBuffer(),sys::path::parent_path(*CI),IncludeDirs,Visited,Hash);
+    }
+}
+
+}
+
+std::string
+KernelCache::getEntryPath(const std::string &Key, const char *Ext) const {
+    SmallString<256> Path(CachePath);
+    sys::path::append(Path,Key + Ext);
+    return Path.str().str();
+}
+
+std::string
+KernelCache::getKey(const std::string &Src, const std::string &BuildOptions,
+                    const std::string &DeviceIdentity) const {
+    const StringRef Separator("\0",1);
+
+    MD5 Hash;
+    Hash.update(StringRef(ACL_KERNEL_CACHE_MAGIC));
+    Hash.update(Separator);
+    Hash.update(Src);
+    Hash.update(Separator);
+    Hash.update(BuildOptions);
+    Hash.update(Separator);
+    Hash.update(DeviceIdentity);
+
+    // the source is built from the current directory
+    std::vector<std::string> IncludeDirs;
+    getIncludeDirs(BuildOptions,IncludeDirs);
+    StringSet<> Visited;
+    hashIncludes(Src,".",IncludeDirs,Visited,Hash);
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+
+    SmallString<32> Key;
+    MD5::stringifyResult(Result,Key);
+    return Key.str().str();
+}
+
+bool
+KernelCache::lookup(const std::string &Key, KernelCacheEntry &Entry) const {
+    Entry.clear();
+    if (!Enabled)
+        return false;
+
+    std::ifstream src(getEntryPath(Key,".bin").c_str(), std::ios::in | std::ios::binary);
+    if (!src)
+        return false;
+
+    std::string Magic;
+    std::getline(src,Magic);
+    if (Magic.compare(ACL_KERNEL_CACHE_MAGIC) != 0)
+        return false;
+
+    size_t DeviceNum = 0;
+    src >> DeviceNum;
+    src.get();  // '\n'
+
+    for (size_t i=0; src && i<DeviceNum; ++i) {
+        size_t BinSize = 0;
+        size_t LogSize = 0;
+        PTXASInfo Info;
+        src >> BinSize >> LogSize
+            >> Info.arch >> Info.registers >> Info.gmem >> Info.stack_frame
+            >> Info.spill_stores >> Info.spill_loads >> Info.cmem;
+        src.get();  // '\n'
+
+        std::string Bin(BinSize,'\0');
+        src.read(&Bin[0],BinSize);
+        Info.Raw.resize(LogSize);
+        src.read(&Info.Raw[0],LogSize);
+
+        Entry.Binaries.push_back(Bin);
+        Entry.Info.push_back(Info);
+    }
+
+    if (!src || Entry.size() != DeviceNum) {
+        // truncated or corrupted entry, rebuild it
+        Entry.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void
+KernelCache::store(const std::string &Key, const KernelCacheEntry &Entry) const {
+    if (!Enabled)
+        return;
+
+    assert(Entry.Binaries.size() == Entry.Info.size());
+
+    // write to a temporary file and rename it, so that concurrent acl
+    // invocations never observe a partially written entry
+    int FD;
+    SmallString<256> TmpPath;
+    if (sys::fs::createUniqueFile(getEntryPath(Key,".bin") + "-%%%%%%.tmp",FD,TmpPath))
+        return;
+
+    {
+        raw_fd_ostream dst(FD,/*shouldClose=*/true);
+        dst << ACL_KERNEL_CACHE_MAGIC << "\n"
+            << Entry.size() << "\n";
+        for (size_t i=0; i<Entry.size(); ++i) {
+            const PTXASInfo &Info = Entry.Info[i];
+            dst << Entry.Binaries[i].size() << " " << Info.Raw.size() << " "
+                << Info.arch << " " << Info.registers << " " << Info.gmem << " "
+                << Info.stack_frame << " " << Info.spill_stores << " "
+                << Info.spill_loads << " " << Info.cmem << "\n";
+            dst << Entry.Binaries[i] << Info.Raw;
+        }
+        dst.close();
+        if (dst.has_error()) {
+            dst.clear_error();
+            sys::fs::remove(TmpPath);
+            return;
+        }
+    }
+
+    if (sys::fs::rename(TmpPath,getEntryPath(Key,".bin")))
+        sys::fs::remove(TmpPath);
+}
+
+std::string
+KernelCache::getTuneKey(const std::string &Bin, const std::string &Launch,
+                        const std::string &DeviceIdentity) const {
+    const StringRef Separator("\0",1);
+
+    MD5 Hash;
+    Hash.update(StringRef(ACL_KERNEL_TUNE_MAGIC));
+    Hash.update(Separator);
+    Hash.update(Bin);
+    Hash.update(Separator);
+    Hash.update(Launch);
+    Hash.update(Separator);
+    Hash.update(DeviceIdentity);
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+
+    SmallString<32> Key;
+    MD5::stringifyResult(Result,Key);
+    return Key.str().str();
+}
+
+bool
+KernelCache::lookupLocalSize(const std::string &Key, std::vector<size_t> &Local) const {
+    Local.clear();
+    if (!Enabled)
+        return false;
+
+    std::ifstream src(getEntryPath(Key,".tune").c_str());
+    if (!src)
+        return false;
+
+    std::string Magic;
+    std::getline(src,Magic);
+    if (Magic.compare(ACL_KERNEL_TUNE_MAGIC) != 0)
+        return false;
+
+    size_t Dims = 0;
+    src >> Dims;
+    for (size_t d=0; src && d<Dims && d<3; ++d) {
+        size_t Size = 0;
+        src >> Size;
+        Local.push_back(Size);
+    }
+
+    if (!src || !Dims || Local.size() != Dims) {
+        Local.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void
+KernelCache::storeLocalSize(const std::string &Key, const std::vector<size_t> &Local) const {
+    if (!Enabled)
+        return;
+
+    // see store()
+    int FD;
+    SmallString<256> TmpPath;
+    if (sys::fs::createUniqueFile(getEntryPath(Key,".tune") + "-%%%%%%.tmp",FD,TmpPath))
+        return;
+
+    {
+        raw_fd_ostream dst(FD,/*shouldClose=*/true);
+        dst << ACL_KERNEL_TUNE_MAGIC << "\n"
+            << Local.size();
+        for (size_t d=0; d<Local.size(); ++d)
+            dst << " " << Local[d];
+        dst << "\n";
+        dst.close();
+        if (dst.has_error()) {
+            dst.clear_error();
+            sys::fs::remove(TmpPath);
+            return;
+        }
+    }
+
+    if (sys::fs::rename(TmpPath,getEntryPath(Key,".tune")))
+        sys::fs::remove(TmpPath);
+}
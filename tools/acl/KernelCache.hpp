@@ -0,0 +1,63 @@
+#ifndef ACL_KERNEL_CACHE_HPP_
+#define ACL_KERNEL_CACHE_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+#include "CentaurusConfig.hpp"
+
+namespace acl {
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Kernel Cache
+///////////////////////////////////////////////////////////////////////////////
+
+//one cached build of a kernel for every device of a platform,
+//in the order clGetDeviceIDs() returned them
+struct KernelCacheEntry {
+    std::vector<std::string> Binaries;
+    std::vector<PTXASInfo> Info;
+
+    size_t size() const { return Binaries.size(); }
+    void clear() { Binaries.clear(); Info.clear(); }
+};
+
+//acl owned persistent cache of OpenCL kernel binaries
+//
+//Entries are content addressed: the key is the hash of the kernel source,
+//the contents of the headers it includes, the build options and the identity
+//of the platform and its devices, so a kernel is rebuilt only if one of them
+//has changed.
+class KernelCache {
+private:
+    std::string CachePath;
+    bool Enabled;
+
+    std::string getEntryPath(const std::string &Key, const char *Ext) const;
+
+public:
+    explicit KernelCache(const CentaurusConfig &Config);
+
+    bool isEnabled() const { return Enabled; }
+
+    std::string getKey(const std::string &Src, const std::string &BuildOptions,
+                       const std::string &DeviceIdentity) const;
+
+    //return true on cache hit
+    bool lookup(const std::string &Key, KernelCacheEntry &Entry) const;
+    void store(const std::string &Key, const KernelCacheEntry &Entry) const;
+
+    //the local size --autotune chose for a device binary, a launch and a
+    //device, so a rebuild of the same kernel chooses the same one
+    std::string getTuneKey(const std::string &Bin, const std::string &Launch,
+                           const std::string &DeviceIdentity) const;
+
+    //return true on cache hit
+    bool lookupLocalSize(const std::string &Key, std::vector<size_t> &Local) const;
+    void storeLocalSize(const std::string &Key, const std::vector<size_t> &Local) const;
+};
+
+}
+
+#endif
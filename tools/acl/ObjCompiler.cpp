@@ -0,0 +1,281 @@
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/CodeGen/BackendUtil.h"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Driver/Compilation.h"
+#include "clang/Driver/Driver.h"
+#include "clang/Driver/Job.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/TextDiagnosticBuffer.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Common.hpp"
+#include "ObjCompiler.hpp"
+
+using namespace llvm;
+using namespace clang;
+using namespace acl;
+
+namespace {
+
+// cc1_main() without the -mllvm and plugin handling
+bool createInstance(const std::vector<std::string> &Args, CompilerInstance &Clang) {
+    std::vector<const char *> Argv;
+    for (std::vector<std::string>::const_iterator
+             II = Args.begin(), EE = Args.end(); II != EE; ++II)
+        Argv.push_back(II->c_str());
+
+    IntrusiveRefCntPtr<DiagnosticIDs> DiagID(new DiagnosticIDs());
+    IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+    TextDiagnosticBuffer *DiagsBuffer = new TextDiagnosticBuffer;
+    DiagnosticsEngine Diags(DiagID, &*DiagOpts, DiagsBuffer);
+
+    bool Success = CompilerInvocation::CreateFromArgs(Clang.getInvocation(),
+                                                      Argv.data(), Argv.data() + Argv.size(),
+                                                      Diags);
+
+    Clang.createDiagnostics();
+    if (!Clang.hasDiagnostics())
+        return false;
+
+    DiagsBuffer->FlushDiagnostics(Clang.getDiagnostics());
+
+    return Success;
+}
+
+// code generation of an already optimised module, only the backend passes
+bool emitObject(CompilerInstance &Clang, StringRef TDesc, Module *M, const std::string &Object) {
+    std::error_code EC;
+    raw_fd_ostream OS(Object,EC,sys::fs::F_None);
+    if (EC) {
+        llvm::errs() << ERROR << "cannot open '" << Object << "': " << EC.message() << "\n";
+        return false;
+    }
+
+    Clang.getCodeGenOpts().DisableLLVMOpts = true;
+    EmitBackendOutput(Clang.getDiagnostics(),Clang.getCodeGenOpts(),Clang.getTargetOpts(),
+                      Clang.getLangOpts(),TDesc,M,Backend_EmitObj,&OS);
+    return !Clang.getDiagnostics().hasErrorOccurred();
+}
+
+std::string getBitcodeFile(const std::string &Object) {
+    return RemoveDotExtension(Object) + ".bc";
+}
+
+}
+
+ObjectCompiler::ObjectCompiler(const CentaurusConfig &Config) : Config(Config) {
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmPrinters();
+    llvm::InitializeAllAsmParsers();
+}
+
+int
+ObjectCompiler::addSources(const SmallVectorImpl<const char *> &cli,
+                           const std::vector<std::string> &Sources) {
+    using namespace clang::driver;
+
+    IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+    TextDiagnosticPrinter *DiagClient =
+        new TextDiagnosticPrinter(llvm::errs(), &*DiagOpts);
+    IntrusiveRefCntPtr<DiagnosticIDs> DiagID(new DiagnosticIDs());
+    DiagnosticsEngine Diags(DiagID, &*DiagOpts, DiagClient);
+
+    Driver TheDriver(Config.ClangPath, llvm::sys::getDefaultTargetTriple(), Diags);
+    TheDriver.setTitle("centaurus");
+
+    for (std::vector<std::string>::const_iterator
+             II = Sources.begin(), EE = Sources.end(); II != EE; ++II) {
+        CC1Job Job;
+        Job.Source = *II;
+        Job.Object = GetBasename(RemoveDotExtension(*II) + ".o");
+
+        SmallVector<const char *, 256> Args;
+        Args.push_back(Config.ClangPath.c_str());
+        Args.append(cli.begin(),cli.end());
+        Args.push_back(Job.Source.c_str());
+        Args.push_back("-o");
+        Args.push_back(Job.Object.c_str());
+
+        std::unique_ptr<Compilation> C(TheDriver.BuildCompilation(Args));
+        if (!C.get() || C->containsError())
+            return 1;
+
+        const JobList &JL = C->getJobs();
+        if (JL.size() != 1)
+            return 1;
+
+        const Command &Cmd = *JL.begin();
+        const llvm::opt::ArgStringList &CC1Args = Cmd.getArguments();
+        if (CC1Args.empty() || StringRef(CC1Args.front()).compare("-cc1") != 0)
+            return 1;
+
+        for (llvm::opt::ArgStringList::const_iterator
+                 AI = CC1Args.begin() + 1, AE = CC1Args.end(); AI != AE; ++AI) {
+            // we run many compilations in this process, do not leak them
+            if (StringRef(*AI).compare("-disable-free") == 0)
+                continue;
+            Job.Args.push_back(*AI);
+        }
+
+        Jobs.push_back(Job);
+    }
+
+    return 0;
+}
+
+template<typename ActionFn>
+int
+ObjectCompiler::run(ActionFn Action) {
+    auto RunJob = [&](size_t i) {
+        CompilerInstance Clang;
+        if (!createInstance(Jobs[i].Args,Clang))
+            return false;
+        return Action(i,Clang);
+    };
+
+    size_t Parallel = Config.Jobs ? Config.Jobs : 1;
+    if (Parallel > Jobs.size())
+        Parallel = Jobs.size();
+
+    int Failed = 0;
+    if (Parallel <= 1) {
+        for (size_t i=0; i<Jobs.size(); ++i)
+            if (!RunJob(i))
+                ++Failed;
+        return Failed;
+    }
+
+    std::map<pid_t,size_t> Running;
+    size_t Next = 0;
+    while (Next < Jobs.size() || !Running.empty()) {
+        if (!Failed && Next < Jobs.size() && Running.size() < Parallel) {
+            // do not duplicate buffered output in the worker
+            llvm::outs().flush();
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                llvm::errs() << ERROR << "fork() failed\n";
+                ++Failed;
+                continue;
+            }
+            if (!pid) {
+                int Res = RunJob(Next) ? 0 : 1;
+                llvm::outs().flush();
+                _exit(Res);
+            }
+
+            Running[pid] = Next++;
+            continue;
+        }
+
+        if (Running.empty())
+            break;
+
+        int status;
+        pid_t pid = waitpid(-1,&status,0);
+        if (pid < 0) {
+            llvm::errs() << ERROR << "waitpid() failed\n";
+            return Failed + Running.size();
+        }
+
+        std::map<pid_t,size_t>::iterator PI = Running.find(pid);
+        if (PI == Running.end())
+            continue;
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            llvm::errs() << ERROR << "cannot compile '" << Jobs[PI->second].Source << "'\n";
+            ++Failed;
+        }
+        Running.erase(PI);
+    }
+
+    return Failed;
+}
+
+int
+ObjectCompiler::emitObjects(std::vector<std::string> &Objects) {
+    // the cc1 arguments already ask for the object, optimise and emit it in
+    // one pipeline
+    int Res = run([](size_t, CompilerInstance &Clang) {
+            EmitObjAction Act;
+            return Clang.ExecuteAction(Act);
+        });
+
+    for (std::vector<CC1Job>::iterator
+             II = Jobs.begin(), EE = Jobs.end(); II != EE; ++II)
+        Objects.push_back(II->Object);
+
+    return Res;
+}
+
+int
+ObjectCompiler::emitSingleObject(const std::string &Object) {
+    if (Jobs.empty())
+        return 1;
+
+    // the workers are separate processes, the optimised modules come back
+    // through bitcode files next to the objects
+    int Res = run([this](size_t i, CompilerInstance &Clang) {
+            Clang.getFrontendOpts().OutputFile = getBitcodeFile(Jobs[i].Object);
+            EmitBCAction Act;
+            return Clang.ExecuteAction(Act);
+        });
+
+    LLVMContext Context;
+    std::unique_ptr<Module> Composite;
+    for (size_t i=0; !Res && i<Jobs.size(); ++i) {
+        const std::string BCFile = getBitcodeFile(Jobs[i].Object);
+        ErrorOr<std::unique_ptr<MemoryBuffer> > Buffer = MemoryBuffer::getFile(BCFile);
+        if (std::error_code EC = Buffer.getError()) {
+            llvm::errs() << ERROR << "cannot open '" << BCFile << "': " << EC.message() << "\n";
+            Res = 1;
+            break;
+        }
+
+        ErrorOr<std::unique_ptr<Module> > M =
+            parseBitcodeFile((*Buffer)->getMemBufferRef(),Context);
+        if (std::error_code EC = M.getError()) {
+            llvm::errs() << ERROR << "cannot read module of '" << Jobs[i].Source << "': "
+                         << EC.message() << "\n";
+            Res = 1;
+        }
+        else if (!Composite)
+            Composite = std::move(*M);
+        else if (Linker::LinkModules(Composite.get(),M->get())) {
+            llvm::errs() << ERROR << "cannot link module of '" << Jobs[i].Source << "'\n";
+            Res = 1;
+        }
+    }
+
+    for (std::vector<CC1Job>::iterator
+             II = Jobs.begin(), EE = Jobs.end(); II != EE; ++II)
+        sys::fs::remove(getBitcodeFile(II->Object));
+
+    if (Res)
+        return Res;
+
+    // code generation options of the first source file, the modules are
+    // optimised already
+    CompilerInstance Clang;
+    if (!createInstance(Jobs.front().Args,Clang))
+        return 1;
+
+    return !emitObject(Clang,Composite->getDataLayoutStr(),Composite.get(),Object);
+}
@@ -0,0 +1,57 @@
+#ifndef ACL_OBJ_COMPILER_HPP_
+#define ACL_OBJ_COMPILER_HPP_
+
+#include "llvm/ADT/SmallVector.h"
+
+#include <string>
+#include <vector>
+
+#include "CentaurusConfig.hpp"
+
+namespace acl {
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Object Compiler
+///////////////////////////////////////////////////////////////////////////////
+
+//in-process replacement of 'clang -c' for the source files acl generates
+//
+//The driver runs once per source file only to get its cc1 command line, the
+//cc1 jobs then run in up to -j forked processes, each one in its own
+//CompilerInstance. They cannot share this process: the backend parses the
+//global LLVM cl::opts every time it runs.
+class ObjectCompiler {
+private:
+    struct CC1Job {
+        std::string Source;
+        std::string Object;
+        std::vector<std::string> Args;  //cc1 arguments after "-cc1"
+    };
+
+    const CentaurusConfig &Config;
+    std::vector<CC1Job> Jobs;
+
+    //run Action(i,Clang) for every job, in a worker process if -j > 1
+    template<typename ActionFn>
+    int run(ActionFn Action);
+
+public:
+    explicit ObjectCompiler(const CentaurusConfig &Config);
+
+    //return non zero if the driver flags of cli do not lead to exactly one
+    //cc1 job per source file (e.g. -save-temps), use the external clang then
+    int addSources(const llvm::SmallVectorImpl<const char *> &cli,
+                   const std::vector<std::string> &Sources);
+
+    bool empty() const { return Jobs.empty(); }
+
+    //one object per source file, in the current directory
+    int emitObjects(std::vector<std::string> &Objects);
+
+    //link all the source files at IR level and emit one relocatable object
+    int emitSingleObject(const std::string &Object);
+};
+
+}
+
+#endif
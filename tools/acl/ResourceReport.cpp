@@ -0,0 +1,208 @@
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "Common.hpp"
+#include "ResourceReport.hpp"
+
+using namespace llvm;
+using namespace acl;
+
+namespace {
+
+struct ResourceRecord {
+    std::string File;
+    std::string Kernel;
+    std::string Variant;
+    std::string Platform;
+    size_t Device;
+    size_t WorkGroupSize;
+    PTXASInfo Info;
+};
+
+// per SM limits of an NVIDIA compute capability
+struct SMLimits {
+    size_t MaxWarps;
+    size_t MaxBlocks;
+    size_t Registers;
+    size_t RegisterUnit;  //per warp allocation granularity
+};
+
+SMLimits getSMLimits(size_t arch) {
+    SMLimits L;
+    if (arch < 30)      { L.MaxWarps = 48; L.MaxBlocks =  8; L.Registers = 32768; L.RegisterUnit =  64; }
+    else if (arch < 50) { L.MaxWarps = 64; L.MaxBlocks = 16; L.Registers = 65536; L.RegisterUnit = 256; }
+    else if (arch < 75) { L.MaxWarps = 64; L.MaxBlocks = 32; L.Registers = 65536; L.RegisterUnit = 256; }
+    else if (arch < 80) { L.MaxWarps = 32; L.MaxBlocks = 16; L.Registers = 65536; L.RegisterUnit = 256; }
+    else if (arch < 86) { L.MaxWarps = 64; L.MaxBlocks = 32; L.Registers = 65536; L.RegisterUnit = 256; }
+    else                { L.MaxWarps = 48; L.MaxBlocks = 16; L.Registers = 65536; L.RegisterUnit = 256; }
+    return L;
+}
+
+bool readParts(const std::vector<std::string> &RewrittenFiles, std::vector<ResourceRecord> &Records) {
+    for (std::vector<std::string>::const_iterator
+             II = RewrittenFiles.begin(), EE = RewrittenFiles.end(); II != EE; ++II) {
+        std::string Part = getResourceReportPart(*II);
+        std::ifstream src(Part.c_str());
+        if (!src)
+            continue;
+
+        for (std::string line; std::getline(src,line);) {
+            std::stringstream IS(line);
+            ResourceRecord R;
+            std::getline(IS,R.File,'\t');
+            std::getline(IS,R.Kernel,'\t');
+            std::getline(IS,R.Variant,'\t');
+            std::getline(IS,R.Platform,'\t');
+            IS >> R.Device >> R.WorkGroupSize
+               >> R.Info.arch >> R.Info.registers >> R.Info.gmem >> R.Info.stack_frame
+               >> R.Info.spill_stores >> R.Info.spill_loads >> R.Info.cmem;
+            if (!IS)
+                return false;
+            Records.push_back(R);
+        }
+        src.close();
+        unlink(Part.c_str());
+    }
+    return true;
+}
+
+}
+
+std::string
+acl::getResourceReportPart(const std::string &RewrittenFile) {
+    return RemoveDotExtension(RewrittenFile) + "_ocl.resources";
+}
+
+void
+acl::writeResourceReportPart(const std::string &RewrittenFile, const std::string &Variant,
+                             const std::vector<KernelRefDef *> &Kernels, bool Append) {
+    std::ofstream dst(getResourceReportPart(RewrittenFile).c_str(),
+                      Append ? std::ios::out | std::ios::app : std::ios::out);
+
+    for (std::vector<KernelRefDef *>::const_iterator
+             KI = Kernels.begin(), KE = Kernels.end(); KI != KE; ++KI) {
+        KernelRefDef *Kernel = *KI;
+
+        std::vector<size_t> WorkGroupSizes(Kernel->WorkGroupSizes);
+        if (WorkGroupSizes.empty())
+            WorkGroupSizes.push_back(0);
+
+        for (std::vector<PlatformBin>::iterator
+                 PI = Kernel->Binary.begin(), PE = Kernel->Binary.end(); PI != PE; ++PI) {
+            for (size_t Device = 0; Device < PI->size(); ++Device) {
+                const PTXASInfo &Info = (*PI)[Device].Log;
+                for (std::vector<size_t>::iterator
+                         WI = WorkGroupSizes.begin(), WE = WorkGroupSizes.end(); WI != WE; ++WI) {
+                    dst << RewrittenFile << "\t" << Kernel->DeviceCode.NameRef << "\t"
+                        << Variant << "\t" << PI->PlatformName << "\t"
+                        << Device << " " << *WI << " "
+                        << Info.arch << " " << Info.registers << " " << Info.gmem << " "
+                        << Info.stack_frame << " " << Info.spill_stores << " "
+                        << Info.spill_loads << " " << Info.cmem << "\n";
+                }
+            }
+        }
+    }
+    dst.flush();
+}
+
+double
+acl::estimateOccupancy(const PTXASInfo &Info, size_t WorkGroupSize) {
+    if (!Info.arch || !WorkGroupSize)
+        return -1;
+
+    const SMLimits L = getSMLimits(Info.arch);
+
+    const size_t Warps = (WorkGroupSize + 31) / 32;
+    if (Warps > L.MaxWarps)
+        return 0;
+
+    size_t Blocks = std::min(L.MaxBlocks, L.MaxWarps / Warps);
+    if (Info.registers) {
+        const size_t RegsPerWarp = (Info.registers * 32 + L.RegisterUnit - 1) / L.RegisterUnit * L.RegisterUnit;
+        Blocks = std::min(Blocks, L.Registers / (RegsPerWarp * Warps));
+    }
+
+    return (double)(Blocks * Warps) / L.MaxWarps;
+}
+
+int
+acl::writeResourceReport(const std::string &ReportFile,
+                         const std::vector<std::string> &RewrittenFiles) {
+    std::vector<ResourceRecord> Records;
+    if (!readParts(RewrittenFiles,Records)) {
+        llvm::outs() << ERROR << "corrupted resource report of a translation unit\n";
+        return 1;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream dst(ReportFile,EC,sys::fs::F_Text);
+    if (EC) {
+        llvm::outs() << ERROR << "cannot open '" << ReportFile << "': " << EC.message() << "\n";
+        return 1;
+    }
+
+    const bool CSV = GetDotExtension(ReportFile).compare(".csv") == 0;
+
+    if (CSV)
+        dst << "file,kernel,variant,platform,device,arch,registers,gmem,stack_frame,"
+            << "spill_stores,spill_loads,cmem,spills,local_size,occupancy\n";
+    else
+        dst << "{\n  \"kernels\": [";
+
+    for (std::vector<ResourceRecord>::iterator
+             II = Records.begin(), EE = Records.end(); II != EE; ++II) {
+        const ResourceRecord &R = *II;
+        const PTXASInfo &Info = R.Info;
+        const bool Spills = Info.spill_stores || Info.spill_loads;
+        const double Occupancy = estimateOccupancy(Info,R.WorkGroupSize);
+
+        std::string LocalSize = R.WorkGroupSize ? toString(R.WorkGroupSize) : std::string();
+        std::string OccupancyStr;
+        if (Occupancy >= 0) {
+            raw_string_ostream OS(OccupancyStr);
+            OS << format("%.2f",Occupancy);
+            OS.flush();
+        }
+
+        if (CSV) {
+            dst << R.File << "," << R.Kernel << "," << R.Variant << "," << R.Platform << ","
+                << R.Device << "," << Info.arch << "," << Info.registers << ","
+                << Info.gmem << "," << Info.stack_frame << "," << Info.spill_stores << ","
+                << Info.spill_loads << "," << Info.cmem << "," << (Spills ? 1 : 0) << ","
+                << LocalSize << "," << OccupancyStr << "\n";
+            continue;
+        }
+
+        dst << (II == Records.begin() ? "\n" : ",\n")
+            << "    {\"file\": " << quoteJSON(R.File)
+            << ", \"kernel\": " << quoteJSON(R.Kernel)
+            << ", \"variant\": " << quoteJSON(R.Variant)
+            << ", \"platform\": " << quoteJSON(R.Platform)
+            << ", \"device\": " << R.Device
+            << ", \"arch\": " << Info.arch
+            << ", \"registers\": " << Info.registers
+            << ", \"gmem\": " << Info.gmem
+            << ", \"stack_frame\": " << Info.stack_frame
+            << ", \"spill_stores\": " << Info.spill_stores
+            << ", \"spill_loads\": " << Info.spill_loads
+            << ", \"cmem\": " << Info.cmem
+            << ", \"spills\": " << (Spills ? "true" : "false")
+            << ", \"local_size\": " << (LocalSize.size() ? LocalSize : "null")
+            << ", \"occupancy\": " << (OccupancyStr.size() ? OccupancyStr : "null")
+            << "}";
+    }
+
+    if (!CSV)
+        dst << "\n  ]\n}\n";
+
+    llvm::outs() << "Write resource report   : '" << ReportFile << "'  -  "
+                 << Records.size() << " record(s)\n";
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef ACL_RESOURCE_REPORT_HPP_
+#define ACL_RESOURCE_REPORT_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Types.hpp"
+
+namespace acl {
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Resource Report
+///////////////////////////////////////////////////////////////////////////////
+
+//Stage1 writes the part of the --resource-report of every input file next to
+//the rewritten file, the driver merges the parts in the order of the inputs.
+
+std::string getResourceReportPart(const std::string &RewrittenFile);
+
+//one line per kernel x platform x device x work-group size of its tasks
+void writeResourceReportPart(const std::string &RewrittenFile, const std::string &Variant,
+                             const std::vector<KernelRefDef *> &Kernels, bool Append);
+
+//JSON, or CSV if ReportFile ends with ".csv"
+int writeResourceReport(const std::string &ReportFile,
+                        const std::vector<std::string> &RewrittenFiles);
+
+//active warps / max warps per SM for NVIDIA devices, negative if unknown
+double estimateOccupancy(const PTXASInfo &Info, size_t WorkGroupSize);
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/Version.h"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Lex/PreprocessorOptions.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Common.hpp"
+#include "CompileBackend.hpp"
+#include "KernelCache.hpp"
+#include "TimeReport.hpp"
+
+using namespace llvm;
+using namespace clang;
+using namespace acl;
+
+namespace {
+
+const char *SPIRTriple = "spir64-unknown-unknown";
+
+// The kernels are compiled to SPIR bitcode by the OpenCL front end of acl,
+// the OpenCL builtins are declared by the libclc headers we install.
+class SPIRBackend : public CompileBackend {
+private:
+    std::string IncludePath;
+
+    bool build(const std::string &Src, const std::vector<std::string> &Options,
+               std::string &Bitcode, std::string &Log) const;
+
+public:
+    explicit SPIRBackend(const CentaurusConfig &Config) : IncludePath(Config.IncludePath) {}
+
+    const char *getName() const { return "SPIR"; }
+    size_t getNumTargets() const { return 1; }
+
+    PlatformBin compile(const std::string &Src, const std::string &SymbolName,
+                        const std::string &PrefixDef,
+                        const std::vector<std::string> &Options,
+                        size_t Target, const KernelCache &Cache);
+};
+
+bool
+SPIRBackend::build(const std::string &Src, const std::vector<std::string> &Options,
+                   std::string &Bitcode, std::string &Log) const {
+    static const char *InputName = "__acl_kernel.cl";
+
+    std::vector<std::string> Args;
+    Args.push_back("-triple");
+    Args.push_back(SPIRTriple);
+    Args.push_back("-cl-std=CL1.2");
+    Args.push_back("-I");
+    Args.push_back(IncludePath);
+    Args.push_back("-include");
+    Args.push_back("clc/clc.h");
+    Args.push_back("-Dcl_clang_storage_class_specifiers");
+
+    // keep only the options of the OpenCL front end
+    for (std::vector<std::string>::const_iterator
+             II = Options.begin(), EE = Options.end(); II != EE; ++II) {
+        StringRef Option(*II);
+        if (Option.startswith("-D") || Option.startswith("-U") ||
+            Option.startswith("-I") || Option.startswith("-cl-"))
+            Args.push_back(*II);
+    }
+
+    Args.push_back("-x");
+    Args.push_back("cl");
+    Args.push_back(InputName);
+
+    std::vector<const char *> Argv;
+    for (std::vector<std::string>::const_iterator
+             II = Args.begin(), EE = Args.end(); II != EE; ++II)
+        Argv.push_back(II->c_str());
+
+    raw_string_ostream LogOS(Log);
+
+    IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+    TextDiagnosticPrinter *DiagClient = new TextDiagnosticPrinter(LogOS, &*DiagOpts);
+    IntrusiveRefCntPtr<DiagnosticIDs> DiagID(new DiagnosticIDs());
+    IntrusiveRefCntPtr<DiagnosticsEngine> Diags(new DiagnosticsEngine(DiagID, &*DiagOpts, DiagClient));
+
+    CompilerInstance Clang;
+    bool Success = CompilerInvocation::CreateFromArgs(Clang.getInvocation(),
+                                                      Argv.data(), Argv.data() + Argv.size(),
+                                                      *Diags);
+    Clang.setDiagnostics(Diags.get());
+
+    // the source never touches the file system
+    Clang.getPreprocessorOpts().addRemappedFile(InputName,
+                                                MemoryBuffer::getMemBufferCopy(Src,InputName).release());
+
+    LLVMContext Context;
+    EmitLLVMOnlyAction Act(&Context);
+    if (Success)
+        Success = Clang.ExecuteAction(Act);
+
+    std::unique_ptr<Module> M;
+    if (Success)
+        M = Act.takeModule();
+
+    if (M) {
+        raw_string_ostream OS(Bitcode);
+        WriteBitcodeToFile(M.get(),OS);
+        OS.flush();
+    }
+
+    LogOS.flush();
+    return M != nullptr;
+}
+
+PlatformBin
+SPIRBackend::compile(const std::string &Src, const std::string &SymbolName,
+                     const std::string &PrefixDef,
+                     const std::vector<std::string> &Options,
+                     size_t Target, const KernelCache &Cache) {
+    // the SPIR binaries are not specific to a platform
+    std::string PlatformName = "UNKNOWN";
+    std::string Symbol = SymbolName;
+    std::string Prefix = PrefixDef;
+
+    std::string BuildOptions;
+    for (std::vector<std::string>::const_iterator
+             II = Options.begin(), EE = Options.end(); II != EE; ++II)
+        BuildOptions += *II + " ";
+
+    const std::string CacheKey =
+        Cache.getKey(Src,BuildOptions,std::string(SPIRTriple) + " " + getClangFullVersion());
+    KernelCacheEntry Entry;
+    if (Cache.lookup(CacheKey,Entry) && Entry.size() == 1)
+        return createPlatformBin(PlatformName,Symbol,Prefix,Entry);
+
+    std::string Bitcode;
+    std::string Log;
+    bool Built;
+    {
+        TimeRegion Time("build",PlatformName + " " + Symbol);
+        Built = build(Src,Options,Bitcode,Log);
+    }
+    if (!Built)
+        return createFailedPlatformBin(std::string(DEBUG) + Src + "\n"
+                                       + DEBUG + "LOG:\n" + Log + "\n");
+
+    Entry.Binaries.push_back(Bitcode);
+    Entry.Info.push_back(PTXASInfo(Log,PlatformName));
+    Cache.store(CacheKey,Entry);
+
+    return createPlatformBin(PlatformName,Symbol,Prefix,Entry);
+}
+
+}
+
+CompileBackend *
+acl::createSPIRBackend(const CentaurusConfig &Config) {
+    return new SPIRBackend(Config);
+}
@@ -1,11 +1,20 @@
 #include "Stages.hpp"
 #include "Common.hpp"
+#include "ResourceReport.hpp"
+#include "CodeEmitter.hpp"
+#include "TimeReport.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <map>
 
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
 
 #include "clang/Sema/SemaDiagnostic.h"
 
@@ -23,8 +32,22 @@ struct KernelDepInfo {
 };
 llvm::DenseMap<FunctionDecl *, struct KernelDepInfo> DepCFG;
 
+// the call dependencies of a function, callers before callees, shared by all
+// the kernels and variants of the function, see KernelRefDef::findCallDeps()
+llvm::DenseMap<FunctionDecl *, SmallVector<FunctionDecl *,8> > CallDepsCache;
+// the bottom-up position of the SCC of a function in the call graph
+llvm::DenseMap<const Decl *, unsigned> CallGraphOrder;
+
 acl::CentaurusConfig ACLConfig;
 
+// the generated files are named after the main file Stage1 rewrites
+std::string MainFileName;
+std::string getMainFileName(SourceManager &SM) {
+    if (MainFileName.size())
+        return MainFileName;
+    return SM.getFileEntryForID(SM.getMainFileID())->getName();
+}
+
 std::vector<std::string> APIHeaderVector;
 bool TrackThisHeader(std::string &Header) {
     for (std::vector<std::string>::iterator
@@ -38,8 +61,57 @@ bool TrackThisHeader(std::string &Header) {
 llvm::DenseMap<FunctionDecl *,KernelRefDef *> KernelAccuratePool;
 llvm::DenseMap<FunctionDecl *,KernelRefDef *> KernelApproximatePool;
 llvm::DenseMap<FunctionDecl *,KernelRefDef *> KernelEvaluatePool;
+std::map<std::string,KernelRefDef *> KernelFusedPool;
+// the approximate kernels generated by perforate() and relaxed_math
+std::map<std::string,KernelRefDef *> KernelGeneratedPool;
+// the kernels specialised for the constant arguments of a call site, see
+// --specialize-kernels
+std::map<std::string,KernelRefDef *> KernelSpecializedPool;
+// the CPU variants of the accurate kernels, see --cpu-vector-width
+llvm::DenseMap<FunctionDecl *,KernelRefDef *> KernelVectorPool;
+unsigned KernelNameUID = 0;  //unique kernel identifier of the translation unit
+
+// adjacent tasks found by Stage1_ASTVisitor::VisitCompoundStmt(), both the
+// first and the second task of a fusion map to it
+std::map<DirectiveInfo *,TaskFusion> TaskFusions;
+
+// data clause args whose buffer stays on the device, see --elide-transfers
+std::map<Arg *,ClauseKind> TransferDowngrades;
+
+// an entry of the static site table, indexed by the site ID,
+// see --static-task-sites
+struct TaskSite {
+    //the fields of the site
+    std::string Init;
+
+    //the task directives of the site, two for a fused task
+    SmallVector<DirectiveInfo *,2> Directives;
+    FunctionDecl *Function;
+    bool InLoop;
+
+    //filled by analyzeTaskDeps()
+    std::vector<unsigned> Deps;
+    bool DynamicDeps;
+
+    TaskSite(const std::string &Init) :
+        Init(Init), Function(0), InLoop(false), DynamicDeps(true) {}
+};
+std::vector<TaskSite> TaskSites;
+
+// a task that is the whole body of a counted loop, found by
+// Stage1_ASTVisitor::TraverseForStmt(), see --batch-tasks
+struct TaskRange {
+    ForStmt *ForLoop;
+    VarDecl *Var;
+    //the loop header and the max number of iterations
+    std::string Header;
+    std::string MaxNum;
+};
+std::map<DirectiveInfo *,TaskRange> TaskRanges;
+
+CompileScheduler KernelScheduler;
 
-std::vector<std::pair<std::string, std::string> > NewOpenCLFiles;
+std::vector<std::pair<std::string, const KernelRefDef *> > NewOpenCLFiles;
 
 std::string printUserType(const Type *Ty) {
     std::string DeclStr;
@@ -78,16 +150,24 @@ std::string printPTXLog(const PTXASInfo &info) {
     return OS.str();
 }
 
-#if 0
+// Tag of the global symbols emitted for the current translation unit, kernels
+// with the same name in different input files must not clash at 'ld -r'.
+static std::string getTUSymbolTag(clang::ASTContext *Context) {
+    SourceManager &SM = Context->getSourceManager();
+    std::string Tag = GetBasename(RemoveDotExtension(getMainFileName(SM)));
+    for (std::string::iterator II = Tag.begin(), EE = Tag.end(); II != EE; ++II)
+        if (!isalnum((unsigned char)*II))
+            *II = '_';
+    return Tag;
+}
+
 static std::string getUniqueKernelName(const std::string Base) {
-    static int UID = 0;  //unique kernel identifier
     std::string ID;
     raw_string_ostream OS(ID);
-    OS << Base << "_" << UID;
-    UID++;
+    OS << Base << "_" << KernelNameUID;
+    KernelNameUID++;
     return OS.str();
 }
-#endif
 
 struct GeometrySrc : ObjRefDef {
 private:
@@ -99,10 +179,575 @@ public:
     }
 };
 
+////////////////////////////////////////////////////////////////////////////////
+////    Loop Perforation
+////////////////////////////////////////////////////////////////////////////////
+
+// the counter of 'i++', 'i--', 'i += s' and 'i -= s'
+static VarDecl *getLoopCounter(Expr *Inc) {
+    Expr *Counter = 0;
+    if (UnaryOperator *UO = dyn_cast<UnaryOperator>(Inc)) {
+        if (UO->isIncrementDecrementOp())
+            Counter = UO->getSubExpr();
+    }
+    else if (CompoundAssignOperator *CAO = dyn_cast<CompoundAssignOperator>(Inc)) {
+        if (CAO->getOpcode() == BO_AddAssign || CAO->getOpcode() == BO_SubAssign)
+            Counter = CAO->getLHS();
+    }
+    DeclRefExpr *DRE = dyn_cast_or_null<DeclRefExpr>(Counter ? Counter->IgnoreParenImpCasts() : 0);
+    return DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : 0;
+}
+
+static bool isDecrement(Expr *Inc) {
+    if (UnaryOperator *UO = dyn_cast<UnaryOperator>(Inc))
+        return UO->isDecrementOp();
+    if (CompoundAssignOperator *CAO = dyn_cast<CompoundAssignOperator>(Inc))
+        return CAO->getOpcode() == BO_SubAssign;
+    return false;
+}
+
+// the condition compares the counter with '<', '<=', '>' or '>=', so the loop
+// still ends if the perforated increment steps over the bound. An unsigned
+// counter that counts down would wrap around at 0 instead.
+static bool isPerforableLoop(ForStmt *F) {
+    if (!F->getInc() || !F->getCond())
+        return false;
+    BinaryOperator *Cond = dyn_cast<BinaryOperator>(F->getCond()->IgnoreParenImpCasts());
+    if (!Cond || !Cond->isRelationalOp())
+        return false;
+    Expr *Inc = F->getInc()->IgnoreParenImpCasts();
+    VarDecl *VD = getLoopCounter(Inc);
+    if (!VD)
+        return false;
+    if (isDecrement(Inc) && !VD->getType()->isSignedIntegerOrEnumerationType())
+        return false;
+    DeclRefExpr *LHS = dyn_cast<DeclRefExpr>(Cond->getLHS()->IgnoreParenImpCasts());
+    DeclRefExpr *RHS = dyn_cast<DeclRefExpr>(Cond->getRHS()->IgnoreParenImpCasts());
+    return (LHS && LHS->getDecl() == VD) || (RHS && RHS->getDecl() == VD);
+}
+
+// collect the increments of the innermost perforable loops, return true if S
+// has any
+static bool collectPerforableLoops(Stmt *S, llvm::SmallPtrSetImpl<Stmt *> &Incs) {
+    bool Found = false;
+    for (Stmt::child_range range = S->children(); range; ++range)
+        if (*range && collectPerforableLoops(*range,Incs))
+            Found = true;
+
+    ForStmt *F = dyn_cast<ForStmt>(S);
+    if (Found || !F || !isPerforableLoop(F))
+        return Found;
+    Incs.insert(F->getInc());
+    return true;
+}
+
+// Prints the increment of the innermost counted loops of a kernel Rate times,
+// 'for (i = 0; i < n; ++i)' becomes 'for (i = 0; i < n; ++i, ++i)'. The inner
+// loops are usually the reductions of a work-item, every output element is
+// still written.
+class PerforationHelper : public PrinterHelper {
+private:
+    llvm::SmallPtrSet<Stmt *,8> Incs;
+    PrintingPolicy Policy;
+    unsigned Rate;
+
+public:
+    PerforationHelper(FunctionDecl *FD, const PrintingPolicy &Policy, unsigned Rate) :
+        Policy(Policy), Rate(Rate) {
+        if (Rate > 1 && FD->hasBody())
+            collectPerforableLoops(FD->getBody(),Incs);
+    }
+
+    size_t getNumLoops() const { return Incs.size(); }
+
+    bool handledStmt(Stmt *S, raw_ostream &OS) {
+        if (!Incs.count(S))
+            return false;
+        for (unsigned i = 0; i < Rate; ++i) {
+            if (i)
+                OS << ", ";
+            S->printPretty(OS,nullptr,Policy);
+        }
+        return true;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////    Kernel Specialisation
+////////////////////////////////////////////////////////////////////////////////
+
+// the variable is assigned, incremented or its address is taken
+static bool isVarModified(Stmt *S, VarDecl *VD) {
+    Expr *Target = 0;
+    if (UnaryOperator *UO = dyn_cast<UnaryOperator>(S)) {
+        if (UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf)
+            Target = UO->getSubExpr();
+    }
+    else if (BinaryOperator *BO = dyn_cast<BinaryOperator>(S)) {
+        if (BO->isAssignmentOp())
+            Target = BO->getLHS();
+    }
+    if (Target) {
+        DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Target->IgnoreParenImpCasts());
+        if (DRE && DRE->getDecl() == VD)
+            return true;
+    }
+
+    for (Stmt::child_range range = S->children(); range; ++range)
+        if (*range && isVarModified(*range,VD))
+            return true;
+    return false;
+}
+
+// The integer arguments of the call that are constant, converted to the type
+// of the parameter. The name is set by the caller once per specialised kernel.
+static KernelSpecialization getKernelSpecialization(clang::ASTContext *Context, CallExpr *CE,
+                                                    FunctionDecl *FD) {
+    KernelSpecialization Spec;
+    if (!FD->hasBody() || FD->isVariadic() || Context->isFunctionWithSubtasks(FD))
+        return Spec;
+
+    for (unsigned i = 0; i < CE->getNumArgs() && i < FD->getNumParams(); ++i) {
+        ParmVarDecl *PVD = FD->getParamDecl(i);
+        if (!PVD->getType()->isIntegerType() || isVarModified(FD->getBody(),PVD))
+            continue;
+        llvm::APSInt Value;
+        if (!CE->getArg(i)->isIntegerConstantExpr(Value,*Context))
+            continue;
+        std::string Type = PVD->getType().getUnqualifiedType().getAsString(Context->getPrintingPolicy());
+        Spec.Constants.push_back(std::make_pair(i,"((" + Type + ")" + Value.toString(10) + ")"));
+    }
+    return Spec;
+}
+
+// Prints the constant argument instead of the parameter. The parameters are
+// kept, the host code binds all the arguments of the call site as before.
+class SpecializationHelper : public PrinterHelper {
+private:
+    llvm::DenseMap<const Decl *,std::string> Constants;
+
+public:
+    SpecializationHelper(FunctionDecl *FD, const KernelSpecialization &Spec) {
+        for (std::vector<std::pair<unsigned,std::string> >::const_iterator
+                 II = Spec.Constants.begin(), EE = Spec.Constants.end(); II != EE; ++II)
+            Constants[FD->getParamDecl(II->first)] = II->second;
+    }
+
+    bool handledStmt(Stmt *S, raw_ostream &OS) {
+        DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S);
+        if (!DRE)
+            return false;
+        llvm::DenseMap<const Decl *,std::string>::iterator II = Constants.find(DRE->getDecl());
+        if (II == Constants.end())
+            return false;
+        OS << II->second;
+        return true;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////    CPU Vector Variants
+////////////////////////////////////////////////////////////////////////////////
+
+// Rewrites the element-wise kernels
+//
+//     T i = get_global_id(0);
+//     if (i < n) {          //optional
+//         P[i] = E;         //or P[i] op= E
+//         ...
+//     }
+//
+// where E reads Q[i] and values that are the same for all the work-items, to
+// W elements per work-item by vloadW()/vstoreW(). A work-item of the last
+// incomplete vector runs the original statements element by element.
+class KernelVectorizer {
+private:
+    clang::ASTContext *Context;
+    const unsigned Width;
+    VarDecl *IV;
+    //the element type of all the accessed buffers, float or int
+    QualType ElemTy;
+
+    std::string print(Stmt *S) {
+        std::string Str;
+        raw_string_ostream OS(Str);
+        S->printPretty(OS,nullptr,Context->getPrintingPolicy());
+        return OS.str();  //flush
+    }
+
+    std::string getVectorType() const {
+        return ElemTy.getAsString(Context->getPrintingPolicy()) + toString(Width);
+    }
+
+    // the same value for all the work-items
+    bool isUniform(Stmt *S) {
+        if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S))
+            if (DRE->getDecl() == IV)
+                return false;
+        if (isa<ArraySubscriptExpr>(S) || isa<CallExpr>(S))
+            return false;
+        if (MemberExpr *ME = dyn_cast<MemberExpr>(S))
+            if (ME->isArrow())
+                return false;
+        if (UnaryOperator *UO = dyn_cast<UnaryOperator>(S))
+            if (UO->getOpcode() == UO_Deref || UO->isIncrementDecrementOp())
+                return false;
+        if (BinaryOperator *BO = dyn_cast<BinaryOperator>(S))
+            if (BO->isAssignmentOp())
+                return false;
+
+        for (Stmt::child_range range = S->children(); range; ++range)
+            if (*range && !isUniform(*range))
+                return false;
+        return true;
+    }
+
+    // the buffer P of P[i], NULL if E is not an element of a buffer
+    DeclRefExpr *getElementBuffer(Expr *E) {
+        ArraySubscriptExpr *ASE = dyn_cast<ArraySubscriptExpr>(E->IgnoreParens());
+        if (!ASE)
+            return 0;
+        DeclRefExpr *Idx = dyn_cast<DeclRefExpr>(ASE->getIdx()->IgnoreParenImpCasts());
+        DeclRefExpr *Base = dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+        if (!Idx || Idx->getDecl() != IV || !Base || !isa<ParmVarDecl>(Base->getDecl()))
+            return 0;
+        const PointerType *PT = Base->getType()->getAs<PointerType>();
+        if (!PT)
+            return 0;
+
+        QualType Ty = Context->getCanonicalType(PT->getPointeeType()).getUnqualifiedType();
+        if (ElemTy.isNull()) {
+            if (!Ty->isSpecificBuiltinType(BuiltinType::Float) &&
+                !Ty->isSpecificBuiltinType(BuiltinType::Int))
+                return 0;
+            ElemTy = Ty;
+        }
+        return Ty == ElemTy ? Base : 0;
+    }
+
+    std::string getElementAddress(DeclRefExpr *Buffer) {
+        return print(Buffer) + " + " + IV->getNameAsString();
+    }
+
+    // E for W consecutive elements, false if E is not element-wise
+    bool printVector(Expr *E, raw_ostream &OS) {
+        if (E->getType()->isArithmeticType() && isUniform(E)) {
+            OS << "((" << getVectorType() << ")(" << print(E) << "))";
+            return true;
+        }
+        if (!Context->hasSameUnqualifiedType(E->getType(),ElemTy))
+            return false;
+
+        if (ParenExpr *PE = dyn_cast<ParenExpr>(E)) {
+            OS << "(";
+            if (!printVector(PE->getSubExpr(),OS))
+                return false;
+            OS << ")";
+            return true;
+        }
+        if (ImplicitCastExpr *ICE = dyn_cast<ImplicitCastExpr>(E)) {
+            if (ICE->getCastKind() != CK_LValueToRValue && ICE->getCastKind() != CK_NoOp)
+                return false;
+            return printVector(ICE->getSubExpr(),OS);
+        }
+        if (DeclRefExpr *Buffer = getElementBuffer(E)) {
+            OS << "vload" << Width << "(0," << getElementAddress(Buffer) << ")";
+            return true;
+        }
+        if (BinaryOperator *BO = dyn_cast<BinaryOperator>(E)) {
+            if (!BO->isMultiplicativeOp() && !BO->isAdditiveOp() &&
+                !BO->isShiftOp() && !BO->isBitwiseOp())
+                return false;
+            if (!printVector(BO->getLHS(),OS))
+                return false;
+            OS << " " << BO->getOpcodeStr() << " ";
+            return printVector(BO->getRHS(),OS);
+        }
+        if (UnaryOperator *UO = dyn_cast<UnaryOperator>(E)) {
+            if (UO->getOpcode() != UO_Minus && UO->getOpcode() != UO_Plus &&
+                UO->getOpcode() != UO_Not)
+                return false;
+            OS << UnaryOperator::getOpcodeStr(UO->getOpcode());
+            return printVector(UO->getSubExpr(),OS);
+        }
+        if (CallExpr *CE = dyn_cast<CallExpr>(E)) {
+            FunctionDecl *Callee = CE->getDirectCallee();
+            if (!Callee || !isVectorBuiltin(Callee->getNameAsString()))
+                return false;
+            OS << Callee->getNameAsString() << "(";
+            for (unsigned i = 0; i < CE->getNumArgs(); ++i) {
+                if (i)
+                    OS << ",";
+                if (!printVector(CE->getArg(i),OS))
+                    return false;
+            }
+            OS << ")";
+            return true;
+        }
+        return false;
+    }
+
+    // P[i] = E or P[i] op= E
+    bool printElementStmt(Stmt *S, raw_ostream &OS) {
+        BinaryOperator *BO = dyn_cast<BinaryOperator>(S);
+        if (!BO || !BO->isAssignmentOp())
+            return false;
+        DeclRefExpr *Buffer = getElementBuffer(BO->getLHS());
+        if (!Buffer)
+            return false;
+
+        const std::string Address = getElementAddress(Buffer);
+        OS << "vstore" << Width << "(";
+        if (BO->isCompoundAssignmentOp()) {
+            BinaryOperatorKind Op = BinaryOperator::getOpForCompoundAssignment(BO->getOpcode());
+            OS << "vload" << Width << "(0," << Address << ") "
+               << BinaryOperator::getOpcodeStr(Op) << " (";
+            if (!printVector(BO->getRHS(),OS))
+                return false;
+            OS << ")";
+        }
+        else if (!printVector(BO->getRHS(),OS))
+            return false;
+        OS << ",0," << Address << ");\n";
+        return true;
+    }
+
+    // the OpenCL builtins of gentype arguments only
+    static bool isVectorBuiltin(const std::string &Name) {
+        static const char *Builtins[] = {
+            "sqrt", "rsqrt", "cbrt", "fabs", "exp", "exp2", "exp10", "log", "log2",
+            "log10", "sin", "cos", "tan", "floor", "ceil", "round", "trunc",
+            "fmin", "fmax", "fma", "mad", "pow", "min", "max", "clamp", "mix", 0
+        };
+        for (const char **II = Builtins; *II; ++II)
+            if (Name.compare(*II) == 0)
+                return true;
+        return false;
+    }
+
+public:
+    KernelVectorizer(clang::ASTContext *Context, unsigned Width) :
+        Context(Context), Width(Width), IV(0) {}
+
+    // the body of the CPU variant of FD, false if FD is not element-wise
+    bool vectorize(FunctionDecl *FD, std::string &Body) {
+        CompoundStmt *CS = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+        if (!CS || CS->size() < 2)
+            return false;
+
+        // T i = get_global_id(0);
+        DeclStmt *DS = dyn_cast<DeclStmt>(CS->body_front());
+        IV = (DS && DS->isSingleDecl()) ? dyn_cast<VarDecl>(DS->getSingleDecl()) : 0;
+        if (!IV || !IV->getType()->isIntegerType() || IV->getType().isConstQualified() ||
+            !IV->getInit())
+            return false;
+        CallExpr *GID = dyn_cast<CallExpr>(IV->getInit()->IgnoreParenImpCasts());
+        if (!GID || !GID->getDirectCallee() || GID->getNumArgs() != 1 ||
+            GID->getDirectCallee()->getNameAsString().compare("get_global_id"))
+            return false;
+        llvm::APSInt Dim;
+        if (!GID->getArg(0)->isIntegerConstantExpr(Dim,*Context) || Dim.getZExtValue())
+            return false;
+
+        // if (i < n), the only statement after the index
+        IfStmt *Guard = 0;
+        Expr *Bound = 0;
+        if (CS->size() == 2 && isa<IfStmt>(CS->body_back())) {
+            Guard = cast<IfStmt>(CS->body_back());
+            BinaryOperator *Cond = dyn_cast<BinaryOperator>(Guard->getCond()->IgnoreParenImpCasts());
+            if (Guard->getElse() || Guard->getConditionVariable() ||
+                !Cond || Cond->getOpcode() != BO_LT)
+                return false;
+            DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(Cond->getLHS()->IgnoreParenImpCasts());
+            if (!DRE || DRE->getDecl() != IV || !isUniform(Cond->getRHS()))
+                return false;
+            Bound = Cond->getRHS();
+        }
+
+        SmallVector<Stmt *,8> Elements;
+        if (!Guard)
+            Elements.append(CS->body_begin() + 1,CS->body_end());
+        else if (CompoundStmt *Then = dyn_cast<CompoundStmt>(Guard->getThen()))
+            Elements.append(Then->body_begin(),Then->body_end());
+        else
+            Elements.push_back(Guard->getThen());
+
+        std::string Vector;
+        raw_string_ostream VOS(Vector);
+        for (SmallVector<Stmt *,8>::iterator
+                 II = Elements.begin(), EE = Elements.end(); II != EE; ++II)
+            if (!printElementStmt(*II,VOS))
+                return false;
+        VOS.flush();
+        if (Vector.empty())
+            return false;
+
+        const std::string Type = IV->getType().getUnqualifiedType().getAsString(Context->getPrintingPolicy());
+        const std::string Name = IV->getNameAsString();
+
+        raw_string_ostream OS(Body);
+        OS << "{\n" << Type << " " << Name << " = get_global_id(0) * " << Width << ";\n";
+        if (!Guard)
+            OS << Vector;
+        else {
+            OS << "if (" << Name << " + " << Width - 1 << " < (" << print(Bound) << ")) {\n"
+               << Vector
+               << "}\n"
+               << "else {\n"
+               << Type << " __acl_base = " << Name << ";\n"
+               << "for (" << Name << " = __acl_base; " << Name << " < __acl_base + " << Width
+               << "; ++" << Name << ")\n"
+               << print(Guard)
+               << "}\n";
+        }
+        OS << "}\n";
+        OS.flush();
+        return true;
+    }
+};
+
+// the CPU variant of FD, empty if FD is not an element-wise kernel
+static KernelVectorization getKernelVectorization(clang::ASTContext *Context, FunctionDecl *FD,
+                                                  unsigned Width) {
+    KernelVectorization Vec;
+    if (!FD->hasBody() || FD->isVariadic() || Context->isFunctionWithSubtasks(FD))
+        return Vec;
+
+    KernelVectorizer Vectorizer(Context,Width);
+    if (Vectorizer.vectorize(FD,Vec.Body))
+        Vec.Width = Width;
+    return Vec;
+}
+
+// Prints the vectorised body instead of the body of the kernel
+class VectorizationHelper : public PrinterHelper {
+private:
+    Stmt *Body;
+    const std::string &Vectorized;
+
+public:
+    VectorizationHelper(FunctionDecl *FD, const std::string &Vectorized) :
+        Body(FD->getBody()), Vectorized(Vectorized) {}
+
+    bool handledStmt(Stmt *S, raw_ostream &OS) {
+        if (S != Body)
+            return false;
+        OS << Vectorized;
+        return true;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+////    Basic Block Profiling
+////////////////////////////////////////////////////////////////////////////////
+
+static bool isIncBBCall(Stmt *S) {
+    CallExpr *CE = dyn_cast<CallExpr>(S);
+    FunctionDecl *Callee = CE ? CE->getDirectCallee() : 0;
+    return Callee && CE->getNumArgs() == 2 &&
+        Callee->getNameAsString().compare("__acl_builtin__incBB") == 0;
+}
+
+// The __acl_builtin__incBB() calls of a kernel body. The counters can be kept
+// in local memory if all the calls count into the same parameter with
+// constant counter numbers, and if the kernel does not return early, every
+// work-item must reach the flush at the end.
+class LocalProfileCounters {
+private:
+    clang::ASTContext *Context;
+    bool Valid;
+
+    void visit(Stmt *S) {
+        if (isa<ReturnStmt>(S)) {
+            Valid = false;
+            return;
+        }
+        if (isIncBBCall(S)) {
+            CallExpr *CE = cast<CallExpr>(S);
+            DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(CE->getArg(0)->IgnoreParenImpCasts());
+            ParmVarDecl *PVD = DRE ? dyn_cast<ParmVarDecl>(DRE->getDecl()) : 0;
+            llvm::APSInt Num;
+            if (!PVD || (Prof && PVD != Prof) ||
+                !CE->getArg(1)->isIntegerConstantExpr(Num,*Context) || Num.isNegative()) {
+                Valid = false;
+                return;
+            }
+            Prof = PVD;
+            NumCounters = std::max<unsigned>(NumCounters,Num.getZExtValue() + 1);
+            return;
+        }
+
+        for (Stmt::child_range range = S->children(); range && Valid; ++range)
+            if (*range)
+                visit(*range);
+    }
+
+public:
+    //the global counters and their number
+    ParmVarDecl *Prof;
+    unsigned NumCounters;
+
+    LocalProfileCounters(clang::ASTContext *Context, FunctionDecl *FD) :
+        Context(Context), Valid(true), Prof(0), NumCounters(0) {
+        if (FD->hasBody())
+            visit(FD->getBody());
+    }
+
+    bool isValid() const { return Valid && Prof; }
+};
+
+// Counts into the counters __acl_bb of the work-group instead of the global
+// counters, which are updated once per work-group at the end of the kernel,
+// see KernelHeader. With --profile-sample=<n> only one work-group in n counts
+// and its counters are scaled by n.
+class ProfileHelper : public PrinterHelper {
+private:
+    Stmt *Body;
+    const PrintingPolicy &Policy;
+    const LocalProfileCounters &Counters;
+    bool InBody;
+
+public:
+    ProfileHelper(FunctionDecl *FD, const PrintingPolicy &Policy,
+                  const LocalProfileCounters &Counters) :
+        Body(FD->getBody()), Policy(Policy), Counters(Counters), InBody(false) {}
+
+    bool handledStmt(Stmt *S, raw_ostream &OS) {
+        if (S == Body && !InBody) {
+            std::string Str;
+            raw_string_ostream BOS(Str);
+            InBody = true;
+            S->printPretty(BOS,this,Policy);
+            InBody = false;
+            BOS.flush();
+
+            const size_t Open = Str.find('{');
+            const size_t Close = Str.rfind('}');
+            if (Open == std::string::npos || Close == std::string::npos || Close < Open)
+                return false;
+            const std::string Num = toString(Counters.NumCounters);
+            OS << Str.substr(0,Open + 1) << "\n"
+               << "__ACL_PROFILE_BB_BEGIN__(" << Num << ")\n"
+               << Str.substr(Open + 1,Close - Open - 1)
+               << "__ACL_PROFILE_BB_END__(" << Num << "," << Counters.Prof->getName() << ")\n"
+               << Str.substr(Close);
+            return true;
+        }
+        if (isIncBBCall(S)) {
+            OS << "__acl_builtin__incBB_local(__acl_bb,__acl_bb_sampled,";
+            cast<CallExpr>(S)->getArg(1)->printPretty(OS,this,Policy);
+            OS << ")";
+            return true;
+        }
+        return false;
+    }
+};
+
 static
 ObjRefDef printFunction(clang::FunctionDecl *FD, clang::ASTContext *Context,
                         std::string AlternativeName,
-                        const enum PrintSubtaskType SubtaskPrintMode)
+                        const enum PrintSubtaskType SubtaskPrintMode,
+                        PrinterHelper *Helper = NULL)
 {
     std::string Ref;
     std::string Def;
@@ -114,19 +759,25 @@ ObjRefDef printFunction(clang::FunctionDecl *FD, clang::ASTContext *Context,
 #else
         Ref = getUniqueKernelName(FD->getNameAsString());
 #endif
-       if (Context->getSourceManager().isInMainFile(FD->getLocStart()))
-            FD->print(OS,Context->getPrintingPolicy());
+       if (Context->getSourceManager().isInMainFile(FD->getLocStart()) ||
+           ACLConfig.StripKernelSources) {
+            // a function without subtasks is printed as it is
+            if (Helper)
+                FD->printAccurateVersion(OS,Context->getPrintingPolicy(),Ref,0,false,Helper);
+            else
+                FD->print(OS,Context->getPrintingPolicy());
+       }
         break;
     case K_PRINT_ACCURATE_SUBTASK: {
         //always print the accurate version
         Ref = AlternativeName;
-        FD->printAccurateVersion(OS,Context->getPrintingPolicy(),AlternativeName);
+        FD->printAccurateVersion(OS,Context->getPrintingPolicy(),AlternativeName,0,false,Helper);
         break;
     }
     case K_PRINT_APPROXIMATE_SUBTASK: {
         //always print the approximate version
         Ref = AlternativeName;
-        FD->printApproximateVersion(OS,Context->getPrintingPolicy(),AlternativeName);
+        FD->printApproximateVersion(OS,Context->getPrintingPolicy(),AlternativeName,0,false,Helper);
         break;
     }
     default:
@@ -143,59 +794,307 @@ static ClauseInfo *getClauseOfKind(const ClauseList &CList, ClauseKind CK) {
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+////    Stripped Kernel Sources
+////////////////////////////////////////////////////////////////////////////////
+
+// the declarations of the main file and of the tracked user headers are
+// printed, the system and the acl headers are known to the OpenCL compiler
+static bool isPrintableDecl(clang::ASTContext *Context, const Decl *D) {
+    SourceLocation Loc = D->getLocation();
+    if (Loc.isInvalid())
+        return false;
+    SourceManager &SM = Context->getSourceManager();
+    if (SM.isInSystemHeader(Loc))
+        return false;
+    if (SM.isInMainFile(Loc))
+        return true;
+    // declarations from the cmd (-include option) have no file
+    const FileEntry *FE = SM.getFileEntryForID(SM.getFileID(SM.getExpansionLoc(Loc)));
+    if (!FE)
+        return false;
+    std::string DefFile = FE->getName();
+    return TrackThisHeader(DefFile);
+}
+
+// Collects the types and the file scope variables the kernel and its call
+// dependencies use, each one after the declarations it depends on. The printed
+// code has the macros already expanded.
+class KernelDeclCollector : public RecursiveASTVisitor<KernelDeclCollector> {
+private:
+    clang::ASTContext *Context;
+    llvm::SmallPtrSet<const Decl *,16> Visited;
+
+    void addType(QualType T) {
+        if (T.isNull())
+            return;
+        const Type *Ty = T.getTypePtr();
+        if (const TypedefType *TT = dyn_cast<TypedefType>(Ty))
+            addDecl(TT->getDecl());
+        else if (const TagType *TT = dyn_cast<TagType>(Ty))
+            addDecl(TT->getDecl());
+        else if (const PointerType *PT = dyn_cast<PointerType>(Ty))
+            addType(PT->getPointeeType());
+        else if (const ArrayType *AT = dyn_cast<ArrayType>(Ty))
+            addType(AT->getElementType());
+        else if (const FunctionProtoType *FPT = dyn_cast<FunctionProtoType>(Ty)) {
+            addType(FPT->getReturnType());
+            for (unsigned i = 0; i < FPT->getNumParams(); ++i)
+                addType(FPT->getParamType(i));
+        }
+        else if (const FunctionType *FT = dyn_cast<FunctionType>(Ty))
+            addType(FT->getReturnType());
+        else if (Ty->isSugared())
+            addType(Ty->desugar());
+    }
+
+    void addDecl(NamedDecl *D) {
+        if (TagDecl *Tag = dyn_cast<TagDecl>(D))
+            if (TagDecl *Def = Tag->getDefinition())
+                D = Def;
+        if (!isPrintableDecl(Context,D) || !Visited.insert(D).second)
+            return;
+
+        if (TypedefNameDecl *TD = dyn_cast<TypedefNameDecl>(D))
+            addType(TD->getUnderlyingType());
+        else if (RecordDecl *RD = dyn_cast<RecordDecl>(D)) {
+            for (RecordDecl::field_iterator
+                     FI = RD->field_begin(), FE = RD->field_end(); FI != FE; ++FI)
+                addType(FI->getType());
+            // typedef struct { ... } name; is printed with its typedef
+            if (!RD->getIdentifier() && RD->getTypedefNameForAnonDecl())
+                return;
+        }
+        else if (VarDecl *VD = dyn_cast<VarDecl>(D)) {
+            addType(VD->getType());
+            if (VD->getInit())
+                TraverseStmt(VD->getInit());
+        }
+        Decls.push_back(D);
+    }
+
+public:
+    std::vector<NamedDecl *> Decls;
+
+    explicit KernelDeclCollector(clang::ASTContext *Context) : Context(Context) {}
+
+    bool VisitValueDecl(ValueDecl *D) {
+        addType(D->getType());
+        return true;
+    }
+
+    bool VisitExpr(Expr *E) {
+        addType(E->getType());
+        return true;
+    }
+
+    bool VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *E) {
+        if (E->isArgumentType())
+            addType(E->getArgumentType());
+        return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr *E) {
+        if (EnumConstantDecl *ECD = dyn_cast<EnumConstantDecl>(E->getDecl()))
+            addDecl(cast<EnumDecl>(ECD->getDeclContext()));
+        else if (VarDecl *VD = dyn_cast<VarDecl>(E->getDecl()))
+            if (VD->isFileVarDecl())
+                addDecl(VD->getDefinition() ? VD->getDefinition() : VD);
+        return true;
+    }
+
+    std::string print() const {
+        std::string Def;
+        raw_string_ostream OS(Def);
+        for (std::vector<NamedDecl *>::const_iterator
+                 II = Decls.begin(), EE = Decls.end(); II != EE; ++II) {
+            TypedefNameDecl *TD = dyn_cast<TypedefNameDecl>(*II);
+            TagDecl *Tag = TD ? TD->getUnderlyingType()->getAsTagDecl() : 0;
+            if (Tag && !Tag->getIdentifier() && Tag->getTypedefNameForAnonDecl() == TD) {
+                OS << "typedef ";
+                Tag->print(OS,Context->getPrintingPolicy());
+                OS << " " << TD->getName();
+            }
+            else
+                (*II)->print(OS,Context->getPrintingPolicy());
+            OS << ";\n\n";
+        }
+        return OS.str();
+    }
+};
+
 KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
+                           CompileScheduler &Scheduler,
                            clang::ASTContext *Context,clang::FunctionDecl *FD, clang::CallGraph *CG,
                            const clang::centaurus::DirectiveInfo *DI,
                            std::string &Extensions, std::string &UserTypes,
                            const enum PrintSubtaskType SubtaskPrintMode)
-    : ACLConfig(ACLConfig)
+    : ACLConfig(ACLConfig), CPUVariant(NULL), VectorWidth(0),
+      InlineSize(0), StaticDeviceType(true), Finalized(false)
 {
     if (!FD) {
         HostCode.NameRef = "NULL";
         DeviceCode.NameRef = "NULL";
+        Finalized = true;
         return;
     }
 
+    init(Scheduler,Context,FD,ObjRefDef(),CG,DI,Extensions,UserTypes,SubtaskPrintMode);
+}
+
+KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
+                           CompileScheduler &Scheduler,
+                           clang::ASTContext *Context,
+                           clang::FunctionDecl *FirstFD, clang::FunctionDecl *SecondFD,
+                           const ObjRefDef &FusedKernel, clang::CallGraph *CG,
+                           const clang::centaurus::DirectiveInfo *DI,
+                           std::string &Extensions, std::string &UserTypes)
+    : ACLConfig(ACLConfig), CPUVariant(NULL), VectorWidth(0),
+      InlineSize(0), StaticDeviceType(true), Finalized(false)
+{
+    clang::FunctionDecl *Kernels[] = { FirstFD, SecondFD };
+    init(Scheduler,Context,Kernels,FusedKernel,CG,DI,Extensions,UserTypes,K_PRINT_ACCURATE_SUBTASK);
+}
+
+KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
+                           CompileScheduler &Scheduler,
+                           clang::ASTContext *Context,clang::FunctionDecl *FD,
+                           const KernelApproximation &Approx, clang::CallGraph *CG,
+                           const clang::centaurus::DirectiveInfo *DI,
+                           std::string &Extensions, std::string &UserTypes)
+    : ACLConfig(ACLConfig), CPUVariant(NULL), VectorWidth(0),
+      InlineSize(0), StaticDeviceType(true), Finalized(false)
+{
+    init(Scheduler,Context,FD,ObjRefDef(),CG,DI,Extensions,UserTypes,K_PRINT_APPROXIMATE_SUBTASK,&Approx);
+}
+
+KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
+                           CompileScheduler &Scheduler,
+                           clang::ASTContext *Context,clang::FunctionDecl *FD,
+                           const KernelSpecialization &Spec, clang::CallGraph *CG,
+                           const clang::centaurus::DirectiveInfo *DI,
+                           std::string &Extensions, std::string &UserTypes)
+    : ACLConfig(ACLConfig), CPUVariant(NULL), VectorWidth(0),
+      InlineSize(0), StaticDeviceType(true), Finalized(false)
+{
+    init(Scheduler,Context,FD,ObjRefDef(),CG,DI,Extensions,UserTypes,K_PRINT_ACCURATE_SUBTASK,NULL,&Spec);
+}
+
+KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
+                           CompileScheduler &Scheduler,
+                           clang::ASTContext *Context,clang::FunctionDecl *FD,
+                           const KernelVectorization &Vec, clang::CallGraph *CG,
+                           const clang::centaurus::DirectiveInfo *DI,
+                           std::string &Extensions, std::string &UserTypes)
+    : ACLConfig(ACLConfig), CPUVariant(NULL), VectorWidth(Vec.Width),
+      InlineSize(0), StaticDeviceType(true), Finalized(false)
+{
+    init(Scheduler,Context,FD,ObjRefDef(),CG,DI,Extensions,UserTypes,K_PRINT_ACCURATE_SUBTASK,NULL,NULL,&Vec);
+}
+
+void
+KernelRefDef::init(CompileScheduler &Scheduler, clang::ASTContext *Context,
+                   ArrayRef<clang::FunctionDecl *> Kernels, const ObjRefDef &FusedKernel,
+                   clang::CallGraph *CG, const clang::centaurus::DirectiveInfo *DI,
+                   std::string &Extensions, std::string &UserTypes,
+                   const enum PrintSubtaskType SubtaskPrintMode,
+                   const KernelApproximation *Approx,
+                   const KernelSpecialization *Spec,
+                   const KernelVectorization *Vec)
+{
     if (ACLConfig.ProfileMode) {
         BuildOptions.push_back("-D__ACL_PROFILE_MODE__");
         BuildOptions.push_back("-I" + ACLConfig.IncludePath);
+        if (ACLConfig.ProfileSample > 1)
+            BuildOptions.push_back("-DACL_PROFILE_SAMPLE=" + toString(ACLConfig.ProfileSample));
     }
+    if (Approx && Approx->RelaxedMath)
+        BuildOptions.push_back("-cl-fast-relaxed-math");
 
     assert(SubtaskPrintMode != K_PRINT_ALL);
 
-    // always set the AlternativeName for the top level kernel function
-    std::string AlternativeName = FD->getNameAsString();
-    if (Context->getSourceManager().isInMainFile(FD->getLocStart())) {
-        // if kernel has no subtasks write it on the new file only if it cannot
-        // be found through headers
-        DeviceCode = printFunction(FD,Context,AlternativeName,SubtaskPrintMode);
-    }
-    else {
-        // exists on header, just set the NameRef
-        // we have a header dependency
-        SourceManager &SM = Context->getSourceManager();
-        std::string DefFile = SM.getFileEntryForID(SM.getFileID(FD->getLocStart()))->getName();
-        DepCFG[FD].DepHeaders[DefFile] = true;
+    TimeRegion PrintTime("print",Kernels.front()->getNameAsString());
+
+    for (ArrayRef<clang::FunctionDecl *>::iterator
+             KI = Kernels.begin(), KE = Kernels.end(); KI != KE; ++KI) {
+        FunctionDecl *FD = *KI;
+        ObjRefDef Src;
+
+        // always set the AlternativeName for the top level kernel function
+        std::string AlternativeName = FD->getNameAsString();
+        if (Context->getSourceManager().isInMainFile(FD->getLocStart()) ||
+            ACLConfig.StripKernelSources) {
+            // if kernel has no subtasks write it on the new file only if it cannot
+            // be found through headers
+            if (!Approx && !Spec && !Vec) {
+                // the basic block counters of profile mode are kept in local memory
+                if (ACLConfig.ProfileMode && !Context->isFunctionWithSubtasks(FD)) {
+                    LocalProfileCounters Counters(Context,FD);
+                    if (Counters.isValid()) {
+                        ProfileHelper Helper(FD,Context->getPrintingPolicy(),Counters);
+                        Src = printFunction(FD,Context,AlternativeName,SubtaskPrintMode,&Helper);
+                    }
+                }
+                if (Src.NameRef.empty())
+                    Src = printFunction(FD,Context,AlternativeName,SubtaskPrintMode);
+            }
+        }
+        else {
+            // exists on header, just set the NameRef
+            // we have a header dependency
+            SourceManager &SM = Context->getSourceManager();
+            std::string DefFile = SM.getFileEntryForID(SM.getFileID(FD->getLocStart()))->getName();
+            DepCFG[FD].DepHeaders[DefFile] = true;
 
 #if 0
-        llvm::outs() << DEBUG
-                     << FD->getNameAsString() << "-------------------kernel function from header, add header dependency -------------" << DefFile << "\n";
+            llvm::outs() << DEBUG
+                         << FD->getNameAsString() << "-------------------kernel function from header, add header dependency -------------" << DefFile << "\n";
 #endif
-        DeviceCode.NameRef = AlternativeName;
+            Src.NameRef = AlternativeName;
+        }
+
+        // the kernels derived by acl are always written
+        if (Approx) {
+            AlternativeName += Approx->getSuffix();
+            PerforationHelper Helper(FD,Context->getPrintingPolicy(),Approx->PerforationRate);
+            Src = printFunction(FD,Context,AlternativeName,SubtaskPrintMode,&Helper);
+            if (Approx->PerforationRate > 1 && !Helper.getNumLoops())
+                llvm::outs() << WARNING
+                             << "kernel '" << FD->getNameAsString() << "' has no loop to perforate\n";
+        }
+        else if (Spec) {
+            AlternativeName = Spec->Name;
+            SpecializationHelper Helper(FD,*Spec);
+            Src = printFunction(FD,Context,AlternativeName,SubtaskPrintMode,&Helper);
+        }
+        else if (Vec) {
+            AlternativeName += Vec->getSuffix();
+            VectorizationHelper Helper(FD,Vec->Body);
+            Src = printFunction(FD,Context,AlternativeName,SubtaskPrintMode,&Helper);
+        }
+
+        if (Context->isFunctionWithSubtasks(FD)) {
+            if (SubtaskPrintMode == K_PRINT_ACCURATE_SUBTASK)
+                AlternativeName += "__accurate__";
+            else if (SubtaskPrintMode == K_PRINT_APPROXIMATE_SUBTASK)
+                AlternativeName += "__approx__";
+            // always write a new version if kernel has subtasks
+            Src = printFunction(FD,Context,AlternativeName,SubtaskPrintMode);
+        }
+
+        DeviceCode.NameRef = Src.NameRef;
+        DeviceCode.Definition += Src.Definition;
     }
 
-    if (Context->isFunctionWithSubtasks(FD)) {
-        if (SubtaskPrintMode == K_PRINT_ACCURATE_SUBTASK)
-            AlternativeName += "__accurate__";
-        else if (SubtaskPrintMode == K_PRINT_APPROXIMATE_SUBTASK)
-            AlternativeName += "__approx__";
-        // always write a new version if kernel has subtasks
-        DeviceCode = printFunction(FD,Context,AlternativeName,SubtaskPrintMode);
+    // the fused kernel calls the kernels of both tasks
+    if (FusedKernel.NameRef.size()) {
+        DeviceCode.NameRef = FusedKernel.NameRef;
+        DeviceCode.Definition += FusedKernel.Definition;
     }
 
 #if 0
         llvm::outs() << DEBUG
-                     << "kernel:" << FD->getNameAsString() << "\n"
+                     << "kernel:" << DeviceCode.NameRef << "\n"
                      << DeviceCode.Definition << "\n";
 #endif
 
@@ -206,27 +1105,59 @@ KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
 
     std::string __offline = KernelHeader + Extensions;
 
-    if (Context->getSourceManager().isInMainFile(FD->getLocStart())) {
+    if (Context->getSourceManager().isInMainFile(Kernels.front()->getLocStart())) {
         // write any enabled OpenCL extensions
 #define OPENCLEXT(nm) if (Context->OpenCLFeatures->nm) { __offline += "#pragma OPENCL EXTENSION " #nm " : enable\n"; }
 #include "clang/Basic/OpenCLExtensions.def"
     }
 
     std::string PreDef;  // = Extensions;
-    for (llvm::StringMap<bool>::iterator
-             II = DepCFG[FD].DepHeaders.begin(), EE = DepCFG[FD].DepHeaders.end(); II != EE; ++II) {
-        __offline += "#include \"" + II->getKey().str() + "\"\n";
-        //PreDef += "#include \"" + II->getKey().str() + "\"\n";
+    llvm::StringMap<bool> DepHeaders;
+    llvm::SmallPtrSet<const clang::Type *,8> DepUserTypes;
+    llvm::SmallSetVector<clang::FunctionDecl *,sizeof(clang::FunctionDecl *)> Deps;
+    for (ArrayRef<clang::FunctionDecl *>::iterator
+             KI = Kernels.begin(), KE = Kernels.end(); KI != KE; ++KI) {
+        FunctionDecl *FD = *KI;
+        {
+            TimeRegion Time("deps",FD->getNameAsString());
+            findCallDeps(FD,CG,Deps);
+        }
+        // the declarations are printed below instead
+        if (ACLConfig.StripKernelSources)
+            continue;
+        for (llvm::StringMap<bool>::iterator
+                 II = DepCFG[FD].DepHeaders.begin(), EE = DepCFG[FD].DepHeaders.end(); II != EE; ++II) {
+            if (!DepHeaders.insert(std::make_pair(II->getKey(),true)).second)
+                continue;
+            __offline += "#include \"" + II->getKey().str() + "\"\n";
+            //PreDef += "#include \"" + II->getKey().str() + "\"\n";
+        }
+        for (std::vector<const clang::Type *>::iterator
+                 II = DepCFG[FD].UserTypes.begin(), EE = DepCFG[FD].UserTypes.end(); II != EE; ++II) {
+            if (!DepUserTypes.insert(*II).second)
+                continue;
+            __offline += printUserType(*II);
+            //PreDef += UserTypes;
+        }
     }
-    for (std::vector<const clang::Type *>::iterator
-             II = DepCFG[FD].UserTypes.begin(), EE = DepCFG[FD].UserTypes.end(); II != EE; ++II) {
-        __offline += printUserType(*II);
-        //PreDef += UserTypes;
+    // the kernels of a fused task are printed once, as kernels
+    for (ArrayRef<clang::FunctionDecl *>::iterator
+             KI = Kernels.begin(), KE = Kernels.end(); KI != KE; ++KI)
+        Deps.remove(*KI);
+
+    // a self-contained source, only what the kernels and their call
+    // dependencies use
+    if (ACLConfig.StripKernelSources) {
+        KernelDeclCollector Collector(Context);
+        for (ArrayRef<clang::FunctionDecl *>::iterator
+                 KI = Kernels.begin(), KE = Kernels.end(); KI != KE; ++KI)
+            Collector.TraverseDecl(*KI);
+        for (llvm::SmallSetVector<clang::FunctionDecl *,sizeof(clang::FunctionDecl *)>::iterator
+                 II = Deps.begin(), EE = Deps.end(); II != EE; ++II)
+            Collector.TraverseDecl(*II);
+        __offline += Collector.print();
     }
 
-    llvm::SmallSetVector<clang::FunctionDecl *,sizeof(clang::FunctionDecl *)> Deps;
-    findCallDeps(FD,CG,Deps);
-
     //reverse visit to satisfy dependencies
     while (Deps.size()) {
         FunctionDecl *DepFD = Deps.pop_back_val();
@@ -251,6 +1182,17 @@ KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
             // version (if exists), add it only once in the final *.cl file
             __offline += Src.Definition;
         }
+        else if (ACLConfig.StripKernelSources && isPrintableDecl(Context,DepFD)) {
+            // the header is not included, print the definition
+            const FunctionDecl *Def = DepFD;
+            if (!DepFD->hasBody(Def))
+                continue;
+            raw_string_ostream OS(Src.Definition);
+            Def->print(OS,Context->getPrintingPolicy());
+            OS << "\n";
+            OS.flush();
+            __offline += Src.Definition;
+        }
         else {
             // exists on header
             //llvm::outs() << DEBUG
@@ -267,38 +1209,52 @@ KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
     __offline += DeviceCode.Definition;
     DeviceCode.Definition = PreDef + DeviceCode.Definition;
 
-    std::string __inline_definition = __offline;
-    ReplaceStringInPlace(__inline_definition,"\\","\\\\");
-    ReplaceStringInPlace(__inline_definition,"\r","");
-    ReplaceStringInPlace(__inline_definition,"\t","");
-    ReplaceStringInPlace(__inline_definition,"\"","\\\"");
-    ReplaceStringInPlace(__inline_definition,"\n","\\n");
+    // escaped when the impl file is written, see printInlineSource()
+    InlineSource.swap(__offline);
+    InlineSize = getCStringLiteralSize(InlineSource);
+
+    const std::string SymbolName = getTUSymbolTag(Context) + "__" + DeviceCode.NameRef;
 
-    InlineDeviceCode.NameRef = "__src_inline__" + DeviceCode.NameRef;
+    InlineDeviceCode.NameRef = "__src_inline__" + SymbolName;
     InlineDeviceCode.HeaderDecl = "extern const char " + InlineDeviceCode.NameRef
-        + "[" + toString(__inline_definition.size()) + "];";
-    InlineDeviceCode.Definition = "const char " + InlineDeviceCode.NameRef
-        + "[" + toString(__inline_definition.size()) + "]"
-        + " = "
-        + "\"" + __inline_definition + "\";";
+        + "[" + toString(InlineSize) + "];";
 
-    std::string PrefixDef;
+    // the descriptors of all the kernels share the scope of the impl file
+    PrefixDef = SymbolName;
     if (SubtaskPrintMode == K_PRINT_ACCURATE_SUBTASK)
         PrefixDef += "__ACCR__";
     else if (SubtaskPrintMode == K_PRINT_APPROXIMATE_SUBTASK)
         PrefixDef += "__APRX__";
     else
         PrefixDef += "__EVAL__";
-    compile(__offline,DeviceCode.NameRef,PrefixDef,BuildOptions);
+
+    // build later, together with all the other kernels of this file
+    Scheduler.enqueue(this,InlineSource,SymbolName,PrefixDef,BuildOptions);
+
+    const ClauseKind BindMode = (SubtaskPrintMode == K_PRINT_ACCURATE_SUBTASK) ? CK_BIND : CK_BIND_APPROXIMATE;
+    DeviceType = setDeviceType(DI,BindMode);
+
+    HostCode.NameRef = "__acl_kernel_" + PrefixDef;
+    HostCode.HeaderDecl = "extern struct _kernel_struct " + HostCode.NameRef + ";";
+    // assign kernel UIDs in traversal order
+    getKernelUID(DeviceCode.NameRef);
+
+    SourceManager &SM = Context->getSourceManager();
+    std::string FileName = getMainFileName(SM);
+    std::string Suffix = "_ocl_";
+    std::string NewDeviceImpl = RemoveDotExtension(FileName) + Suffix + DeviceCode.NameRef + ".cl";
+    NewOpenCLFiles.push_back(std::make_pair(NewDeviceImpl,this));
+}
+
+void KernelRefDef::finalize() {
+    if (Finalized)
+        return;
+    Finalized = true;
 
     // On Linux the driver caches compiled kernels in ~/.nv/ComputeCache.
     // Deleting this folder forces a recompile.
     std::string OpenCLCacheDir = "~/.nv/ComputeCache";
 
-    std::string PreAPIDef;
-    std::string PlatformTableName = PrefixDef + "PLATFORM_TABLE";
-    std::string PlatformTable = "struct _platform_bin *" + PlatformTableName + " = (struct _platform_bin*)calloc(ACL_SUPPORTED_PLATFORMS_NUM,sizeof(struct _platform_bin));";
-
     for (std::vector<PlatformBin>::iterator
              II = Binary.begin(), EE = Binary.end(); II != EE; ++II) {
         PlatformBin &Platform = *II;
@@ -307,8 +1263,6 @@ KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
                      << "########    [" << Platform.PlatformName << "]\n";
 #endif
 
-        std::string PlatformDef;
-
         bool CacheWarning = false;
         for (std::vector<DeviceBin>::iterator
                  DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
@@ -326,8 +1280,6 @@ KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
             else {
                 CacheWarning = true;
             }
-
-            PlatformDef += Device.Definition;
         }
 
         if (CacheWarning)
@@ -336,34 +1288,66 @@ KernelRefDef::KernelRefDef(const CentaurusConfig &ACLConfig,
                          << "delete cache directory '" << OpenCLCacheDir
                          << "' to regenerate the build log.\n";
 
-        PlatformDef += Platform.Definition;
-        PreAPIDef += PlatformDef;
-        PlatformTable += PlatformTableName + "[" "PL_" + Platform.PlatformName + "] = " + Platform.NameRef + ";";
-
         llvm::outs() << "\n";
         //llvm::outs() << "\n#################################\n";
     }
 
-    const ClauseKind BindMode = (SubtaskPrintMode == K_PRINT_ACCURATE_SUBTASK) ? CK_BIND : CK_BIND_APPROXIMATE;
+    // the device of a task is not known at compile time, every launch gets
+    // its own copy of the descriptor, a queued task keeps its device type
+    if (!StaticDeviceType)
+        SiteDefinition = "struct _kernel_struct " + HostCode.NameRef + "__site = " + HostCode.NameRef + ";"
+            + HostCode.NameRef + "__site.device_type = " + DeviceType + ";";
+}
 
-    HostCode.NameRef = "__acl_kernel_" + DeviceCode.NameRef;
-    HostCode.Definition = PreAPIDef + PlatformTable
-        + "struct _kernel_struct *" + HostCode.NameRef + " = (struct _kernel_struct*)acl_malloc(sizeof(struct _kernel_struct));"
-        "*" + HostCode.NameRef + " = (struct _kernel_struct){"
-        + ".device_type = " + setDeviceType(DI,BindMode)
-        + ",.UID = " + toString(getKernelUID(DeviceCode.NameRef))
-        + ",.name = \"" + DeviceCode.NameRef + "\""
-        + ",.name_size = " + toString(DeviceCode.NameRef.size())
-        + ",.src = " + InlineDeviceCode.NameRef
-        + ",.src_size = " + toString(__inline_definition.size())
-        + ",.platform_table = " + PlatformTableName
-        + "};";
+void KernelRefDef::printInlineSource(raw_ostream &OS) const {
+    if (InlineDeviceCode.NameRef.empty())
+        return;
+    OS << "const char " << InlineDeviceCode.NameRef << "[" << InlineSize << "] = \"";
+    writeCStringLiteral(OS,InlineSource);
+    OS << "\";";
+}
 
-    SourceManager &SM = Context->getSourceManager();
-    std::string FileName = SM.getFileEntryForID(SM.getMainFileID())->getName();
-    std::string Suffix = "_ocl_";
-    std::string NewDeviceImpl = RemoveDotExtension(FileName) + Suffix + DeviceCode.NameRef + ".cl";
-    NewOpenCLFiles.push_back(std::make_pair(NewDeviceImpl,__offline));
+void KernelRefDef::printHostCode(raw_ostream &OS) const {
+    if (HostCode.NameRef.empty() || HostCode.NameRef.compare("NULL") == 0)
+        return;
+
+    const std::string PlatformTableName = PrefixDef + "PLATFORM_TABLE";
+
+    // the device tables of the platforms
+    for (std::vector<PlatformBin>::const_iterator
+             II = Binary.begin(), EE = Binary.end(); II != EE; ++II)
+        OS << II->Definition;
+    if (CPUVariant)
+        OS << CPUVariant->HostCode.HeaderDecl;
+
+    // file scope tables, the task sites only take the address of the kernel
+    OS << "static struct _platform_bin " << PlatformTableName << "[ACL_SUPPORTED_PLATFORMS_NUM] = {";
+    if (Binary.empty())
+        OS << "{0}";
+    for (std::vector<PlatformBin>::const_iterator
+             II = Binary.begin(), EE = Binary.end(); II != EE; ++II) {
+        OS << (II == Binary.begin() ? "" : ",")
+           << "[PL_" << II->PlatformName << "] = {"
+           << ".device_table = " << II->NameRef
+           << ",.device_num = " << II->size();
+        // the runtime chooses it for the CPU devices of the platform
+        if (CPUVariant)
+            OS << ",.cpu_variant = " << CPUVariant->getHostRef();
+        OS << "}";
+    }
+    OS << "};";
+
+    OS << "struct _kernel_struct " << HostCode.NameRef << " = {"
+       << ".device_type = " << (StaticDeviceType ? DeviceType : "0")
+       << ",.UID = " << KernelUIDMap.lookup(DeviceCode.NameRef)
+       << ",.name = \"" << DeviceCode.NameRef << "\""
+       << ",.name_size = " << DeviceCode.NameRef.size()
+       << ",.src = " << InlineDeviceCode.NameRef
+       << ",.src_size = " << InlineSize
+       << ",.platform_table = " << PlatformTableName;
+    if (VectorWidth)
+        OS << ",.vector_width = " << VectorWidth;
+    OS << "};\n";
 }
 
 size_t KernelRefDef::getKernelUID(std::string Name) {
@@ -372,8 +1356,11 @@ size_t KernelRefDef::getKernelUID(std::string Name) {
         return 0;
     UIDKernelMap::const_iterator II = KernelUIDMap.find(Name);
     if (II == KernelUIDMap.end()) {
-        KernelUIDMap[Name] = ++KUID;
-        return KUID;
+        // namespace the UIDs by translation unit, the runtime sees the kernels
+        // of all the input files
+        size_t UID = ((size_t)ACLConfig.TUIndex << 16) | ++KUID;
+        KernelUIDMap[Name] = UID;
+        return UID;
     }
     return II->getValue();
 }
@@ -387,6 +1374,35 @@ static FunctionDecl *getApproxFunctionDecl(DirectiveInfo *DI) {
     return 0;
 }
 
+// the approximate kernel that acl generates if there is no approxfun()
+static KernelApproximation getKernelApproximation(DirectiveInfo *DI) {
+    KernelApproximation Approx;
+    if (ClauseInfo *CI = getClauseOfKind(DI->getClauseList(),CK_PERFORATE))
+        Approx.PerforationRate = CI->getArg()->getICE().getZExtValue();
+    Approx.RelaxedMath = getClauseOfKind(DI->getClauseList(),CK_RELAXED_MATH) != 0;
+    return Approx;
+}
+
+// number of work-items of a work-group, 0 if not known at compile time
+static size_t getWorkGroupSize(DirectiveInfo *DI) {
+    ClauseInfo *Workers = getClauseOfKind(DI->getClauseList(),CK_WORKERS);
+    if (!Workers)
+        return 0;
+
+    size_t Size = 1;
+    for (ArgVector::iterator
+             IA = Workers->getArgs().begin(), EA = Workers->getArgs().end(); IA != EA; ++IA) {
+        if (!(*IA)->isICE())
+            return 0;
+        Size *= (*IA)->getICE().getZExtValue();
+    }
+    return Size;
+}
+
+static std::string getTaskSiteTable(clang::ASTContext *Context) {
+    return "__acl_task_sites_" + getTUSymbolTag(Context);
+}
+
 static std::string getTaskid(DirectiveInfo *DI) {
     ClauseList &CList = DI->getClauseList();
     for (ClauseList::iterator
@@ -401,6 +1417,7 @@ struct KernelSrc {
     std::string Definition;
 
     clang::ASTContext *Context;
+    DirectiveInfo *DI;
 
     KernelRefDef *AccurateKernel;
     KernelRefDef *ApproximateKernel;
@@ -409,24 +1426,41 @@ struct KernelSrc {
     KernelSrc(clang::ASTContext *Context, clang::CallGraph *CG,
               DirectiveInfo *DI, int TaskUID,
               std::string &Extensions, std::string &UserTypes) :
-        Context(Context),
+        Context(Context), DI(DI),
         AccurateKernel(0), ApproximateKernel(0), EvaluationKernel(0)
     {
         CreateKernel(Context,CG,DI,Extensions,UserTypes);
+        NameRef = "__acl_task_exe";
+    }
 
+    KernelSrc(clang::ASTContext *Context, clang::CallGraph *CG,
+              const TaskFusion &Fusion, int TaskUID,
+              std::string &Extensions, std::string &UserTypes) :
+        Context(Context), DI(Fusion.First),
+        AccurateKernel(0), ApproximateKernel(0), EvaluationKernel(0)
+    {
+        CreateFusedKernel(Context,CG,Fusion,Extensions,UserTypes);
         NameRef = "__acl_task_exe";
-        Definition = AccurateKernel->HostCode.Definition;
+    }
 
-        std::string ApproxName = ApproximateKernel ? ApproximateKernel->HostCode.NameRef : "NULL";
-        if (ApproximateKernel)
-            Definition += ApproximateKernel->HostCode.Definition;
+    //the Definition needs the kernel binaries, call after KernelScheduler.run()
+    void finalize() {
+        AccurateKernel->finalize();
+        Definition = AccurateKernel->SiteDefinition;
+
+        std::string ApproxName = ApproximateKernel ? ApproximateKernel->getSiteRef() : "NULL";
+        if (ApproximateKernel) {
+            ApproximateKernel->finalize();
+            Definition += ApproximateKernel->SiteDefinition;
+        }
 
         std::string EstimationName = "NULL";
-        std::string EvalfunName = EvaluationKernel ? EvaluationKernel->HostCode.NameRef : "NULL";
+        std::string EvalfunName = EvaluationKernel ? EvaluationKernel->getSiteRef() : "NULL";
 
         if (ACLConfig.ProfileMode) {
             if (EvaluationKernel) {
-                Definition += EvaluationKernel->HostCode.Definition;
+                EvaluationKernel->finalize();
+                Definition += EvaluationKernel->SiteDefinition;
 
                 ClauseInfo *ClauseEstimation = getClauseOfKind(DI->getClauseList(),CK_ESTIMATION);
                 ClauseInfo *ClauseEvalfun = getClauseOfKind(DI->getClauseList(),CK_EVALFUN);
@@ -450,7 +1484,7 @@ struct KernelSrc {
 
         Definition += "struct _task_executable " + NameRef + " = {"
             //+ ".UID = " + toString(TaskUID)
-            + ".kernel_accurate = " + AccurateKernel->HostCode.NameRef
+            + ".kernel_accurate = " + AccurateKernel->getSiteRef()
             + ",.kernel_approximate = " + ApproxName
             + ",.kernel_evalfun = " + EvalfunName
             + ",.estimation = " + EstimationName
@@ -461,6 +1495,9 @@ private:
     void CreateKernel(clang::ASTContext *Context, clang::CallGraph *CG,
                       clang::centaurus::DirectiveInfo *DI,
                       std::string &Extensions, std::string &UserTypes);
+    void CreateFusedKernel(clang::ASTContext *Context, clang::CallGraph *CG,
+                           const TaskFusion &Fusion,
+                           std::string &Extensions, std::string &UserTypes);
 
 };
 
@@ -479,6 +1516,24 @@ struct TaskSrc {
     std::string HostCall;
     std::string KernelCode;
 
+    //the index in TaskSites, -1 if the site is not static
+    int SiteIndex;
+
+    //one call for the Num tasks of a counted loop, Args holds the
+    //memory objects of every task, see --batch-tasks
+    std::string getRangeHostCall(const std::string &Args, const std::string &Num) const {
+        return SiteDef
+            + SiteCall + "_range("
+            + Approx + ","
+            + Args + "," + MemObjInfo.NumArgs + ","
+            + OpenCLCode.NameRef + ","
+            + Geometry.NameRef + ","
+            + "__acl_group_label" + ","
+            + SiteArgs + ","
+            + Num
+            + ");";
+    }
+
     TaskSrc(clang::ASTContext *Context, clang::CallGraph *CG, DirectiveInfo *DI,
             SmallVector<VarDecl *,4> &IterationSpace,
             clang::centaurus::RegionStack &RStack,
@@ -488,9 +1543,43 @@ struct TaskSrc {
         Approx(getTaskApprox(Context,DI)),
         MemObjInfo(Context,DI,RStack),
         Geometry(DI,Context),
-        OpenCLCode(Context,CG,DI,++TaskUID,Extensions,UserTypes)
+        OpenCLCode(Context,CG,DI,++TaskUID,Extensions,UserTypes),
+        SiteIndex(-1)
+    {
+        init(Context,DI,IterationSpace);
+    }
+
+    //one task for the two tasks of Fusion
+    TaskSrc(clang::ASTContext *Context, clang::CallGraph *CG, const TaskFusion &Fusion,
+            SmallVector<VarDecl *,4> &IterationSpace,
+            clang::centaurus::RegionStack &RStack,
+            clang::tooling::Replacements &ReplacementPool,
+            std::string &Extensions, std::string &UserTypes) :
+        Label(getTaskLabel(Fusion.First)),
+        Approx(getTaskApprox(Context,Fusion.First)),
+        MemObjInfo(Context,Fusion,RStack),
+        Geometry(Fusion.First,Context),
+        OpenCLCode(Context,CG,Fusion,++TaskUID,Extensions,UserTypes),
+        SiteIndex(-1)
     {
+        init(Context,Fusion.First,IterationSpace);
+    }
+
+private:
+    //label and source location of the site
+    std::string SiteDef;
+    std::string SiteCall;
+    std::string SiteArgs;
+
+    void init(clang::ASTContext *Context, DirectiveInfo *DI,
+              SmallVector<VarDecl *,4> &IterationSpace) {
         PLoc = Context->getSourceManager().getPresumedLoc(DI->getLocStart());
+
+        if (ACLConfig.StaticTaskSites) {
+            initStaticSite(Context,DI,IterationSpace);
+            return;
+        }
+
         std::string SrcLocID = "\"" + GetBasename(PLoc.getFilename()) + ":" + toString(PLoc.getLine());
 
         std::string ExtraArgs;
@@ -509,14 +1598,67 @@ struct TaskSrc {
         std::string SrcLocDef = "char *__acl_srcloc;asprintf(&__acl_srcloc," + SrcLocID + ExtraArgs + ");";
         std::string LabelDef = "const char *__acl_group_label = " + Label + ";";
 
-        HostCall = LabelDef + SrcLocDef
-            + "acl_create_task("
+        SiteDef = LabelDef + SrcLocDef;
+        SiteCall = "acl_create_task";
+        SiteArgs = "__acl_srcloc";
+
+        initHostCall();
+    }
+
+    //the site is an entry of the static site table, only the values of the
+    //loop variables are passed at each launch
+    void initStaticSite(clang::ASTContext *Context, DirectiveInfo *DI,
+                        SmallVector<VarDecl *,4> &IterationSpace) {
+        const std::string SiteID = toString(TaskSites.size());
+
+        std::string IterationVars;
+        std::string IterationValues;
+        for (SmallVector<VarDecl *,4>::iterator
+                 II = IterationSpace.begin(), EE = IterationSpace.end(); II != EE; ++II) {
+            if (II != IterationSpace.begin()) {
+                IterationVars += ",";
+                IterationValues += ",";
+            }
+            IterationVars += "\"" + (*II)->getNameAsString() + "\"";
+            IterationValues += "(long long)" + (*II)->getNameAsString();
+        }
+        if (IterationSpace.empty()) {
+            IterationVars = "NULL";
+            IterationValues = "NULL";
+        }
+        else {
+            IterationVars = "(const char * const[]){" + IterationVars + "}";
+            // wide enough for the long and size_t loop variables
+            IterationValues = "(const long long[]){" + IterationValues + "}";
+        }
+
+        std::string Taskid = getTaskid(DI);
+        SiteIndex = TaskSites.size();
+        TaskSites.push_back(TaskSite(".id = " + SiteID
+                                     + ",.file = \"" + GetBasename(PLoc.getFilename()) + "\""
+                                     + ",.line = " + toString(PLoc.getLine())
+                                     + ",.taskid = " + (Taskid.size() ? Taskid : "NULL")
+                                     + ",.iteration_vars = " + IterationVars
+                                     + ",.num_iteration_vars = " + toString(IterationSpace.size())));
+
+        std::string LabelDef = "const char *__acl_group_label = " + Label + ";";
+
+        SiteDef = LabelDef;
+        SiteCall = "acl_create_task_site";
+        SiteArgs = "&" + getTaskSiteTable(Context) + "[" + SiteID + "]," + IterationValues;
+
+        initHostCall();
+    }
+
+    void initHostCall() {
+        HostCall = SiteDef
+            + SiteCall + "("
             + Approx + ","
             + MemObjInfo.NameRef + "," + MemObjInfo.NumArgs + ","
             + OpenCLCode.NameRef + ","
             + Geometry.NameRef + ","
             + "__acl_group_label" + ","
-            + "__acl_srcloc"
+            + SiteArgs
             + ");";
 
         KernelCode = OpenCLCode.AccurateKernel->DeviceCode.Definition;
@@ -524,7 +1666,6 @@ struct TaskSrc {
             KernelCode += OpenCLCode.ApproximateKernel->DeviceCode.Definition;
     }
 
-private:
     std::string getTaskLabel(DirectiveInfo *DI) {
         ClauseList &CList = DI->getClauseList();
         for (ClauseList::iterator
@@ -546,8 +1687,35 @@ private:
 };
 
 int TaskSrc::TaskUID = 0;
+
+//the task directives of a static site for analyzeTaskDeps()
+static void recordTaskSite(TaskSrc *Task, FunctionDecl *FD, bool InLoop,
+                           DirectiveInfo *DI, DirectiveInfo *Second = 0) {
+    if (Task->SiteIndex < 0)
+        return;
+    TaskSite &Site = TaskSites[Task->SiteIndex];
+    Site.Function = FD;
+    Site.InLoop = InLoop;
+    Site.Directives.push_back(DI);
+    if (Second)
+        Site.Directives.push_back(Second);
+}
 UIDKernelMap KernelRefDef::KernelUIDMap;
 
+//task sites wait for the kernel builds, see Stage1_ASTVisitor::Finish()
+struct PendingTask {
+    TaskSrc *Task;
+    std::string DirectiveSrc;
+    CharSourceRange Range;
+    //the loop of a batched task, NULL for a single task
+    const TaskRange *Loop;
+
+    PendingTask(TaskSrc *Task, std::string DirectiveSrc, CharSourceRange Range,
+                const TaskRange *Loop = NULL) :
+        Task(Task), DirectiveSrc(DirectiveSrc), Range(Range), Loop(Loop) {}
+};
+static std::vector<PendingTask> PendingTasks;
+
 void
 KernelSrc::CreateKernel(clang::ASTContext *Context, clang::CallGraph *CG, DirectiveInfo *DI,
                         std::string &Extensions, std::string &UserTypes) {
@@ -566,17 +1734,26 @@ KernelSrc::CreateKernel(clang::ASTContext *Context, clang::CallGraph *CG, Direct
 
     llvm::DenseMap<FunctionDecl *, KernelRefDef *>::iterator Kref;
 
+    KernelApproximation Approx = getKernelApproximation(DI);
+
+    KernelSpecialization Spec;
+    if (ACLConfig.SpecializeKernels)
+        Spec = getKernelSpecialization(Context,CE,AccurateFun);
+
     //top level kernel call
     if (Context->isFunctionWithSubtasks(AccurateFun)) {
         assert(!ApproxFun);
 
         llvm::outs() << "Kernel '" << AccurateFun->getNameAsString() << "' has subtasks\n";
+        if (!Approx.empty())
+            llvm::outs() << WARNING
+                         << "perforate() and relaxed_math are ignored, the approximate version is given by the subtasks\n";
 
         Kref = KernelAccuratePool.find(AccurateFun);
         if (Kref != KernelAccuratePool.end())
             AccurateKernel = Kref->second;
         else {
-            AccurateKernel = new KernelRefDef(ACLConfig,
+            AccurateKernel = new KernelRefDef(ACLConfig,KernelScheduler,
                                               Context,AccurateFun,CG,DI,
                                               Extensions,UserTypes,
                                               K_PRINT_ACCURATE_SUBTASK);
@@ -587,7 +1764,7 @@ KernelSrc::CreateKernel(clang::ASTContext *Context, clang::CallGraph *CG, Direct
         if (Kref != KernelApproximatePool.end())
             ApproximateKernel = Kref->second;
         else {
-            ApproximateKernel = new KernelRefDef(ACLConfig,
+            ApproximateKernel = new KernelRefDef(ACLConfig,KernelScheduler,
                                                  Context,AccurateFun,CG,DI,
                                                  Extensions,UserTypes,
                                                  K_PRINT_APPROXIMATE_SUBTASK);
@@ -595,28 +1772,84 @@ KernelSrc::CreateKernel(clang::ASTContext *Context, clang::CallGraph *CG, Direct
         }
     }
     else {
-        Kref = KernelAccuratePool.find(AccurateFun);
-        if (Kref != KernelAccuratePool.end())
-            AccurateKernel = Kref->second;
+        if (Spec.empty()) {
+            Kref = KernelAccuratePool.find(AccurateFun);
+            if (Kref != KernelAccuratePool.end())
+                AccurateKernel = Kref->second;
+            else {
+                AccurateKernel = new KernelRefDef(ACLConfig,KernelScheduler,
+                                                  Context,AccurateFun,CG,DI,
+                                                  Extensions,UserTypes,
+                                                  K_PRINT_ACCURATE_SUBTASK);
+                KernelAccuratePool[AccurateFun] = AccurateKernel;
+
+                KernelVectorization Vec;
+                if (ACLConfig.CPUVectorWidth)
+                    Vec = getKernelVectorization(Context,AccurateFun,ACLConfig.CPUVectorWidth);
+                if (!Vec.empty()) {
+                    AccurateKernel->CPUVariant = new KernelRefDef(ACLConfig,KernelScheduler,
+                                                                  Context,AccurateFun,Vec,CG,DI,
+                                                                  Extensions,UserTypes);
+                    KernelVectorPool[AccurateFun] = AccurateKernel->CPUVariant;
+                    llvm::outs() << NOTE << "kernel '" << AccurateFun->getNameAsString()
+                                 << "' vectorised for CPU devices, " << Vec.Width
+                                 << " elements per work-item\n";
+                }
+            }
+        }
         else {
-            AccurateKernel = new KernelRefDef(ACLConfig,
-                                              Context,AccurateFun,CG,DI,
-                                              Extensions,UserTypes,
-                                              K_PRINT_ACCURATE_SUBTASK);
-            KernelAccuratePool[AccurateFun] = AccurateKernel;
+            std::string Key = Spec.getKey(AccurateFun->getNameAsString());
+            std::map<std::string,KernelRefDef *>::iterator Sref = KernelSpecializedPool.find(Key);
+            if (Sref != KernelSpecializedPool.end())
+                AccurateKernel = Sref->second;
+            else {
+                Spec.Name = getUniqueKernelName(AccurateFun->getNameAsString() + "__spec");
+                AccurateKernel = new KernelRefDef(ACLConfig,KernelScheduler,
+                                                  Context,AccurateFun,Spec,CG,DI,
+                                                  Extensions,UserTypes);
+                KernelSpecializedPool[Key] = AccurateKernel;
+                llvm::outs() << NOTE << "kernel '" << AccurateFun->getNameAsString()
+                             << "' specialised as '" << Spec.Name << "' for "
+                             << Spec.Constants.size() << " constant argument(s)\n";
+            }
         }
         if (ApproxFun) {
             Kref = KernelApproximatePool.find(ApproxFun);
             if (Kref != KernelApproximatePool.end())
                 ApproximateKernel = Kref->second;
             else {
-                ApproximateKernel = new KernelRefDef(ACLConfig,
+                ApproximateKernel = new KernelRefDef(ACLConfig,KernelScheduler,
                                                      Context,ApproxFun,CG,DI,
                                                      Extensions,UserTypes,
                                                      K_PRINT_APPROXIMATE_SUBTASK);
                 KernelApproximatePool[ApproxFun] = ApproximateKernel;
             }
         }
+        else if (!Approx.empty()) {
+            std::string Name = AccurateFun->getNameAsString() + Approx.getSuffix();
+            std::map<std::string,KernelRefDef *>::iterator Gref = KernelGeneratedPool.find(Name);
+            if (Gref != KernelGeneratedPool.end())
+                ApproximateKernel = Gref->second;
+            else {
+                ApproximateKernel = new KernelRefDef(ACLConfig,KernelScheduler,
+                                                     Context,AccurateFun,Approx,CG,DI,
+                                                     Extensions,UserTypes);
+                KernelGeneratedPool[Name] = ApproximateKernel;
+            }
+        }
+    }
+
+    // geometry of this task, for the resource report
+    const size_t WorkGroupSize = getWorkGroupSize(DI);
+    if (AccurateKernel)
+        AccurateKernel->addWorkGroupSize(WorkGroupSize);
+    if (ApproximateKernel)
+        ApproximateKernel->addWorkGroupSize(WorkGroupSize);
+
+    if (ACLConfig.Autotune) {
+        AccurateKernel->setAutotune(Context,AccurateFun,DI);
+        if (ApproximateKernel)
+            ApproximateKernel->setAutotune(Context,ApproxFun ? ApproxFun : AccurateFun,DI);
     }
 
     ClauseInfo *ClauseEvalfun = getClauseOfKind(DI->getClauseList(),CK_EVALFUN);
@@ -633,11 +1866,94 @@ KernelSrc::CreateKernel(clang::ASTContext *Context, clang::CallGraph *CG, Direct
             if (Kref != KernelEvaluatePool.end())
                 EvaluationKernel = Kref->second;
             else {
-                EvaluationKernel = new KernelRefDef(ACLConfig,Context,Evalfun,CG,DI,Extensions,UserTypes);
+                EvaluationKernel = new KernelRefDef(ACLConfig,KernelScheduler,Context,Evalfun,CG,DI,Extensions,UserTypes);
                 KernelEvaluatePool[Evalfun] = EvaluationKernel;
             }
+            EvaluationKernel->addWorkGroupSize(WorkGroupSize);
+            if (ACLConfig.Autotune)
+                EvaluationKernel->setAutotune(Context,Evalfun,DI);
+        }
+    }
+}
+
+static FunctionDecl *getTaskKernel(DirectiveInfo *DI) {
+    CallExpr *CE = dyn_cast<CallExpr>(DI->getAclStmt()->getSubStmt());
+    if (!CE)
+        return 0;
+    return CE->getDirectCallee();
+}
+
+// The fused kernel runs the kernel of the first task and then the kernel of the
+// second one. A barrier only orders the work-items of a work-group, so every
+// work-group of the second task may only read the elements of the intermediate
+// buffers written by the same work-group of the first task: analyzeTaskFusion()
+// only fuses kernels whose work-items touch their own elements.
+static ObjRefDef printFusedKernel(clang::ASTContext *Context, const TaskFusion &Fusion) {
+    FunctionDecl *FirstFun = getTaskKernel(Fusion.First);
+    FunctionDecl *SecondFun = getTaskKernel(Fusion.Second);
+
+    // the shared arguments are part of the name, the same pair of kernels may
+    // be fused differently by other tasks
+    std::string Name = FirstFun->getNameAsString() + "__" + SecondFun->getNameAsString() + "__fused";
+    for (std::vector<unsigned>::const_iterator
+             II = Fusion.SecondArgs.begin(), EE = Fusion.SecondArgs.end(); II != EE; ++II)
+        Name += "_" + toString(*II);
+
+    std::vector<std::string> Params(Fusion.NumArgs);
+
+    std::string FirstCall = FirstFun->getNameAsString() + "(";
+    for (unsigned i = 0; i < FirstFun->getNumParams(); ++i) {
+        std::string ParamName = "__acl_fused_" + toString(i);
+        raw_string_ostream OS(Params[i]);
+        FirstFun->getParamDecl(i)->getType().print(OS,Context->getPrintingPolicy(),ParamName);
+        OS.flush();
+        FirstCall += (i ? "," : "") + ParamName;
+    }
+    FirstCall += ");";
+
+    std::string SecondCall = SecondFun->getNameAsString() + "(";
+    for (unsigned i = 0; i < SecondFun->getNumParams(); ++i) {
+        const unsigned KI = Fusion.SecondArgs[i];
+        std::string ParamName = "__acl_fused_" + toString(KI);
+        if (KI >= FirstFun->getNumParams()) {
+            raw_string_ostream OS(Params[KI]);
+            SecondFun->getParamDecl(i)->getType().print(OS,Context->getPrintingPolicy(),ParamName);
+            OS.flush();
         }
+        SecondCall += (i ? "," : "") + ParamName;
     }
+    SecondCall += ");";
+
+    std::string Def = "__kernel void " + Name + "(";
+    for (std::vector<std::string>::iterator II = Params.begin(), EE = Params.end(); II != EE; ++II)
+        Def += (II != Params.begin() ? ", " : "") + *II;
+    Def += ") {\n"
+        + FirstCall + "\n"
+        + "barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);\n"
+        + SecondCall + "\n"
+        + "}\n\n";
+
+    return ObjRefDef(Name,Def);
+}
+
+void
+KernelSrc::CreateFusedKernel(clang::ASTContext *Context, clang::CallGraph *CG, const TaskFusion &Fusion,
+                             std::string &Extensions, std::string &UserTypes) {
+    ObjRefDef FusedKernel = printFusedKernel(Context,Fusion);
+
+    std::map<std::string,KernelRefDef *>::iterator Kref = KernelFusedPool.find(FusedKernel.NameRef);
+    if (Kref != KernelFusedPool.end())
+        AccurateKernel = Kref->second;
+    else {
+        AccurateKernel = new KernelRefDef(ACLConfig,KernelScheduler,Context,
+                                          getTaskKernel(Fusion.First),getTaskKernel(Fusion.Second),
+                                          FusedKernel,CG,Fusion.First,
+                                          Extensions,UserTypes);
+        KernelFusedPool[FusedKernel.NameRef] = AccurateKernel;
+    }
+
+    // geometry of this task, for the resource report
+    AccurateKernel->addWorkGroupSize(getWorkGroupSize(Fusion.First));
 }
 
 void GeometrySrc::init(DirectiveInfo *DI, clang::ASTContext *Context) {
@@ -744,6 +2060,23 @@ std::string acl::KernelHeader =
 #ifdef __ACL_PROFILE_MODE__\n\
 int __acl_builtin__incBB(__global int *prof, int num) {\
     return atomic_inc(&prof[num]);\
+}\n\
+#ifndef ACL_PROFILE_SAMPLE\n#define ACL_PROFILE_SAMPLE 1\n#endif\n\
+#define __ACL_LOCAL_LINEAR_ID__ (get_local_id(0) + get_local_size(0) * (get_local_id(1) + get_local_size(1) * get_local_id(2)))\n\
+#define __ACL_LOCAL_LINEAR_SIZE__ (get_local_size(0) * get_local_size(1) * get_local_size(2))\n\
+#define __ACL_GROUP_LINEAR_ID__ (get_group_id(0) + get_num_groups(0) * (get_group_id(1) + get_num_groups(1) * get_group_id(2)))\n\
+#define __ACL_PROFILE_BB_BEGIN__(n) \
+__local int __acl_bb[n]; \
+const int __acl_bb_sampled = __ACL_GROUP_LINEAR_ID__ % ACL_PROFILE_SAMPLE == 0; \
+for (size_t __acl_i = __ACL_LOCAL_LINEAR_ID__; __acl_i < (n); __acl_i += __ACL_LOCAL_LINEAR_SIZE__) __acl_bb[__acl_i] = 0; \
+barrier(CLK_LOCAL_MEM_FENCE);\n\
+#define __ACL_PROFILE_BB_END__(n,prof) \
+barrier(CLK_LOCAL_MEM_FENCE); \
+if (__acl_bb_sampled) \
+for (size_t __acl_i = __ACL_LOCAL_LINEAR_ID__; __acl_i < (n); __acl_i += __ACL_LOCAL_LINEAR_SIZE__) \
+if (__acl_bb[__acl_i]) atomic_add(&(prof)[__acl_i], __acl_bb[__acl_i] * ACL_PROFILE_SAMPLE);\n\
+int __acl_builtin__incBB_local(__local int *bb, int sampled, int num) {\
+    return sampled ? atomic_inc(&bb[num]) : 0;\
 }\
 \n#endif\n\n\
 #ifndef CLK_LOCAL_MEM_FENCE\n#define CLK_LOCAL_MEM_FENCE 1\n#endif\n    \
@@ -873,7 +2206,7 @@ Stage0_ASTVisitor::Finish(ASTContext *Context) {
 
     std::string Suffix("_acl");
     std::string Ext = GetDotExtension(FileName);
-    std::string NewFile = RemoveDotExtension(FileName) + Suffix + Ext;
+    NewFile = RemoveDotExtension(FileName) + Suffix + Ext;
 
     //Create new C file
 
@@ -964,6 +2297,12 @@ Stage1_ASTVisitor::VisitAclStmt(AclStmt *ACC) {
         << " in " << ND->getName() << "(): "
         << "Found Centaurus Directive: " << DI->getAsString() << "\n";
 
+    std::map<DirectiveInfo *,TaskFusion>::iterator Fused = TaskFusions.find(DI);
+    if (Fused != TaskFusions.end() && Fused->second.Second == DI) {
+        llvm::outs() << "  -  Fused with the previous task\n\n";
+        return true;
+    }
+
     if (DI->getKind() == DK_TASKWAIT) {
         //generate runtime calls for taskwait
         ClauseList &CList = DI->getClauseList();
@@ -1032,18 +2371,52 @@ Stage1_ASTVisitor::VisitAclStmt(AclStmt *ACC) {
             return true;
         }
 
-        TaskSrc NewTask(Context,CG,DI,IterationSpace,RStack,ReplacementPool,
-                        acl::OpenCLExtensions,UserTypes);
-
+        TaskSrc *NewTask;
         std::string DirectiveSrc =
             DI->getPrettyDirective(Context->getPrintingPolicy(),false);
-        std::string NewCode = "/*" + DirectiveSrc + "*/\n"
-            + "{"
-            + NewTask.MemObjInfo.Definition
-            + NewTask.Geometry.Definition
-            + NewTask.OpenCLCode.Definition
-            + NewTask.HostCall
-            + "}";
+
+        std::map<DirectiveInfo *,TaskRange>::iterator Batched = TaskRanges.find(DI);
+        if (Batched != TaskRanges.end()) {
+            const TaskRange &Loop = Batched->second;
+            llvm::outs() << "  -  Batch the tasks of the loop over '"
+                         << Loop.Var->getNameAsString() << "'\n";
+            //the source location of the batch is the one of its loop
+            assert(IterationSpace.size() && IterationSpace.back() == Loop.Var);
+            SmallVector<VarDecl *,4> OuterSpace(IterationSpace.begin(),IterationSpace.end() - 1);
+            NewTask = new TaskSrc(Context,CG,DI,OuterSpace,RStack,ReplacementPool,
+                                  acl::OpenCLExtensions,UserTypes);
+            recordTaskSite(NewTask,CurrentFunction,true,DI);
+
+            // the task replaces the whole loop
+            SourceLocation PrologueLoc = Loop.ForLoop->getLocStart();
+            SourceLocation EpilogueLoc;
+            if (isa<CompoundStmt>(Loop.ForLoop->getBody()))
+                EpilogueLoc = Loop.ForLoop->getLocEnd().getLocWithOffset(1);
+            else
+                EpilogueLoc = SubStmt->getLocEnd().getLocWithOffset(2);
+
+            CharSourceRange Range(SourceRange(PrologueLoc,EpilogueLoc),/*IsTokenRange=*/false);
+            PendingTasks.push_back(PendingTask(NewTask,DirectiveSrc,Range,&Loop));
+            llvm::outs() << "\n";
+            return true;
+        }
+
+        if (Fused != TaskFusions.end()) {
+            const TaskFusion &Fusion = Fused->second;
+            llvm::outs() << "  -  Fuse with the next task '"
+                         << getTaskKernel(Fusion.Second)->getNameAsString() << "'\n";
+            NewTask = new TaskSrc(Context,CG,Fusion,IterationSpace,RStack,ReplacementPool,
+                                  acl::OpenCLExtensions,UserTypes);
+            recordTaskSite(NewTask,CurrentFunction,!IterationSpace.empty(),Fusion.First,Fusion.Second);
+            DirectiveSrc += Fusion.Second->getPrettyDirective(Context->getPrintingPolicy(),false);
+            // the task replaces both statements
+            SubStmt = Fusion.Second->getAclStmt()->getSubStmt();
+        }
+        else {
+            NewTask = new TaskSrc(Context,CG,DI,IterationSpace,RStack,ReplacementPool,
+                                  acl::OpenCLExtensions,UserTypes);
+            recordTaskSite(NewTask,CurrentFunction,!IterationSpace.empty(),DI);
+        }
 
         SourceLocation PrologueLoc = DI->getLocStart().getLocWithOffset(-8);
         SourceLocation EpilogueLoc;
@@ -1055,8 +2428,7 @@ Stage1_ASTVisitor::VisitAclStmt(AclStmt *ACC) {
             EpilogueLoc = SubStmt->getLocEnd().getLocWithOffset(2);
 
         CharSourceRange Range(SourceRange(PrologueLoc,EpilogueLoc),/*IsTokenRange=*/false);
-        Replacement HostCall(Context->getSourceManager(),Range,NewCode);
-        applyReplacement(ReplacementPool,HostCall);
+        PendingTasks.push_back(PendingTask(NewTask,DirectiveSrc,Range));
     }
     else if (DI->getKind() == DK_TASKGROUP) {
         //geterate runtime calls for taskgroup
@@ -1234,10 +2606,105 @@ static Arg *getMatchedArg(Arg *A, SmallVector<Arg*,8> &Pool, ASTContext *Context
     return 0;
 }
 
+// another variable of the function has the name of VD
+static bool isShadowed(Stmt *S, VarDecl *VD) {
+    if (DeclStmt *DS = dyn_cast<DeclStmt>(S))
+        for (DeclStmt::decl_iterator
+                 II = DS->decl_begin(), EE = DS->decl_end(); II != EE; ++II) {
+            VarDecl *Other = dyn_cast<VarDecl>(*II);
+            if (Other && Other != VD && Other->getName() == VD->getName())
+                return true;
+        }
+
+    for (Stmt::child_range range = S->children(); range; ++range)
+        if (*range && isShadowed(*range,VD))
+            return true;
+    return false;
+}
+
+// E has the same value at every point of FD after its first evaluation
+static bool isInvariantSize(Expr *E, FunctionDecl *FD) {
+    E = E->IgnoreParens();
+    if (isa<IntegerLiteral>(E) || isa<CharacterLiteral>(E))
+        return true;
+    if (UnaryExprOrTypeTraitExpr *UE = dyn_cast<UnaryExprOrTypeTraitExpr>(E))
+        return !UE->getTypeOfArgument()->isVariablyModifiedType();
+    if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E)) {
+        if (isa<EnumConstantDecl>(DRE->getDecl()))
+            return true;
+        // the locals and the parameters of FD only, a callee may change any
+        // other variable
+        VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl());
+        return VD && VD->hasLocalStorage() && VD->getParentFunctionOrMethod() == FD &&
+            !isVarModified(FD->getBody(),VD) && !isShadowed(FD->getBody(),VD);
+    }
+    if (CastExpr *CE = dyn_cast<CastExpr>(E))
+        return isInvariantSize(CE->getSubExpr(),FD);
+    if (UnaryOperator *UO = dyn_cast<UnaryOperator>(E))
+        return (UO->getOpcode() == UO_Minus || UO->getOpcode() == UO_Plus ||
+                UO->getOpcode() == UO_Not) && isInvariantSize(UO->getSubExpr(),FD);
+    if (BinaryOperator *BO = dyn_cast<BinaryOperator>(E))
+        return !BO->isAssignmentOp() && BO->getOpcode() != BO_Comma &&
+            isInvariantSize(BO->getLHS(),FD) && isInvariantSize(BO->getRHS(),FD);
+    if (ConditionalOperator *CO = dyn_cast<ConditionalOperator>(E))
+        return isInvariantSize(CO->getCond(),FD) &&
+            isInvariantSize(CO->getTrueExpr(),FD) && isInvariantSize(CO->getFalseExpr(),FD);
+    return false;
+}
+
+// The size in bytes of the buffer E points to, if E is a local pointer that
+// is initialized by an allocation and never changed, the allocation is then
+// in scope of every task that uses it. Empty if the size is not known at
+// compile time, the runtime looks it up by acl_usable_size() instead.
+static std::string getStaticBufferSize(clang::ASTContext *Context, Expr *E) {
+    DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenCasts());
+    VarDecl *VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : 0;
+    if (!VD || isa<ParmVarDecl>(VD) || !VD->hasLocalStorage() || !VD->getInit())
+        return std::string();
+    FunctionDecl *FD = dyn_cast_or_null<FunctionDecl>(VD->getParentFunctionOrMethod());
+    if (!FD || !FD->hasBody() || isVarModified(FD->getBody(),VD))
+        return std::string();
+
+    CallExpr *CE = dyn_cast<CallExpr>(VD->getInit()->IgnoreParenCasts());
+    FunctionDecl *Callee = CE ? CE->getDirectCallee() : 0;
+    if (!Callee)
+        return std::string();
+
+    // the size args of the allocation, before and after the override
+    SmallVector<Expr *,2> Factors;
+    const std::string Name = Callee->getNameAsString();
+    if ((Name.compare("malloc") == 0 || Name.compare("acl_malloc") == 0) && CE->getNumArgs() == 1)
+        Factors.push_back(CE->getArg(0));
+    else if ((Name.compare("calloc") == 0 || Name.compare("acl_calloc") == 0) && CE->getNumArgs() == 2) {
+        Factors.push_back(CE->getArg(0));
+        Factors.push_back(CE->getArg(1));
+    }
+    else if ((Name.compare("realloc") == 0 || Name.compare("acl_realloc") == 0) && CE->getNumArgs() == 2)
+        Factors.push_back(CE->getArg(1));
+    else
+        return std::string();
+
+    std::string Size;
+    for (SmallVector<Expr *,2>::iterator
+             II = Factors.begin(), EE = Factors.end(); II != EE; ++II) {
+        std::string Factor;
+        llvm::APSInt Value;
+        if ((*II)->isIntegerConstantExpr(Value,*Context))
+            Factor = Value.toString(10);
+        else if (isInvariantSize(*II,FD))
+            Factor = getPrettyExpr(Context,*II);
+        else
+            return std::string();
+        Size += (Size.empty() ? "(size_t)(" : "*(") + Factor + ")";
+    }
+    return Size;
+}
+
 ObjRefDef addVarDeclForDevice(clang::ASTContext *Context, Expr *E,
                               clang::centaurus::DirectiveInfo *DI,
                               SmallVector<Arg*,8> &PragmaArgs,
-                              RegionStack &RStack, const int Index) {
+                              RegionStack &RStack, const int Index,
+                              const ClauseKind FusedDep = CK_END) {
     //declare a new var here for the accelerator
 
     E = E->IgnoreParenImpCasts();
@@ -1282,6 +2749,14 @@ ObjRefDef addVarDeclForDevice(clang::ASTContext *Context, Expr *E,
 
     std::string DataDepType;
     ClauseKind CK = A->getParent()->getAsClause()->getKind();
+    // the data clauses of both tasks of a fusion
+    if (FusedDep != CK_END)
+        CK = FusedDep;
+    else {
+        std::map<Arg *,ClauseKind>::iterator Downgrade = TransferDowngrades.find(A);
+        if (Downgrade != TransferDowngrades.end())
+            CK = Downgrade->second;
+    }
     switch (CK) {
     case CK_BUFFER:        DataDepType = "D_BUFFER";        break;
     case CK_LOCAL_BUFFER:  DataDepType = "D_LOCAL_BUFFER";  break;
@@ -1326,7 +2801,10 @@ ObjRefDef addVarDeclForDevice(clang::ASTContext *Context, Expr *E,
     else if (Ty->isPointerType()) {
         // ignore casts here, explicit cast to (void *)
         Address = getPrettyExpr(Context,A->getExpr()->IgnoreParenCasts());
-        SizeExpr = "acl_usable_size((void*)" + Address + ")";
+        // the runtime looks up the size only if it is not known here
+        SizeExpr = getStaticBufferSize(Context,A->getExpr());
+        if (SizeExpr.empty())
+            SizeExpr = "acl_usable_size((void*)" + Address + ")";
         ElementSize = "sizeof(" + Ty->getAs<PointerType>()->getPointeeType().getAsString() + ")";
     }
     else if (isa<ArrayArg>(A)) {
@@ -1361,150 +2839,1189 @@ ObjRefDef addVarDeclForDevice(clang::ASTContext *Context, Expr *E,
         + ",.size = " + SizeExpr
         + "};";
 
-    return ObjRefDef(NewName,NewCode);
+    return ObjRefDef(NewName,NewCode);
+}
+
+static inline
+SourceLocation getLocAfterDecl(FunctionDecl *CurrentFunction, VarDecl *VD, std::string &CreateMem) {
+    //BIG FAT HACK
+    //ne must fix the SourceLocation Issues. Seriously
+
+    SourceLocation DeclLoc;
+    CompoundStmt *Body = cast<CompoundStmt>(CurrentFunction->getBody());
+    for (CompoundStmt::body_iterator
+             IS = Body->body_begin(),
+             ES = Body->body_end(); IS != ES; ++IS) {
+        DeclStmt *DS = dyn_cast<DeclStmt>(*IS);
+        if (!DS)
+            continue;
+        for (DeclStmt::decl_iterator
+                 ID = DS->decl_begin(),
+                 ED = DS->decl_end(); ID != ED; ++ID) {
+            Decl *D = *ID;
+            if (VarDecl *DVD = dyn_cast<VarDecl>(D))
+                if (DVD == VD) {
+                    CompoundStmt::body_iterator NextStmt = IS + 1;
+                    assert(NextStmt != ES);
+                    DeclLoc = (*NextStmt)->getLocStart();
+                    if (isa<AclStmt>(*NextStmt)) {
+                        DeclLoc = DeclLoc.getLocWithOffset(-9);
+                        CreateMem += "\n";
+                    }
+                    return DeclLoc;
+                }
+        }
+    }
+    assert(0 && "Unexpected SourceLocation of Decl");
+    return SourceLocation();
+}
+
+static void getDataClauseArgs(DirectiveInfo *DI, SmallVector<Arg*,8> &PragmaArgs) {
+    ClauseList &CList = DI->getClauseList();
+    for (ClauseList::iterator
+             II = CList.begin(), EE = CList.end(); II != EE; ++II) {
+        ClauseInfo *CI = *II;
+        if (!CI->isDataClause())
+            continue;
+        for (ArgVector::iterator
+                 AI = CI->getArgs().begin(), AE = CI->getArgs().end(); AI != AE; ++AI) {
+            Arg *A = *AI;
+            PragmaArgs.push_back(A);
+        }
+    }
+}
+
+// the bytes of the constant E converted to T, empty if E is not constant
+static std::string getConstantBytes(clang::ASTContext *Context, Expr *E, QualType T) {
+    llvm::APInt Bits;
+    if (T->isIntegerType()) {
+        llvm::APSInt Value;
+        if (!E->isIntegerConstantExpr(Value,*Context))
+            return std::string();
+        Bits = Value.extOrTrunc(Context->getTypeSize(T));
+    }
+    else if (T->isRealFloatingType()) {
+        Expr::EvalResult Result;
+        if (!E->EvaluateAsRValue(Result,*Context))
+            return std::string();
+        llvm::APFloat Value(0.0);
+        if (Result.Val.isFloat())
+            Value = Result.Val.getFloat();
+        else if (Result.Val.isInt())
+            Value.convertFromAPInt(Result.Val.getInt(),Result.Val.getInt().isSigned(),
+                                   llvm::APFloat::rmNearestTiesToEven);
+        else
+            return std::string();
+        bool LosesInfo;
+        Value.convert(Context->getFloatTypeSemantics(T),llvm::APFloat::rmNearestTiesToEven,&LosesInfo);
+        Bits = Value.bitcastToAPInt();
+    }
+    else
+        return std::string();
+
+    // host byte order, as clSetKernelArg() expects
+    std::string Bytes(Bits.getBitWidth() / 8,'\0');
+    for (size_t i = 0; i < Bytes.size(); ++i) {
+        const size_t Byte = llvm::sys::IsLittleEndianHost ? i : Bytes.size() - 1 - i;
+        Bytes[Byte] = (char)Bits.lshr(i * 8).trunc(8).getZExtValue();
+    }
+    return Bytes;
+}
+
+// A kernel whose result or local memory depends on the work-group size, in
+// its body or in a function it calls. --autotune cannot change its local size.
+class LocalSizeUseFinder : public RecursiveASTVisitor<LocalSizeUseFinder> {
+private:
+    llvm::SmallPtrSet<const FunctionDecl *,8> Visited;
+
+public:
+    bool Found;
+
+    LocalSizeUseFinder() : Found(false) {}
+
+    bool find(FunctionDecl *FD) {
+        if (FD->hasBody() && Visited.insert(FD).second)
+            TraverseStmt(FD->getBody());
+        return Found;
+    }
+
+    bool VisitVarDecl(VarDecl *VD) {
+        if (VD->getType().getAddressSpace() == LangAS::opencl_local)
+            Found = true;
+        return !Found;
+    }
+
+    bool VisitCallExpr(CallExpr *CE) {
+        FunctionDecl *Callee = CE->getDirectCallee();
+        if (!Callee)
+            return true;
+        std::string NameStr = Callee->getNameAsString();
+        StringRef Name(NameStr);
+        if (Name == "barrier" || Name == "get_local_id" || Name == "get_local_size" ||
+            Name == "get_group_id" || Name == "get_num_groups" ||
+            Name.startswith("work_group_"))
+            Found = true;
+        else
+            find(Callee);
+        return !Found;
+    }
+};
+
+// The launch of the task at compile time: the global size of groups(), for
+// every pointer a buffer of the size of its data clause and the constant
+// arguments of the call. Return why the kernel cannot be tuned otherwise, the
+// local size of workers() is kept.
+static const char *getAutotuneLaunch(clang::ASTContext *Context, FunctionDecl *FD,
+                                     DirectiveInfo *DI, AutotuneSpec &Spec) {
+    ClauseInfo *Groups = getClauseOfKind(DI->getClauseList(),CK_GROUPS);
+    if (!Groups || Groups->getArgs().empty() || Groups->getArgs().size() > 3)
+        return "no groups() clause";
+    if (getClauseOfKind(DI->getClauseList(),CK_WORKERS))
+        return "the task sets workers()";
+    if (LocalSizeUseFinder().find(FD))
+        return "the kernel depends on the work-group size";
+    for (ArgVector::iterator
+             IA = Groups->getArgs().begin(), EA = Groups->getArgs().end(); IA != EA; ++IA) {
+        if (!(*IA)->isICE() || !(*IA)->getICE().getZExtValue())
+            return "the global size is not constant";
+        Spec.GlobalSize.push_back((*IA)->getICE().getZExtValue());
+    }
+
+    CallExpr *CE = dyn_cast<CallExpr>(DI->getAclStmt()->getSubStmt());
+    if (!CE || CE->getNumArgs() != FD->getNumParams())
+        return "the kernel has other parameters than the call of the task";
+
+    SmallVector<Arg*,8> PragmaArgs;
+    getDataClauseArgs(DI,PragmaArgs);
+
+    for (unsigned i = 0; i < FD->getNumParams(); ++i) {
+        QualType Ty = FD->getParamDecl(i)->getType().getCanonicalType();
+        Expr *E = CE->getArg(i)->IgnoreParenImpCasts();
+
+        if (const PointerType *PT = Ty->getAs<PointerType>()) {
+            if (PT->getPointeeType().getAddressSpace() == LangAS::opencl_local)
+                return "a local memory argument";
+
+            ClauseInfo TmpCI(CK_IN,DI);
+            Arg *TmpA = CreateNewArgFrom(E,&TmpCI,Context);
+            TmpCI.setArg(TmpA);
+            Arg *A = getMatchedArg(TmpA,PragmaArgs,Context);
+            delete TmpA;
+
+            SubArrayArg *SA = dyn_cast_or_null<SubArrayArg>(A);
+            llvm::APSInt Length;
+            if (SA && SA->getLength()->isIntegerConstantExpr(Length,*Context)) {
+                QualType Element = SA->getExpr()->getType();
+                Spec.Args.push_back(AutotuneArg(Length.getZExtValue() *
+                                                Context->getTypeSizeInChars(Element).getQuantity()));
+                continue;
+            }
+            return "the size of a buffer is not constant";
+        }
+
+        std::string Bytes = getConstantBytes(Context,E,Ty);
+        if (Bytes.empty())
+            return "a scalar argument is not constant";
+        Spec.Args.push_back(AutotuneArg(Bytes));
+    }
+    return 0;
+}
+
+// --autotune runs the kernel only with the launch of its task, a made up one
+// could index out of the buffers or loop for a very long time
+void KernelRefDef::setAutotune(clang::ASTContext *Context, FunctionDecl *FD, DirectiveInfo *DI) {
+    if (!Tune.empty() || !FD || DeviceCode.NameRef.compare("NULL") == 0)
+        return;
+
+    AutotuneSpec Spec;
+    if (const char *Reason = getAutotuneLaunch(Context,FD,DI,Spec)) {
+        llvm::outs() << NOTE << "autotune: skip '" << DeviceCode.NameRef << "'  -  "
+                     << Reason << "\n";
+        return;
+    }
+
+    Spec.KernelName = DeviceCode.NameRef;
+    Tune = Spec;
+}
+
+void DataIOSrc::init(clang::ASTContext *Context, DirectiveInfo *DI,
+                     RegionStack &RStack) {
+    Stmt *SubStmt = DI->getAclStmt()->getSubStmt();
+
+    CallExpr *CE = dyn_cast<CallExpr>(SubStmt);
+    assert(CE);
+    if (!CE)
+        return;
+
+    if (CE->getNumArgs() == 0) {
+        NameRef = "NULL";
+        //Definition = "";
+        NumArgs = "0";
+        return;
+    }
+
+    //gather data clause arguments
+    SmallVector<Arg*,8> PragmaArgs;
+    getDataClauseArgs(DI,PragmaArgs);
+
+#if 0
+    SmallVector<Expr*,8> PtrArgs;
+    for (CallExpr::arg_iterator II = CE->arg_begin(), EE = CE->arg_end(); II != EE; ++II)
+        if ((*II)->getType()->isPointerType())
+            PtrArgs.push_back(*II);
+    if (PtrArgs.size() != PragmaArgs.size()) {
+        NameRef = "NULL";
+        //Definition = "";
+        NumArgs = "0";
+        std::string msg =  "number of pass-by-reference function arguments (" + toString(PtrArgs.size())
+            + ") and dependency data clause arguments (" + toString(PragmaArgs.size())
+            + ") mismatch\n";
+        Diag(Context,DI->getLocStart(),diag::err_pragma_acc_test) << msg;
+        return;
+    }
+#endif
+
+    //generate code
+    NumArgs = toString(CE->getNumArgs());
+    std::string Prologue;
+    std::string InitList;
+
+    int Index = 0;
+    for (CallExpr::arg_iterator II(CE->arg_begin()),EE(CE->arg_end()); II != EE; ++II) {
+        ObjRefDef MemObj = addVarDeclForDevice(Context,*II,DI,PragmaArgs,RStack,Index++);
+        Prologue += MemObj.Definition;
+        if (II != CE->arg_begin())
+            InitList += ",";
+        InitList += MemObj.NameRef;
+    }
+
+    NameRef = "__acl_kernel_args";
+    Definition = Prologue
+        + "struct _memory_object " + NameRef + "[" + NumArgs + "] = {" + InitList + "};";
+}
+
+void DataIOSrc::init(clang::ASTContext *Context, const TaskFusion &Fusion,
+                     RegionStack &RStack) {
+    if (!Fusion.NumArgs) {
+        NameRef = "NULL";
+        //Definition = "";
+        NumArgs = "0";
+        return;
+    }
+
+    //generate code
+    NumArgs = toString(Fusion.NumArgs);
+    std::string Prologue;
+    std::vector<std::string> InitList(Fusion.NumArgs);
+
+    SmallVector<Arg*,8> PragmaArgs;
+    getDataClauseArgs(Fusion.First,PragmaArgs);
+
+    CallExpr *CE = cast<CallExpr>(Fusion.First->getAclStmt()->getSubStmt());
+    const unsigned NumFirstArgs = CE->getNumArgs();
+    int Index = 0;
+    for (CallExpr::arg_iterator II(CE->arg_begin()),EE(CE->arg_end()); II != EE; ++II, ++Index) {
+        std::map<unsigned,ClauseKind>::const_iterator SI = Fusion.SharedDeps.find(Index);
+        ClauseKind FusedDep = (SI != Fusion.SharedDeps.end()) ? SI->second : CK_END;
+        ObjRefDef MemObj = addVarDeclForDevice(Context,*II,Fusion.First,PragmaArgs,RStack,Index,FusedDep);
+        Prologue += MemObj.Definition;
+        InitList[Index] = MemObj.NameRef;
+    }
+
+    //the arguments of the second task that are not shared with the first one
+    PragmaArgs.clear();
+    getDataClauseArgs(Fusion.Second,PragmaArgs);
+
+    CE = cast<CallExpr>(Fusion.Second->getAclStmt()->getSubStmt());
+    Index = 0;
+    for (CallExpr::arg_iterator II(CE->arg_begin()),EE(CE->arg_end()); II != EE; ++II, ++Index) {
+        const unsigned KI = Fusion.SecondArgs[Index];
+        if (KI < NumFirstArgs)
+            continue;
+        ObjRefDef MemObj = addVarDeclForDevice(Context,*II,Fusion.Second,PragmaArgs,RStack,KI);
+        Prologue += MemObj.Definition;
+        InitList[KI] = MemObj.NameRef;
+    }
+
+    NameRef = "__acl_kernel_args";
+    Definition = Prologue
+        + "struct _memory_object " + NameRef + "[" + NumArgs + "] = {";
+    for (std::vector<std::string>::iterator II = InitList.begin(), EE = InitList.end(); II != EE; ++II)
+        Definition += (II != InitList.begin() ? "," : "") + *II;
+    Definition += "};";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Task Fusion
+///////////////////////////////////////////////////////////////////////////////
+
+static bool isReadDep(ClauseKind CK) {
+    return CK == CK_IN || CK == CK_INOUT || CK == CK_DEVICE_IN || CK == CK_DEVICE_INOUT;
+}
+
+static bool isWriteDep(ClauseKind CK) {
+    return CK == CK_OUT || CK == CK_INOUT || CK == CK_DEVICE_OUT || CK == CK_DEVICE_INOUT;
+}
+
+static bool isDeviceDep(ClauseKind CK) {
+    return CK == CK_DEVICE_IN || CK == CK_DEVICE_OUT || CK == CK_DEVICE_INOUT;
+}
+
+// data dependency of a buffer used by both tasks of a fusion, the first task
+// runs first: an intermediate buffer written by the first task and read by the
+// second one is not copied to the device
+static bool mergeDataDeps(ClauseKind First, ClauseKind Second, bool OnDevice, ClauseKind &Merged) {
+    if (First == Second && !isWriteDep(First)) {
+        Merged = First;
+        return true;
+    }
+    if (!(isReadDep(First) || isWriteDep(First)) ||
+        !(isReadDep(Second) || isWriteDep(Second)))
+        return false;  //buffer(), local_buffer()
+
+    const bool Read = isReadDep(First) || (isReadDep(Second) && !isWriteDep(First));
+    const bool Write = isWriteDep(First) || isWriteDep(Second);
+    const bool Device = OnDevice || (isDeviceDep(First) && isDeviceDep(Second));
+
+    if (Read && Write)
+        Merged = Device ? CK_DEVICE_INOUT : CK_INOUT;
+    else if (Write)
+        Merged = Device ? CK_DEVICE_OUT : CK_OUT;
+    else
+        Merged = Device ? CK_DEVICE_IN : CK_IN;
+    return true;
+}
+
+static bool isDataArg(Arg *A) {
+    return !isa<RawExprArg>(A) && !isa<LabelArg>(A) && !isa<FunctionArg>(A);
+}
+
+static ClauseKind getDataDep(Arg *A) {
+    return A->getParent()->getAsClause()->getKind();
+}
+
+// The fused kernel only orders the work-items of a work-group by a barrier,
+// see printFusedKernel(). A buffer shared by the two kernels and written by
+// one of them is safe if every access of both kernels is P[get_global_id(d)]
+// with the same dimension d: a work-item then only touches its own element.
+class GlobalIdAccessChecker : public RecursiveASTVisitor<GlobalIdAccessChecker> {
+private:
+    clang::ASTContext *Context;
+    ParmVarDecl *Param;
+
+    // T i = get_global_id(d); and i is never modified
+    llvm::DenseMap<const VarDecl *,int> IndexVars;
+    bool Collect;
+
+    unsigned NumRefs;
+    unsigned NumIndexed;
+    int Dim;
+
+    int getGlobalIdCallDim(Expr *E) {
+        CallExpr *CE = dyn_cast<CallExpr>(E->IgnoreParenImpCasts());
+        if (!CE || !CE->getDirectCallee() || CE->getNumArgs() != 1 ||
+            CE->getDirectCallee()->getNameAsString().compare("get_global_id"))
+            return -1;
+        llvm::APSInt Value;
+        if (!CE->getArg(0)->isIntegerConstantExpr(Value,*Context))
+            return -1;
+        return Value.getZExtValue();
+    }
+
+    int getIndexDim(Expr *E) {
+        if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts())) {
+            llvm::DenseMap<const VarDecl *,int>::iterator II = IndexVars.find(dyn_cast<VarDecl>(DRE->getDecl()));
+            return II != IndexVars.end() ? II->second : -1;
+        }
+        return getGlobalIdCallDim(E);
+    }
+
+    void setModified(Expr *E) {
+        if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+            if (VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+                IndexVars.erase(VD);
+    }
+
+public:
+    GlobalIdAccessChecker(clang::ASTContext *Context, ParmVarDecl *Param) :
+        Context(Context), Param(Param), Collect(true), NumRefs(0), NumIndexed(0), Dim(-1) {}
+
+    // the dimension of the accesses, -1 if one of them is not safe
+    int check(FunctionDecl *FD) {
+        Collect = true;
+        TraverseStmt(FD->getBody());
+        Collect = false;
+        TraverseStmt(FD->getBody());
+        return NumRefs == NumIndexed ? Dim : -1;
+    }
+
+    bool VisitVarDecl(VarDecl *VD) {
+        if (Collect && VD->isLocalVarDecl() && VD->getType()->isIntegerType() && VD->getInit()) {
+            int D = getGlobalIdCallDim(VD->getInit());
+            if (D >= 0)
+                IndexVars[VD] = D;
+        }
+        return true;
+    }
+
+    bool VisitBinaryOperator(BinaryOperator *BO) {
+        if (Collect && BO->isAssignmentOp())
+            setModified(BO->getLHS());
+        return true;
+    }
+
+    bool VisitUnaryOperator(UnaryOperator *UO) {
+        if (Collect && (UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf))
+            setModified(UO->getSubExpr());
+        return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr *DRE) {
+        if (!Collect && DRE->getDecl() == Param)
+            ++NumRefs;
+        return true;
+    }
+
+    bool VisitArraySubscriptExpr(ArraySubscriptExpr *ASE) {
+        if (Collect)
+            return true;
+        DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+        if (!DRE || DRE->getDecl() != Param)
+            return true;
+        int D = getIndexDim(ASE->getIdx());
+        if (D < 0 || (NumIndexed && D != Dim))
+            return true;  //counted as a reference only
+        Dim = D;
+        ++NumIndexed;
+        return true;
+    }
+};
+
+static bool hasSameGlobalIdAccess(clang::ASTContext *Context,
+                                  FunctionDecl *FirstFD, unsigned FirstParam,
+                                  FunctionDecl *SecondFD, unsigned SecondParam) {
+    int FirstDim = GlobalIdAccessChecker(Context,FirstFD->getParamDecl(FirstParam)).check(FirstFD);
+    int SecondDim = GlobalIdAccessChecker(Context,SecondFD->getParamDecl(SecondParam)).check(SecondFD);
+    return FirstDim >= 0 && FirstDim == SecondDim;
+}
+
+// the clauses that configure the kernel launch, they must be the same for both
+// tasks of a fusion, return false if the task cannot be fused at all
+static bool getFusionKey(clang::ASTContext *Context, DirectiveInfo *DI,
+                         std::vector<std::string> &Key) {
+    FunctionDecl *FD = getTaskKernel(DI);
+    if (!FD || !FD->hasBody())
+        return false;
+    if (Context->isFunctionWithSubtasks(FD))
+        return false;
+
+    CallExpr *CE = cast<CallExpr>(DI->getAclStmt()->getSubStmt());
+    if (CE->getNumArgs() != FD->getNumParams())
+        return false;
+
+    ClauseList &CList = DI->getClauseList();
+    for (ClauseList::iterator
+             II = CList.begin(), EE = CList.end(); II != EE; ++II) {
+        ClauseInfo *CI = *II;
+        switch (CI->getKind()) {
+        case CK_APPROXFUN:
+        case CK_PERFORATE:
+        case CK_RELAXED_MATH:
+        case CK_EVALFUN:
+        case CK_ESTIMATION:
+            return false;
+        case CK_TASKID:
+            continue;
+        default:
+            if (CI->isDataClause())
+                continue;
+            Key.push_back(CI->getPrettyClause(Context->getPrintingPolicy()));
+        }
+    }
+    std::sort(Key.begin(),Key.end());
+    return true;
+}
+
+// Two tasks are fused if they have the same launch configuration and the
+// second one reads a buffer written by the first one. A buffer shared by the
+// two calls becomes one kernel argument, any other overlap of their data
+// clauses prevents the fusion, and so does a shared buffer that is written and
+// not indexed by get_global_id() only, see GlobalIdAccessChecker.
+static bool analyzeTaskFusion(clang::ASTContext *Context, RegionStack &RStack,
+                              DirectiveInfo *First, DirectiveInfo *Second,
+                              TaskFusion &Fusion) {
+    std::vector<std::string> FirstKey;
+    std::vector<std::string> SecondKey;
+    if (!getFusionKey(Context,First,FirstKey) || !getFusionKey(Context,Second,SecondKey))
+        return false;
+    if (FirstKey != SecondKey)
+        return false;
+
+    SmallVector<Arg*,8> FirstPragmaArgs;
+    SmallVector<Arg*,8> SecondPragmaArgs;
+    getDataClauseArgs(First,FirstPragmaArgs);
+    getDataClauseArgs(Second,SecondPragmaArgs);
+
+    // the data clause argument of every pointer argument of a call
+    CallExpr *FirstCE = cast<CallExpr>(First->getAclStmt()->getSubStmt());
+    CallExpr *SecondCE = cast<CallExpr>(Second->getAclStmt()->getSubStmt());
+    SmallVector<Arg*,8> FirstArgs;
+    SmallVector<Arg*,8> SecondArgs;
+    for (unsigned i = 0; i < FirstCE->getNumArgs() + SecondCE->getNumArgs(); ++i) {
+        const bool IsFirst = i < FirstCE->getNumArgs();
+        Expr *E = IsFirst ? FirstCE->getArg(i) : SecondCE->getArg(i - FirstCE->getNumArgs());
+        E = E->IgnoreParenImpCasts();
+        Arg *A = 0;
+        if (E->getType()->isPointerType()) {
+            ClauseInfo TmpCI(CK_IN,IsFirst ? First : Second);
+            Arg *TmpA = CreateNewArgFrom(E,&TmpCI,Context);
+            TmpCI.setArg(TmpA);
+            A = getMatchedArg(TmpA,IsFirst ? FirstPragmaArgs : SecondPragmaArgs,Context);
+            delete TmpA;
+        }
+        (IsFirst ? FirstArgs : SecondArgs).push_back(A);
+    }
+
+    Fusion.First = First;
+    Fusion.Second = Second;
+    Fusion.NumArgs = FirstCE->getNumArgs();
+
+    bool Chained = false;
+    for (SmallVector<Arg*,8>::iterator
+             SI = SecondArgs.begin(), SE = SecondArgs.end(); SI != SE; ++SI) {
+        unsigned KI = Fusion.NumArgs;
+        Arg *SA = *SI;
+        for (unsigned i = 0; SA && i < FirstArgs.size(); ++i) {
+            Arg *FA = FirstArgs[i];
+            if (!FA || !isDataArg(FA) || !isDataArg(SA))
+                continue;
+
+            const bool Same = FA->Matches(SA) && FA->getPrettyArg() == SA->getPrettyArg();
+            if (!Same) {
+                // different host data of the same variable, each task would
+                // see its own device copy
+                if (FA->Contains(SA) || SA->Contains(FA))
+                    return false;
+                continue;
+            }
+
+            ClauseKind FirstCK = FA->getParent()->getAsClause()->getKind();
+            ClauseKind SecondCK = SA->getParent()->getAsClause()->getKind();
+            // an intermediate buffer with a copy in an enclosing region stays there
+            const bool OnDevice = RStack.FindDataOnDevice(FA) != 0;
+            ClauseKind Merged;
+            if (!mergeDataDeps(FirstCK,SecondCK,OnDevice,Merged))
+                return false;
+            if ((isWriteDep(FirstCK) || isWriteDep(SecondCK)) &&
+                !hasSameGlobalIdAccess(Context,getTaskKernel(First),i,
+                                       getTaskKernel(Second),SI - SecondArgs.begin())) {
+                llvm::outs() << WARNING << "do not fuse the tasks of '"
+                             << getTaskKernel(First)->getNameAsString() << "' and '"
+                             << getTaskKernel(Second)->getNameAsString() << "': '"
+                             << FA->getPrettyArg() << "' is not accessed by get_global_id()"
+                             << " of the same dimension only\n";
+                return false;
+            }
+            if (isWriteDep(FirstCK) && isReadDep(SecondCK))
+                Chained = true;
+
+            Fusion.SharedDeps[i] = Merged;
+            KI = i;
+            break;
+        }
+        if (KI == Fusion.NumArgs)
+            ++Fusion.NumArgs;
+        Fusion.SecondArgs.push_back(KI);
+    }
+
+    return Chained;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Transfer Elimination
+///////////////////////////////////////////////////////////////////////////////
+
+// A local buffer written by a task with out() and never touched by the host
+// code after that task, except by free(), does not need any transfer from then
+// on: the producer and every later task keep it on the device. The pointer must
+// not escape, see isEscaping(), or the host could read the buffer by another
+// name.
+
+struct TransferInfo {
+    //the directives of the function in source order
+    std::vector<AclStmt *> Directives;
+    //the top level statements of the function body
+    llvm::SmallPtrSet<AclStmt *,16> TopLevel;
+    //the host code references of the local variables
+    std::map<VarDecl *,std::vector<SourceLocation> > HostRefs;
+};
+
+static bool isFreeCall(CallExpr *CE) {
+    FunctionDecl *FD = CE->getDirectCallee();
+    if (!FD || CE->getNumArgs() != 1)
+        return false;
+    std::string Name = FD->getNameAsString();
+    return Name.compare("free") == 0 || Name.compare("acl_free") == 0;
+}
+
+// an allocation or NULL, a pointer set from them is not an alias
+static bool isFreshPointer(Expr *E) {
+    E = E->IgnoreParenCasts();
+    if (CallExpr *CE = dyn_cast<CallExpr>(E)) {
+        FunctionDecl *FD = CE->getDirectCallee();
+        return FD && FD->getNameAsString().find("alloc") != std::string::npos;
+    }
+    return isa<GNUNullExpr>(E) || isa<CXXNullPtrLiteralExpr>(E) ||
+        (isa<IntegerLiteral>(E) && cast<IntegerLiteral>(E)->getValue() == 0);
+}
+
+// a use of VD through which no other name can reach its storage
+static bool isLocalUse(DeclRefExpr *DRE, Stmt *Parent, VarDecl *VD) {
+    if (!Parent)
+        return true;
+
+    if (UnaryOperator *UO = dyn_cast<UnaryOperator>(Parent))
+        return UO->getOpcode() != UO_AddrOf &&
+            (UO->getOpcode() == UO_Deref || !VD->getType()->isPointerType());
+    if (isa<UnaryExprOrTypeTraitExpr>(Parent))
+        return true;
+
+    const bool Pointer = VD->getType()->isPointerType() || VD->getType()->isArrayType();
+    if (!Pointer)
+        // a scalar is copied, only its address is not
+        return !isa<MemberExpr>(Parent) || (!cast<MemberExpr>(Parent)->getType()->isArrayType() &&
+                                            !cast<MemberExpr>(Parent)->getType()->isPointerType());
+
+    if (ArraySubscriptExpr *ASE = dyn_cast<ArraySubscriptExpr>(Parent))
+        return ASE->getBase()->IgnoreParenImpCasts() == DRE;
+    if (MemberExpr *ME = dyn_cast<MemberExpr>(Parent))
+        return ME->isArrow();
+    if (BinaryOperator *BO = dyn_cast<BinaryOperator>(Parent)) {
+        if (BO->isComparisonOp())
+            return true;
+        if (BO->getOpcode() == BO_Assign && BO->getLHS()->IgnoreParenImpCasts() == DRE)
+            return isFreshPointer(BO->getRHS());
+    }
+    return false;
+}
+
+// true if some other name than VD can reach the storage of VD in the host code
+// S: VD is copied, its address is taken or it is passed to a call other than
+// free() and the kernel call of a task
+static bool isEscaping(Stmt *S, Stmt *Parent, VarDecl *VD) {
+    if (!S)
+        return false;
+    if (AclStmt *ACC = dyn_cast<AclStmt>(S))
+        if (ACC->getDirective()->getKind() == DK_TASK)
+            return false;
+    if (CallExpr *CE = dyn_cast<CallExpr>(S))
+        if (isFreeCall(CE) && isa<DeclRefExpr>(CE->getArg(0)->IgnoreParenCasts()))
+            return false;
+    if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S))
+        return DRE->getDecl() == VD && !isLocalUse(DRE,Parent,VD);
+
+    // the casts and parentheses do not change how the value is used
+    Stmt *ChildParent = (isa<ImplicitCastExpr>(S) || isa<ParenExpr>(S)) ? Parent : S;
+    for (Stmt::child_range range = S->children(); range; ++range)
+        if (isEscaping(*range,ChildParent,VD))
+            return true;
+    return false;
+}
+
+static bool isEscaping(FunctionDecl *FD, VarDecl *VD) {
+    if (VD->getType()->isPointerType() && VD->getInit() && !isFreshPointer(VD->getInit()))
+        return true;
+    return isEscaping(FD->getBody(),0,VD);
+}
+
+static void collectTransferInfo(Stmt *S, bool InDirective, TransferInfo &Info) {
+    if (!S)
+        return;
+    if (AclStmt *ACC = dyn_cast<AclStmt>(S)) {
+        Info.Directives.push_back(ACC);
+        InDirective = true;
+    }
+    else if (CallExpr *CE = dyn_cast<CallExpr>(S)) {
+        // releasing the buffer does not read it
+        if (!InDirective && isFreeCall(CE) &&
+            isa<DeclRefExpr>(CE->getArg(0)->IgnoreParenCasts()))
+            return;
+    }
+    else if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S)) {
+        if (VarDecl *VD = dyn_cast<VarDecl>(DRE->getDecl()))
+            if (!InDirective && VD->hasLocalStorage())
+                Info.HostRefs[VD].push_back(DRE->getLocStart());
+    }
+    for (Stmt::child_range range = S->children(); range; ++range)
+        collectTransferInfo(*range,InDirective,Info);
+}
+
+static bool isAdjacentToTask(CompoundStmt *CS, AclStmt *ACC) {
+    for (CompoundStmt::body_iterator
+             IS = CS->body_begin(), ES = CS->body_end(); IS != ES; ++IS) {
+        if (*IS != ACC)
+            continue;
+        if (IS != CS->body_begin() && isa<AclStmt>(*(IS - 1)))
+            return true;
+        if (IS + 1 != ES && isa<AclStmt>(*(IS + 1)))
+            return true;
+    }
+    return false;
+}
+
+static ClauseKind getDeviceDep(ClauseKind CK) {
+    switch (CK) {
+    case CK_IN:     return CK_DEVICE_IN;
+    case CK_OUT:    return CK_DEVICE_OUT;
+    case CK_INOUT:  return CK_DEVICE_INOUT;
+    default:
+        return CK;
+    }
+}
+
+//the args of the tasks after Producer that keep Out on the device, false if
+//another directive uses the buffer in some other way
+static bool getDeviceResidentArgs(ASTContext *Context, CompoundStmt *Body, TransferInfo &Info,
+                                  AclStmt *Producer, Arg *Out, SmallVector<Arg*,8> &Resident) {
+    SourceManager &SM = Context->getSourceManager();
+    VarDecl *VD = Out->getVarDecl();
+
+    // no host code after the producer
+    std::vector<SourceLocation> &Refs = Info.HostRefs[VD];
+    for (std::vector<SourceLocation>::iterator
+             II = Refs.begin(), EE = Refs.end(); II != EE; ++II)
+        if (SM.isBeforeInTranslationUnit(Producer->getLocStart(),*II))
+            return false;
+
+    bool After = false;
+    for (std::vector<AclStmt *>::iterator
+             II = Info.Directives.begin(), EE = Info.Directives.end(); II != EE; ++II) {
+        DirectiveInfo *DI = (*II)->getDirective();
+        SmallVector<Arg*,8> Args;
+        getDataClauseArgs(DI,Args);
+        for (SmallVector<Arg*,8>::iterator
+                 AI = Args.begin(), AE = Args.end(); AI != AE; ++AI) {
+            Arg *A = *AI;
+            if (!isDataArg(A) || A->getVarDecl() != VD)
+                continue;
+            // data regions keep their own copy
+            if (DI->getKind() != DK_TASK)
+                return false;
+            if (!After)
+                continue;
+            // buffer() and local_buffer() have no transfers
+            const ClauseKind CK = getDataDep(A);
+            if (A->getPrettyArg() != Out->getPrettyArg() || !(isReadDep(CK) || isWriteDep(CK)))
+                return false;
+            if (ACLConfig.FuseTasks && !Info.TopLevel.count(*II))
+                return false;
+            if (ACLConfig.FuseTasks && isAdjacentToTask(Body,*II))
+                return false;
+            Resident.push_back(A);
+        }
+        if (*II == Producer)
+            After = true;
+    }
+    return true;
+}
+
+static void analyzeTransfers(ASTContext *Context, FunctionDecl *FD, CompoundStmt *Body) {
+    TransferInfo Info;
+    collectTransferInfo(Body,false,Info);
+    for (CompoundStmt::body_iterator
+             IS = Body->body_begin(), ES = Body->body_end(); IS != ES; ++IS)
+        if (AclStmt *ACC = dyn_cast<AclStmt>(*IS))
+            Info.TopLevel.insert(ACC);
+
+    SourceManager &SM = Context->getSourceManager();
+    llvm::SmallPtrSet<VarDecl *,8> Done;
+    for (std::vector<AclStmt *>::iterator
+             II = Info.Directives.begin(), EE = Info.Directives.end(); II != EE; ++II) {
+        AclStmt *Producer = *II;
+        DirectiveInfo *DI = Producer->getDirective();
+        // a producer inside a loop or a branch may not run at all
+        if (DI->getKind() != DK_TASK || !Info.TopLevel.count(Producer))
+            continue;
+        if (ACLConfig.FuseTasks && isAdjacentToTask(Body,Producer))
+            continue;
+
+        SmallVector<Arg*,8> Args;
+        getDataClauseArgs(DI,Args);
+        for (SmallVector<Arg*,8>::iterator
+                 AI = Args.begin(), AE = Args.end(); AI != AE; ++AI) {
+            Arg *Out = *AI;
+            if (getDataDep(Out) != CK_OUT || !isDataArg(Out) || !Out->getFieldNesting().empty())
+                continue;
+            VarDecl *VD = Out->getVarDecl();
+            if (Done.count(VD) || !VD->hasLocalStorage() || isa<ParmVarDecl>(VD) ||
+                !VD->getType()->isPointerType() || !VD->getCentaurusArgs().empty())
+                continue;
+            Done.insert(VD);
+
+            // the host could read the buffer through an alias or a callee
+            if (isEscaping(FD,VD))
+                continue;
+
+            SmallVector<Arg*,8> Resident;
+            if (!getDeviceResidentArgs(Context,Body,Info,Producer,Out,Resident))
+                continue;
+
+            Resident.insert(Resident.begin(),Out);
+            for (SmallVector<Arg*,8>::iterator
+                     RI = Resident.begin(), RE = Resident.end(); RI != RE; ++RI) {
+                Arg *A = *RI;
+                ClauseKind CK = getDataDep(A);
+                if (isDeviceDep(CK))
+                    continue;
+                TransferDowngrades[A] = getDeviceDep(CK);
+
+                PresumedLoc PLoc = SM.getPresumedLoc(A->getLocStart());
+                llvm::outs() << NOTE << GetBasename(PLoc.getFilename()) << ":" << PLoc.getLine()
+                             << ": in " << FD->getNameAsString() << "(): '" << A->getPrettyArg()
+                             << "' stays on the device, "
+                             << ClauseInfo::Name[CK] << " -> " << ClauseInfo::Name[getDeviceDep(CK)] << "\n";
+            }
+        }
+    }
+}
+
+bool
+Stage1_ASTVisitor::VisitCompoundStmt(CompoundStmt *CS) {
+    if (!CurrentFunction)
+        return true;
+    if (Context->isOpenCLKernel(CurrentFunction) || Context->isFunctionWithSubtasks(CurrentFunction))
+        return true;
+
+    if (ACLConfig.ElideTransfers && CS == CurrentFunction->getBody())
+        analyzeTransfers(Context,CurrentFunction,CS);
+
+    if (!ACLConfig.FuseTasks)
+        return true;
+
+    //pairs of adjacent tasks, a fused task is not fused again
+    for (CompoundStmt::body_iterator
+             IS = CS->body_begin(), ES = CS->body_end(); IS != ES && IS + 1 != ES; ++IS) {
+        AclStmt *First = dyn_cast<AclStmt>(*IS);
+        AclStmt *Second = dyn_cast<AclStmt>(*(IS + 1));
+        if (!First || !Second)
+            continue;
+        if (First->getDirective()->getKind() != DK_TASK ||
+            Second->getDirective()->getKind() != DK_TASK)
+            continue;
+
+        TaskFusion Fusion;
+        if (!analyzeTaskFusion(Context,RStack,First->getDirective(),Second->getDirective(),Fusion))
+            continue;
+
+        TaskFusions[Fusion.First] = Fusion;
+        TaskFusions[Fusion.Second] = Fusion;
+        ++IS;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Task Ranges
+///////////////////////////////////////////////////////////////////////////////
+
+static bool refersToVar(Stmt *S, VarDecl *VD) {
+    if (!S)
+        return false;
+    if (DeclRefExpr *DRE = dyn_cast<DeclRefExpr>(S))
+        if (DRE->getDecl() == VD)
+            return true;
+    for (Stmt::child_range range = S->children(); range; ++range)
+        if (refersToVar(*range,VD))
+            return true;
+    return false;
 }
 
-static inline
-SourceLocation getLocAfterDecl(FunctionDecl *CurrentFunction, VarDecl *VD, std::string &CreateMem) {
-    //BIG FAT HACK
-    //ne must fix the SourceLocation Issues. Seriously
+static bool isLoopInvariant(ASTContext *Context, Expr *E, VarDecl *VD) {
+    return E && !E->HasSideEffects(*Context) && !refersToVar(E,VD);
+}
 
-    SourceLocation DeclLoc;
-    CompoundStmt *Body = cast<CompoundStmt>(CurrentFunction->getBody());
-    for (CompoundStmt::body_iterator
-             IS = Body->body_begin(),
-             ES = Body->body_end(); IS != ES; ++IS) {
-        DeclStmt *DS = dyn_cast<DeclStmt>(*IS);
-        if (!DS)
-            continue;
-        for (DeclStmt::decl_iterator
-                 ID = DS->decl_begin(),
-                 ED = DS->decl_end(); ID != ED; ++ID) {
-            Decl *D = *ID;
-            if (VarDecl *DVD = dyn_cast<VarDecl>(D))
-                if (DVD == VD) {
-                    CompoundStmt::body_iterator NextStmt = IS + 1;
-                    assert(NextStmt != ES);
-                    DeclLoc = (*NextStmt)->getLocStart();
-                    if (isa<AclStmt>(*NextStmt)) {
-                        DeclLoc = DeclLoc.getLocWithOffset(-9);
-                        CreateMem += "\n";
-                    }
-                    return DeclLoc;
-                }
-        }
-    }
-    assert(0 && "Unexpected SourceLocation of Decl");
-    return SourceLocation();
+static bool isVarRef(Expr *E, VarDecl *VD) {
+    DeclRefExpr *DRE = dyn_cast_or_null<DeclRefExpr>(E ? E->IgnoreParenImpCasts() : 0);
+    return DRE && DRE->getDecl() == VD;
 }
 
-void DataIOSrc::init(clang::ASTContext *Context, DirectiveInfo *DI,
-                     RegionStack &RStack) {
-    Stmt *SubStmt = DI->getAclStmt()->getSubStmt();
+//the counter of for (T VD = A; ...)
+static VarDecl *getInitVar(Stmt *Init) {
+    DeclStmt *DS = dyn_cast_or_null<DeclStmt>(Init);
+    if (!DS || !DS->isSingleDecl())
+        return 0;
+    VarDecl *VD = dyn_cast<VarDecl>(DS->getSingleDecl());
+    return VD && VD->isLocalVarDecl() && !VD->isStaticLocal() && VD->getInit() ? VD : 0;
+}
 
-    CallExpr *CE = dyn_cast<CallExpr>(SubStmt);
-    assert(CE);
-    if (!CE)
-        return;
+//for (VD = A; VD < B; ++VD) #pragma acl task ...
+//for (T VD = A; VD < B; ++VD) #pragma acl task ...
+//
+//A and B have no side effects and the clauses other than the data clauses
+//do not depend on VD, every iteration creates the same task on other data
+static bool analyzeTaskRange(ASTContext *Context, ForStmt *F, VarDecl *VD, TaskRange &Range) {
+    Expr *Lower = 0;
+    std::string InitStr;
+    if (getInitVar(F->getInit()) == VD) {
+        Lower = VD->getInit();
+        InitStr = VD->getType().getAsString(Context->getPrintingPolicy()) + " "
+            + VD->getNameAsString() + " = " + getPrettyExpr(Context,Lower);
+    }
+    else {
+        BinaryOperator *Init = dyn_cast_or_null<BinaryOperator>(F->getInit());
+        if (!Init || Init->getOpcode() != BO_Assign || !isVarRef(Init->getLHS(),VD))
+            return false;
+        Lower = Init->getRHS();
+        InitStr = getPrettyExpr(Context,Init);
+    }
+    if (!isLoopInvariant(Context,Lower,VD))
+        return false;
+
+    BinaryOperator *Cond = dyn_cast_or_null<BinaryOperator>(F->getCond());
+    if (!Cond || (Cond->getOpcode() != BO_LT && Cond->getOpcode() != BO_LE) ||
+        !isVarRef(Cond->getLHS(),VD))
+        return false;
+    Expr *Upper = Cond->getRHS();
+    if (!isLoopInvariant(Context,Upper,VD))
+        return false;
+
+    Expr *Inc = F->getInc();
+    if (UnaryOperator *UO = dyn_cast_or_null<UnaryOperator>(Inc)) {
+        if (!UO->isIncrementOp() || !isVarRef(UO->getSubExpr(),VD))
+            return false;
+    }
+    else if (CompoundAssignOperator *CAO = dyn_cast_or_null<CompoundAssignOperator>(Inc)) {
+        llvm::APSInt Step;
+        if (CAO->getOpcode() != BO_AddAssign || !isVarRef(CAO->getLHS(),VD) ||
+            !CAO->getRHS()->isIntegerConstantExpr(Step,*Context) || Step.getSExtValue() != 1)
+            return false;
+    }
+    else
+        return false;
 
-    if (CE->getNumArgs() == 0) {
-        NameRef = "NULL";
-        //Definition = "";
-        NumArgs = "0";
-        return;
+    //the body is the task
+    Stmt *Body = F->getBody();
+    if (CompoundStmt *CS = dyn_cast<CompoundStmt>(Body)) {
+        if (CS->size() != 1)
+            return false;
+        Body = CS->body_front();
     }
+    AclStmt *ACC = dyn_cast<AclStmt>(Body);
+    if (!ACC || ACC->getDirective()->getKind() != DK_TASK ||
+        !isa<CallExpr>(ACC->getSubStmt()))
+        return false;
+
+    DirectiveInfo *DI = ACC->getDirective();
+    if (TaskFusions.count(DI))
+        return false;
 
-    //gather data clause arguments
-    SmallVector<Arg*,8> PragmaArgs;
     ClauseList &CList = DI->getClauseList();
     for (ClauseList::iterator
              II = CList.begin(), EE = CList.end(); II != EE; ++II) {
         ClauseInfo *CI = *II;
-        if (!CI->isDataClause())
+        if (CI->isDataClause())
             continue;
         for (ArgVector::iterator
-                 AI = CI->getArgs().begin(), AE = CI->getArgs().end(); AI != AE; ++AI) {
-            Arg *A = *AI;
-            PragmaArgs.push_back(A);
-        }
+                 IA = CI->getArgs().begin(), EA = CI->getArgs().end(); IA != EA; ++IA)
+            if (refersToVar((*IA)->getExpr(),VD))
+                return false;
     }
 
-#if 0
-    SmallVector<Expr*,8> PtrArgs;
-    for (CallExpr::arg_iterator II = CE->arg_begin(), EE = CE->arg_end(); II != EE; ++II)
-        if ((*II)->getType()->isPointerType())
-            PtrArgs.push_back(*II);
-    if (PtrArgs.size() != PragmaArgs.size()) {
-        NameRef = "NULL";
-        //Definition = "";
-        NumArgs = "0";
-        std::string msg =  "number of pass-by-reference function arguments (" + toString(PtrArgs.size())
-            + ") and dependency data clause arguments (" + toString(PragmaArgs.size())
-            + ") mismatch\n";
-        Diag(Context,DI->getLocStart(),diag::err_pragma_acc_test) << msg;
-        return;
-    }
-#endif
+    std::string LowerStr = "(" + getPrettyExpr(Context,Lower) + ")";
+    std::string UpperStr = "(" + getPrettyExpr(Context,Upper) + ")";
+    if (Cond->getOpcode() == BO_LT)
+        Range.MaxNum = "(" + UpperStr + " > " + LowerStr + " ? " + UpperStr + " - " + LowerStr + " : 0)";
+    else
+        Range.MaxNum = "(" + UpperStr + " >= " + LowerStr + " ? " + UpperStr + " - " + LowerStr + " + 1 : 0)";
 
-    //generate code
-    NumArgs = toString(CE->getNumArgs());
-    std::string Prologue;
-    std::string InitList;
+    Range.ForLoop = F;
+    Range.Var = VD;
+    Range.Header = "for (" + InitStr + ";"
+        + getPrettyExpr(Context,Cond) + ";"
+        + getPrettyExpr(Context,Inc) + ")";
 
-    int Index = 0;
-    for (CallExpr::arg_iterator II(CE->arg_begin()),EE(CE->arg_end()); II != EE; ++II) {
-        ObjRefDef MemObj = addVarDeclForDevice(Context,*II,DI,PragmaArgs,RStack,Index++);
-        Prologue += MemObj.Definition;
-        if (II != CE->arg_begin())
-            InitList += ",";
-        InitList += MemObj.NameRef;
+    TaskRanges[DI] = Range;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Task Dependencies
+///////////////////////////////////////////////////////////////////////////////
+
+// The static site table carries the dependencies between the sites of a
+// function that the data clauses prove, the runtime checks the memory objects
+// only of the sites with dynamic_deps.
+
+enum DepRelation {
+    DR_NONE,
+    DR_PROVEN,
+    DR_UNKNOWN
+};
+
+//isNamedStorage() of the local variables, filled by analyzeTaskDeps()
+static llvm::DenseMap<VarDecl *,bool> NamedStorage;
+
+//data that no other function and no other pointer can reach: a local array or
+//scalar whose address is only passed to the tasks of the function
+static bool isNamedStorage(Arg *A, FunctionDecl *FD) {
+    if (!isDataArg(A) || !A->getFieldNesting().empty())
+        return false;
+    VarDecl *VD = A->getVarDecl();
+    if (!FD || !FD->hasBody() || !VD->hasLocalStorage() ||
+        VD->getType()->isPointerType() || VD->getType()->isReferenceType())
+        return false;
+
+    llvm::DenseMap<VarDecl *,bool>::iterator II = NamedStorage.find(VD);
+    if (II != NamedStorage.end())
+        return II->second;
+    return NamedStorage[VD] = !isEscaping(FD,VD);
+}
+
+static DepRelation getDepRelation(Arg *A, Arg *B, FunctionDecl *FD) {
+    if (!isWriteDep(getDataDep(A)) && !isWriteDep(getDataDep(B)))
+        return DR_NONE;
+    if (!isDataArg(A) || !isDataArg(B))
+        return DR_UNKNOWN;
+    if (A->getVarDecl() != B->getVarDecl())
+        return (isNamedStorage(A,FD) && isNamedStorage(B,FD)) ? DR_NONE : DR_UNKNOWN;
+    if (A->Matches(B) || A->Contains(B) || B->Contains(A))
+        return DR_PROVEN;
+    //e.g. two subarrays with non-constant bounds
+    return DR_UNKNOWN;
+}
+
+static void getSiteDataArgs(TaskSite &Site, SmallVector<Arg*,8> &Args) {
+    for (SmallVector<DirectiveInfo *,2>::iterator
+             II = Site.Directives.begin(), EE = Site.Directives.end(); II != EE; ++II)
+        getDataClauseArgs(*II,Args);
+}
+
+//the sites of a function in program order, a task of a loop can also depend
+//on the tasks of a previous iteration, so these sites stay dynamic, and so do
+//the sites that depend on a site of a loop
+static void analyzeTaskDeps() {
+    NamedStorage.clear();
+    for (unsigned k = 0; k < TaskSites.size(); ++k) {
+        TaskSite &Site = TaskSites[k];
+        Site.Deps.clear();
+        if (Site.Directives.empty()) {
+            Site.DynamicDeps = true;
+            continue;
+        }
+
+        SmallVector<Arg*,8> Args;
+        getSiteDataArgs(Site,Args);
+
+        bool Dynamic = Site.InLoop;
+        for (SmallVector<Arg*,8>::iterator
+                 II = Args.begin(), EE = Args.end(); II != EE; ++II)
+            if (!isNamedStorage(*II,Site.Function))
+                Dynamic = true;
+
+        for (unsigned j = 0; j < k; ++j) {
+            TaskSite &Prev = TaskSites[j];
+            if (Prev.Function != Site.Function || Prev.Directives.empty())
+                continue;
+
+            SmallVector<Arg*,8> PrevArgs;
+            getSiteDataArgs(Prev,PrevArgs);
+
+            DepRelation Relation = DR_NONE;
+            for (SmallVector<Arg*,8>::iterator
+                     PI = PrevArgs.begin(), PE = PrevArgs.end(); PI != PE; ++PI)
+                for (SmallVector<Arg*,8>::iterator
+                         II = Args.begin(), EE = Args.end(); II != EE; ++II) {
+                    DepRelation R = getDepRelation(*PI,*II,Site.Function);
+                    if (R == DR_PROVEN)
+                        Relation = DR_PROVEN;
+                    else if (R == DR_UNKNOWN)
+                        Dynamic = true;
+                }
+
+            //the runtime waits only for the last task of a site, not for
+            //all the iterations of a loop or of a range
+            if (Relation == DR_PROVEN && Prev.InLoop)
+                Dynamic = true;
+            else if (Relation == DR_PROVEN)
+                Site.Deps.push_back(j);
+        }
+        Site.DynamicDeps = Dynamic;
     }
+    NamedStorage.clear();
+}
 
-    NameRef = "__acl_kernel_args";
-    Definition = Prologue
-        + "struct _memory_object " + NameRef + "[" + NumArgs + "] = {" + InitList + "};";
+static std::string printTaskSite(const TaskSite &Site) {
+    std::string Deps;
+    for (std::vector<unsigned>::const_iterator
+             II = Site.Deps.begin(), EE = Site.Deps.end(); II != EE; ++II)
+        Deps += (II == Site.Deps.begin() ? "" : ",") + toString(*II);
+
+    return "{" + Site.Init
+        + ",.deps = " + (Deps.size() ? "(const unsigned[]){" + Deps + "}" : std::string("NULL"))
+        + ",.num_deps = " + toString(Site.Deps.size())
+        + ",.dynamic_deps = " + (Site.DynamicDeps ? "1" : "0")
+        + "}";
 }
 
+// A function has subtasks if it calls, other than through a kernel, a
+// function with subtasks. Sema marks the functions with subtask directives,
+// the callers are marked from there in one pass over the caller edges.
 static void updateNestedSubtasks(ASTContext *C, CallGraph *CG) {
-    bool repeat = true;
-    while (repeat) {
-        repeat = false;
-        CallGraphNode *Root = CG->getRoot();
-        for (CallGraphNode::const_iterator CI = Root->begin(),
-                 CE = Root->end(); CI != CE; ++CI) {
-            FunctionDecl *CurrentFD = dyn_cast<FunctionDecl>((*CI)->getDecl());
-            if (C->isFunctionWithSubtasks(CurrentFD))
-                continue;
+    SmallVector<CallGraphNode *,16> WorkList;
+    for (CallGraph::iterator II = CG->begin(), EE = CG->end(); II != EE; ++II) {
+        FunctionDecl *FD = dyn_cast_or_null<FunctionDecl>(II->second->getDecl());
+        if (FD && C->isFunctionWithSubtasks(FD))
+            WorkList.push_back(II->second);
+    }
 
-            CallGraphNode *CurrentNode = CG->getNode(CurrentFD);
-            if (!CurrentNode)
+    while (WorkList.size()) {
+        CallGraphNode *CurrentNode = WorkList.pop_back_val();
+        FunctionDecl *CurrentFD = cast<FunctionDecl>(CurrentNode->getDecl());
+        if (C->isOpenCLKernel(CurrentFD))
+            continue;
+
+        for (CallGraphNode::iterator
+                 NI = CurrentNode->caller_begin(), NE = CurrentNode->caller_end(); NI != NE; ++NI) {
+            FunctionDecl *CallerFD = dyn_cast_or_null<FunctionDecl>((*NI)->getDecl());
+            if (!CallerFD || CallerFD == CurrentFD)
                 continue;
-            for (CallGraphNode::iterator
-                     NI = CurrentNode->begin(), NE = CurrentNode->end(); NI != NE; ++NI) {
-                FunctionDecl *NewFD = dyn_cast<FunctionDecl>((*NI)->getDecl());
-                if (NewFD == CurrentFD)
-                    continue;
-                if (C->isOpenCLKernel(NewFD))
-                    continue;
-                if (!C->isFunctionWithSubtasks(NewFD))
-                    continue;
-                C->markAsFunctionWithSubtasks(CurrentFD);
-                repeat = true;
-            }
+            if (C->isFunctionWithSubtasks(CallerFD))
+                continue;
+            C->markAsFunctionWithSubtasks(CallerFD);
+            WorkList.push_back(*NI);
         }
     }
 }
 
-void Stage1_ASTVisitor::Init(ASTContext *C, CallGraph *_CG) {
+static bool isCalledBefore(FunctionDecl *LHS, FunctionDecl *RHS) {
+    return CallGraphOrder.lookup(LHS) > CallGraphOrder.lookup(RHS);
+}
+
+void Stage1_ASTVisitor::Init(ASTContext *C, CallGraph *_CG, const std::string &MainFile) {
     ACLConfig = Config;
+    MainFileName = MainFile;
+    TaskSrc::TaskUID = 0;
+    TaskFusions.clear();
+    TransferDowngrades.clear();
+    TaskSites.clear();
+    TaskRanges.clear();
 
     Context = C;
     CG = _CG;
     updateNestedSubtasks(C,CG);
+
+    CallDepsCache.clear();
+    CallGraphOrder.clear();
+    std::vector<CallGraph::SCCTy> SCCs;
+    CG->getSCCs(SCCs);
+    for (unsigned i = 0; i < SCCs.size(); ++i)
+        for (CallGraph::SCCTy::iterator II = SCCs[i].begin(), EE = SCCs[i].end(); II != EE; ++II)
+            CallGraphOrder[(*II)->getDecl()] = i;
     //CG->dump();
 
     SourceManager &SM = Context->getSourceManager();
-    std::string FileName = SM.getFileEntryForID(SM.getMainFileID())->getName();
+    std::string FileName = getMainFileName(SM);
 
     Suffix = "_ocl";
     CommonFileHeader = "/* Generated by acl */\n";
@@ -1541,40 +4058,59 @@ void Stage1_ASTVisitor::Init(ASTContext *C, CallGraph *_CG) {
 
 void KernelRefDef::findCallDeps(FunctionDecl *StartFD, CallGraph *CG,
                                 llvm::SmallSetVector<clang::FunctionDecl *,sizeof(clang::FunctionDecl *)> &Deps) {
-    llvm::SmallPtrSet<clang::FunctionDecl *,8> WorkList;
-    llvm::SmallPtrSet<clang::FunctionDecl *,8> VisitedList;
-
-    WorkList.insert(StartFD);
+    llvm::DenseMap<FunctionDecl *, SmallVector<FunctionDecl *,8> >::iterator
+        Cached = CallDepsCache.find(StartFD);
+    if (Cached == CallDepsCache.end()) {
+        SmallVector<FunctionDecl *,8> Closure;
+        SmallVector<FunctionDecl *,8> WorkList;
+        llvm::SmallPtrSet<clang::FunctionDecl *,8> VisitedList;
+
+        WorkList.push_back(StartFD);
+        VisitedList.insert(StartFD);
+
+        while (WorkList.size()) {
+            FunctionDecl *CurrentFD = WorkList.pop_back_val();
+            CallGraphNode *CurrentNode = CG->getNode(CurrentFD);
+            if (!CurrentNode)
+                continue;
+            for (CallGraphNode::iterator
+                     NI = CurrentNode->begin(), NE = CurrentNode->end(); NI != NE; ++NI)
+                if (FunctionDecl *NewFD = dyn_cast<FunctionDecl>((*NI)->getDecl()))
+                    if (VisitedList.insert(NewFD).second) {
+                        Closure.push_back(NewFD);
+                        WorkList.push_back(NewFD);
+                    }
+        }
 
-    while (WorkList.size()) {
-        FunctionDecl *CurrentFD = *WorkList.begin();
-        WorkList.erase(CurrentFD);
-        VisitedList.insert(CurrentFD);
-        CallGraphNode *CurrentNode = CG->getNode(CurrentFD);
-        if (!CurrentNode)
-            continue;
-        for (CallGraphNode::iterator
-                 NI = CurrentNode->begin(), NE = CurrentNode->end(); NI != NE; ++NI)
-            if (FunctionDecl *NewFD = dyn_cast<FunctionDecl>((*NI)->getDecl()))
-                if (!VisitedList.count(NewFD) && NewFD != CurrentFD) {
-                    Deps.insert(NewFD);
-                    WorkList.insert(NewFD);
-                }
+        // the definitions are printed from the back, callees first
+        std::stable_sort(Closure.begin(),Closure.end(),isCalledBefore);
+        Cached = CallDepsCache.insert(std::make_pair(StartFD,Closure)).first;
     }
+    Deps.insert(Cached->second.begin(),Cached->second.end());
+}
+
+// the kernel descriptors are initialised at file scope of the impl file, so
+// print the value of constant device arguments
+static std::string printDeviceArg(Arg *A, bool &IsConstant) {
+    if (A->isICE())
+        return A->getICE().toString(10);
+    IsConstant = false;
+    return A->getPrettyArg();
 }
 
 std::string
 KernelRefDef::setDeviceType(const DirectiveInfo *DI, const ClauseKind CK) {
     std::string DeviceType;
+    StaticDeviceType = true;
     if (const ClauseInfo *CI = getClauseOfKind(DI->getClauseList(),CK_SUGGEST)) {
-        DeviceType = "((unsigned int)" + CI->getArg()->getPrettyArg() + " << 1) | 0x0";
+        DeviceType = "((unsigned int)" + printDeviceArg(CI->getArg(),StaticDeviceType) + " << 1) | 0x0";
     }
     else if (const ClauseInfo *CI = getClauseOfKind(DI->getClauseList(),CK)) {
-        DeviceType = "((unsigned int)" + CI->getArg()->getPrettyArg() + " << 1) | 0x1";
+        DeviceType = "((unsigned int)" + printDeviceArg(CI->getArg(),StaticDeviceType) + " << 1) | 0x1";
     }
     else if (CK == CK_BIND_APPROXIMATE) {
         if (const ClauseInfo *CI = getClauseOfKind(DI->getClauseList(),CK_BIND))
-            DeviceType = "((unsigned int)" + CI->getArg()->getPrettyArg() + " << 1) | 0x1";
+            DeviceType = "((unsigned int)" + printDeviceArg(CI->getArg(),StaticDeviceType) + " << 1) | 0x1";
         else
             DeviceType = "((unsigned int)ACL_DEV_ALL << 1) | 0x0";
     }
@@ -1584,10 +4120,240 @@ KernelRefDef::setDeviceType(const DirectiveInfo *DI, const ClauseKind CK) {
     return DeviceType;
 }
 
+//the loop only gathers the memory objects of its tasks, which are then
+//created by a single call
+static std::string printTaskRange(TaskSrc *NewTask, const TaskRange *Loop) {
+    const DataIOSrc &MemObjInfo = NewTask->MemObjInfo;
+    const std::string Args = "__acl_range_args";
+    const std::string Num = "__acl_range_num";
+
+    std::string Code = "size_t " + Num + " = 0;";
+    if (MemObjInfo.NameRef.compare("NULL") == 0) {
+        Code += "struct _memory_object *" + Args + " = NULL;"
+            + Loop->Header + "{++" + Num + ";}";
+    }
+    else {
+        Code += "struct _memory_object *" + Args + " = (struct _memory_object*)malloc("
+            + "sizeof(struct _memory_object)*" + MemObjInfo.NumArgs + "*(" + Loop->MaxNum + " + 1));"
+            + Loop->Header + "{"
+            + MemObjInfo.Definition
+            + "memcpy(" + Args + " + " + Num + "*" + MemObjInfo.NumArgs + ","
+            + MemObjInfo.NameRef + ",sizeof(" + MemObjInfo.NameRef + "));"
+            + "++" + Num + ";"
+            + "}";
+    }
+
+    return Code
+        + "if (" + Num + ") {" + NewTask->getRangeHostCall(Args,Num) + "}"
+        + "free(" + Args + ");";
+}
+
+static void emitPendingTasks(SourceManager &SM, Replacements &ReplacementPool) {
+    if (!KernelScheduler.empty()) {
+        llvm::outs() << "Build " << KernelScheduler.size() << " kernel(s) using "
+                     << ACLConfig.Jobs << " job(s) ...\n";
+        if (KernelScheduler.run(ACLConfig))
+            SM.getDiagnostics().Report(SM.getLocForStartOfFile(SM.getMainFileID()),
+                                       diag::err_pragma_acc_test)
+                << "cannot build the OpenCL kernels";
+    }
+
+    for (std::vector<PendingTask>::iterator
+             II = PendingTasks.begin(), EE = PendingTasks.end(); II != EE; ++II) {
+        TaskSrc *NewTask = II->Task;
+        NewTask->OpenCLCode.finalize();
+
+        std::string NewCode;
+        if (II->Loop)
+            NewCode = "/*" + II->DirectiveSrc + "*/\n"
+                + "{"
+                + NewTask->Geometry.Definition
+                + NewTask->OpenCLCode.Definition
+                + printTaskRange(NewTask,II->Loop)
+                + "}";
+        else
+            NewCode = "/*" + II->DirectiveSrc + "*/\n"
+                + "{"
+                + NewTask->MemObjInfo.Definition
+                + NewTask->Geometry.Definition
+                + NewTask->OpenCLCode.Definition
+                + NewTask->HostCall
+                + "}";
+
+        Replacement HostCall(SM,II->Range,NewCode);
+        applyReplacement(ReplacementPool,HostCall);
+        delete NewTask;
+    }
+    PendingTasks.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Manifest
+///////////////////////////////////////////////////////////////////////////////
+
+// The manifest keeps the hash of every file generated for a main file, an
+// unchanged file is not rewritten (nor formatted) by the next run, so that its
+// timestamp only moves when its task or kernel changes.
+static std::map<std::string,std::string> PrevManifest;
+static std::map<std::string,std::string> NextManifest;
+
+static std::string hashContents(const std::string &Data) {
+    MD5 Hash;
+    Hash.update(Data);
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    SmallString<32> Str;
+    MD5::stringifyResult(Result,Str);
+    return Str.str().str();
+}
+
+static void readManifest(const std::string &ManifestFile) {
+    PrevManifest.clear();
+    NextManifest.clear();
+
+    std::ifstream src(ManifestFile.c_str());
+    std::string Hash, File;
+    while (src >> Hash && std::getline(src >> std::ws,File))
+        PrevManifest[File] = Hash;
+}
+
+static void writeManifest(const std::string &ManifestFile) {
+    std::ofstream dst(ManifestFile.c_str());
+    for (std::map<std::string,std::string>::iterator
+             II = NextManifest.begin(), EE = NextManifest.end(); II != EE; ++II)
+        dst << II->second << " " << II->first << "\n";
+    dst.flush();
+
+    PrevManifest.clear();
+    NextManifest.clear();
+}
+
+static bool isUnchanged(const std::string &File, const std::string &Hash) {
+    NextManifest[File] = Hash;
+
+    std::map<std::string,std::string>::iterator II = PrevManifest.find(File);
+    return II != PrevManifest.end() && II->second == Hash && sys::fs::exists(File);
+}
+
+// return true if File is (re)written
+static bool writeIfChanged(const std::string &File, const std::string &Data) {
+    if (isUnchanged(File,hashContents(Data)))
+        return false;
+
+    std::ofstream dst(File.c_str(), std::ios::out | std::ios::binary);
+    dst << Data;
+    dst.flush();
+    return true;
+}
+
+enum CommitStatus {
+    CS_UNCHANGED,
+    CS_WRITTEN,
+    CS_FAILED
+};
+
+// the streamed version of writeIfChanged(), Contents is already on disk
+static CommitStatus commitIfChanged(const std::string &File, GeneratedFile &Contents) {
+    if (isUnchanged(File,Contents.getHash())) {
+        Contents.discard();
+        return CS_UNCHANGED;
+    }
+    if (!Contents.commit()) {
+        // File is as before, do not record the new contents
+        NextManifest.erase(File);
+        return CS_FAILED;
+    }
+    return CS_WRITTEN;
+}
+
+// Write the binary of the device to a side file of the generated sources and
+// return the assembler stub that embeds it.
+static std::string emitDeviceBin(const DeviceBin &Device, const std::string &Base) {
+    std::string BinFile = Base + Device.Bin.NameRef + ".bin";
+    writeIfChanged(BinFile,Device.Data);
+
+    // .incbin resolves relative paths against the working directory of the assembler
+    SmallString<256> Path(BinFile);
+    sys::fs::make_absolute(Path);
+    return Device.printIncbin(Path.str().str());
+}
+
+// the kernels of a pool in the order of their functions in the translation
+// unit, so that the generated files only change if the kernels do
+static void getOrderedKernels(const llvm::DenseMap<FunctionDecl *,KernelRefDef *> &Pool,
+                              std::vector<KernelRefDef *> &Kernels) {
+    if (Pool.empty())
+        return;
+
+    std::vector<std::pair<FunctionDecl *,KernelRefDef *> > Entries(Pool.begin(),Pool.end());
+    SourceManager &SM = Entries.front().first->getASTContext().getSourceManager();
+    BeforeThanCompare<SourceLocation> IsBefore(SM);
+    std::sort(Entries.begin(),Entries.end(),
+              [&IsBefore](const std::pair<FunctionDecl *,KernelRefDef *> &A,
+                          const std::pair<FunctionDecl *,KernelRefDef *> &B) {
+                  return IsBefore(A.first->getLocation(),B.first->getLocation());
+              });
+
+    for (size_t i=0; i<Entries.size(); ++i)
+        Kernels.push_back(Entries[i].second);
+}
+
+static void getOrderedKernels(const std::map<std::string,KernelRefDef *> &Pool,
+                              std::vector<KernelRefDef *> &Kernels) {
+    for (std::map<std::string,KernelRefDef *>::const_iterator
+             II = Pool.begin(), EE = Pool.end(); II != EE; ++II)
+        Kernels.push_back(II->second);
+}
+
+// the kernels of a pool and the variant of the resource report they go to
+struct KernelPoolInfo {
+    const char *Variant;
+    std::vector<KernelRefDef *> Kernels;
+};
+
+// the pools of the translation unit in the order their kernels are emitted
+static void getKernelPools(std::vector<KernelPoolInfo> &Pools) {
+    Pools.resize(7);
+    Pools[0].Variant = "accurate";
+    getOrderedKernels(KernelAccuratePool,Pools[0].Kernels);
+    Pools[1].Variant = "approximate";
+    getOrderedKernels(KernelApproximatePool,Pools[1].Kernels);
+    Pools[2].Variant = "evaluate";
+    getOrderedKernels(KernelEvaluatePool,Pools[2].Kernels);
+    Pools[3].Variant = "fused";
+    getOrderedKernels(KernelFusedPool,Pools[3].Kernels);
+    Pools[4].Variant = "approximate";
+    getOrderedKernels(KernelGeneratedPool,Pools[4].Kernels);
+    Pools[5].Variant = "accurate";
+    getOrderedKernels(KernelSpecializedPool,Pools[5].Kernels);
+    Pools[6].Variant = "cpu_vector";
+    getOrderedKernels(KernelVectorPool,Pools[6].Kernels);
+}
+
+static void clearKernelPools() {
+    std::vector<KernelPoolInfo> Pools;
+    getKernelPools(Pools);
+    for (std::vector<KernelPoolInfo>::iterator
+             PI = Pools.begin(), PE = Pools.end(); PI != PE; ++PI)
+        for (std::vector<KernelRefDef *>::iterator
+                 II = PI->Kernels.begin(), EE = PI->Kernels.end(); II != EE; ++II)
+            delete *II;
+
+    KernelAccuratePool.clear();
+    KernelApproximatePool.clear();
+    KernelEvaluatePool.clear();
+    KernelFusedPool.clear();
+    KernelGeneratedPool.clear();
+    KernelSpecializedPool.clear();
+    KernelVectorPool.clear();
+}
+
 void
 Stage1_ASTVisitor::Finish() {
     SourceManager &SM = Context->getSourceManager();
 
+    emitPendingTasks(SM,ReplacementPool);
+
     for (SmallVector<SourceLocation,8>::iterator
              II = SM.OpenCLIncludeDirectives.begin(),
              EE = SM.OpenCLIncludeDirectives.end(); II != EE; ++II) {
@@ -1603,7 +4369,7 @@ Stage1_ASTVisitor::Finish() {
         return;
     }
 
-    std::string FileName = SM.getFileEntryForID(SM.getMainFileID())->getName();
+    std::string FileName = getMainFileName(SM);
 
     {
         std::string Headers = HostHeader + "#include \"" + NewHeader + "\"\n";
@@ -1612,144 +4378,142 @@ Stage1_ASTVisitor::Finish() {
         applyReplacement(ReplacementPool,R);
     }
 
+    readManifest(RemoveDotExtension(FileName) + Suffix + ".manifest");
+
+    std::vector<KernelPoolInfo> Pools;
+    getKernelPools(Pools);
+
     {
-        std::ofstream dst(NewHeader.c_str());
+        GeneratedFile dst(NewHeader);
         dst << CommonFileHeader;
-        for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-                 II = KernelAccuratePool.begin(), EE = KernelAccuratePool.end(); II != EE; ++II) {
-            dst << II->second->InlineDeviceCode.HeaderDecl;
-            std::vector<PlatformBin> &Platforms = II->second->Binary;
-            for (std::vector<PlatformBin>::iterator
-                     BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
-                PlatformBin &Platform = *BI;
-                for (std::vector<DeviceBin>::iterator
-                         DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
-                    DeviceBin &Device = *DI;
-                    dst << Device.Bin.HeaderDecl;
-                }
-            }
-        }
-        for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-                 II = KernelApproximatePool.begin(), EE = KernelApproximatePool.end(); II != EE; ++II) {
-            dst << II->second->InlineDeviceCode.HeaderDecl;
-            std::vector<PlatformBin> &Platforms = II->second->Binary;
-            for (std::vector<PlatformBin>::iterator
-                     BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
-                PlatformBin &Platform = *BI;
-                for (std::vector<DeviceBin>::iterator
-                         DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
-                    DeviceBin &Device = *DI;
-                    dst << Device.Bin.HeaderDecl;
-                }
-            }
-        }
-        for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-                 II = KernelEvaluatePool.begin(), EE = KernelEvaluatePool.end(); II != EE; ++II) {
-            dst << II->second->InlineDeviceCode.HeaderDecl;
-            std::vector<PlatformBin> &Platforms = II->second->Binary;
-            for (std::vector<PlatformBin>::iterator
-                     BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
-                PlatformBin &Platform = *BI;
-                for (std::vector<DeviceBin>::iterator
-                         DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
-                    DeviceBin &Device = *DI;
-                    dst << Device.Bin.HeaderDecl;
+        for (std::vector<KernelPoolInfo>::iterator
+                 PI = Pools.begin(), PE = Pools.end(); PI != PE; ++PI) {
+            for (std::vector<KernelRefDef *>::iterator
+                     II = PI->Kernels.begin(), EE = PI->Kernels.end(); II != EE; ++II) {
+                dst << (*II)->InlineDeviceCode.HeaderDecl;
+                dst << (*II)->HostCode.HeaderDecl;
+                std::vector<PlatformBin> &Platforms = (*II)->Binary;
+                for (std::vector<PlatformBin>::iterator
+                         BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
+                    PlatformBin &Platform = *BI;
+                    for (std::vector<DeviceBin>::iterator
+                             DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
+                        DeviceBin &Device = *DI;
+                        dst << Device.Bin.HeaderDecl;
+                    }
                 }
             }
         }
+        if (TaskSites.size())
+            dst << "extern const struct _task_site " << getTaskSiteTable(Context)
+                << "[" << TaskSites.size() << "];";
         dst << "\n";
-        dst.flush();
+
+        CommitStatus Status = commitIfChanged(NewHeader,dst);
+        if (Status == CS_FAILED)
+            Diag(Context,SM.getLocForStartOfFile(SM.getMainFileID()),diag::err_pragma_acc_test)
+                << "cannot write '" + NewHeader + "'";
+        else if (Status == CS_WRITTEN)
+            llvm::outs() << "Create header           : '" << NewHeader << "'  -  new file\n";
+        else
+            llvm::outs() << "Keep header             : '" << NewHeader << "'  -  unchanged\n";
     }
     InputFiles.push_back(NewHeader);
-    llvm::outs() << "Create header           : '" << NewHeader << "'  -  new file\n";
 
     std::string NewImpl = RemoveDotExtension(FileName) + Suffix + ".c";
+    std::string BinBase = RemoveDotExtension(FileName) + Suffix;
     {
-        std::ofstream dst(NewImpl.c_str());
+        GeneratedFile dst(NewImpl);
         dst << CommonFileHeader;
         //dst << "#include \"" << NewHeader << "\"\n";
-        for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-                 II = KernelAccuratePool.begin(), EE = KernelAccuratePool.end(); II != EE; ++II) {
-            dst << II->second->InlineDeviceCode.Definition;
-            std::vector<PlatformBin> &Platforms = II->second->Binary;
-            for (std::vector<PlatformBin>::iterator
-                     BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
-                PlatformBin &Platform = *BI;
-                for (std::vector<DeviceBin>::iterator
-                         DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
-                    DeviceBin &Device = *DI;
-                    dst << Device.Bin.Definition;
-                }
-            }
-        }
-        for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-                 II = KernelApproximatePool.begin(), EE = KernelApproximatePool.end(); II != EE; ++II) {
-            dst << II->second->InlineDeviceCode.Definition;
-            std::vector<PlatformBin> &Platforms = II->second->Binary;
-            for (std::vector<PlatformBin>::iterator
-                     BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
-                PlatformBin &Platform = *BI;
-                for (std::vector<DeviceBin>::iterator
-                         DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
-                    DeviceBin &Device = *DI;
-                    dst << Device.Bin.Definition;
+        // the kernel descriptors
+        dst << "#include <centaurus_common.h>\n";
+        for (std::vector<KernelPoolInfo>::iterator
+                 PI = Pools.begin(), PE = Pools.end(); PI != PE; ++PI) {
+            for (std::vector<KernelRefDef *>::iterator
+                     II = PI->Kernels.begin(), EE = PI->Kernels.end(); II != EE; ++II) {
+                (*II)->finalize();
+                (*II)->printInlineSource(dst);
+                std::vector<PlatformBin> &Platforms = (*II)->Binary;
+                for (std::vector<PlatformBin>::iterator
+                         BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
+                    PlatformBin &Platform = *BI;
+                    for (std::vector<DeviceBin>::iterator
+                             DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
+                        DeviceBin &Device = *DI;
+                        dst << emitDeviceBin(Device,BinBase);
+                        dst << Device.Bin.HeaderDecl;
+                    }
                 }
+                (*II)->printHostCode(dst);
             }
         }
-        for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-                 II = KernelEvaluatePool.begin(), EE = KernelEvaluatePool.end(); II != EE; ++II) {
-            dst << II->second->InlineDeviceCode.Definition;
-            std::vector<PlatformBin> &Platforms = II->second->Binary;
-            for (std::vector<PlatformBin>::iterator
-                     BI = Platforms.begin(), BE = Platforms.end(); BI != BE; ++BI) {
-                PlatformBin &Platform = *BI;
-                for (std::vector<DeviceBin>::iterator
-                         DI = Platform.begin(), DE = Platform.end(); DI != DE; ++DI) {
-                    DeviceBin &Device = *DI;
-                    dst << Device.Bin.Definition;
-                }
-            }
+        if (TaskSites.size()) {
+            dst << "const struct _task_site " << getTaskSiteTable(Context)
+                << "[" << TaskSites.size() << "] = {";
+            analyzeTaskDeps();
+            for (std::vector<TaskSite>::iterator
+                     II = TaskSites.begin(), EE = TaskSites.end(); II != EE; ++II)
+                dst << (II == TaskSites.begin() ? "" : ",") << printTaskSite(*II);
+            dst << "};";
         }
         dst << "\n";
-        dst.flush();
+
+        CommitStatus Status = commitIfChanged(NewImpl,dst);
+        if (Status == CS_FAILED)
+            Diag(Context,SM.getLocForStartOfFile(SM.getMainFileID()),diag::err_pragma_acc_test)
+                << "cannot write '" + NewImpl + "'";
+        else if (Status == CS_WRITTEN)
+            llvm::outs() << "Create kernel src/bin   : '" << NewImpl << "'  -  new file\n";
+        else
+            llvm::outs() << "Keep kernel src/bin     : '" << NewImpl << "'  -  unchanged\n";
     }
     InputFiles.push_back(NewImpl);
-    llvm::outs() << "Create kernel src/bin   : '" << NewImpl << "'  -  new file\n";
 
-    for (std::vector<std::pair<std::string, std::string> >::iterator
+    for (std::vector<std::pair<std::string, const KernelRefDef *> >::iterator
              II = NewOpenCLFiles.begin(), EE = NewOpenCLFiles.end(); II != EE; ++II) {
-        std::pair<std::string, std::string> &P = *II;
-        {
-            std::ofstream dst(P.first.c_str());
-            dst << P.second;
-            dst.flush();
+        std::pair<std::string, const KernelRefDef *> &P = *II;
+        // the printed kernel with its call dependencies and user types
+        if (!writeIfChanged(P.first,P.second->InlineSource)) {
+            llvm::outs() << "Keep OpenCL kernels in  : '" << P.first << "'  -  unchanged\n";
+            continue;
         }
+        // only new files need formatting
         KernelFiles.push_back(P.first);
         llvm::outs() << "Write OpenCL kernels to : '" << P.first << "'  -  new file\n";
     }
     NewOpenCLFiles.clear();
 
+    if (ACLConfig.ResourceReport.size()) {
+        static const char *Variants[] = { "accurate", "approximate", "evaluate", "fused", "cpu_vector" };
+        for (unsigned i = 0; i < sizeof(Variants) / sizeof(Variants[0]); ++i) {
+            std::vector<KernelRefDef *> Kernels;
+            for (std::vector<KernelPoolInfo>::iterator
+                     PI = Pools.begin(), PE = Pools.end(); PI != PE; ++PI)
+                if (StringRef(PI->Variant).compare(Variants[i]) == 0)
+                    Kernels.insert(Kernels.end(),PI->Kernels.begin(),PI->Kernels.end());
+            writeResourceReportPart(FileName,Variants[i],Kernels,i != 0);
+        }
+    }
+
+    writeManifest(RemoveDotExtension(FileName) + Suffix + ".manifest");
+
     // clean
 
-    for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-             II = KernelAccuratePool.begin(), EE = KernelAccuratePool.end(); II != EE; ++II) {
-        delete (*II).second;
-    }
-    KernelAccuratePool.clear();
-    for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-             II = KernelApproximatePool.begin(), EE = KernelApproximatePool.end(); II != EE; ++II) {
-        delete (*II).second;
-    }
-    KernelApproximatePool.clear();
-    for (llvm::DenseMap<FunctionDecl *,KernelRefDef *>::iterator
-             II = KernelEvaluatePool.begin(), EE = KernelEvaluatePool.end(); II != EE; ++II) {
-        delete (*II).second;
-    }
-    KernelEvaluatePool.clear();
+    clearKernelPools();
+    KernelNameUID = 0;
+    TaskFusions.clear();
+    TransferDowngrades.clear();
+    TaskSites.clear();
+    TaskRanges.clear();
 
     DepCFG.clear();
+    CallDepsCache.clear();
+    CallGraphOrder.clear();
 
     APIHeaderVector.clear();
+    KernelRefDef::KernelUIDMap.clear();
+    MainFileName.clear();
     ACLConfig = acl::CentaurusConfig();
 }
 
@@ -1759,6 +4523,8 @@ bool Stage1_ASTVisitor::TraverseForStmt(ForStmt *F) {
     VarDecl *VD = F->getConditionVariable();
     if (VD)
         ;
+    else if (VarDecl *InitVD = getInitVar(F->getInit()))
+        VD = InitVD;
     else if (BinaryOperator *BO = dyn_cast_or_null<BinaryOperator>(F->getInit())) {
         if (BO->getOpcode() == BO_Comma)
             BO = dyn_cast<BinaryOperator>(BO->getLHS());
@@ -1771,6 +4537,12 @@ bool Stage1_ASTVisitor::TraverseForStmt(ForStmt *F) {
     if (VD && VD->getType()->isIntegerType())
         IterationSpace.push_back(VD);
 
+    if (ACLConfig.BatchTasks && VD && VD->getType()->isIntegerType() && CurrentFunction &&
+        !Context->isOpenCLKernel(CurrentFunction) && !Context->isFunctionWithSubtasks(CurrentFunction)) {
+        TaskRange Range;
+        analyzeTaskRange(Context,F,VD,Range);
+    }
+
     for (Stmt::child_range range = F->children(); range; ++range) {
         TRY_TO(TraverseStmt(*range));
     }
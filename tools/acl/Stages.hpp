@@ -54,10 +54,15 @@ private:
     bool hasRuntimeCalls;
     bool hasMain;
 
+    std::string NewFile;
+
 public:
     void Init(clang::ASTContext *C);
     void Finish(clang::ASTContext *Context);
 
+    //the copy of the main file Stage1 rewrites, empty for regular files
+    const std::string &getNewFile() const { return NewFile; }
+
     explicit Stage0_ASTVisitor(CentaurusConfig Config,
                                std::vector<std::string> &InputFiles,
                                std::vector<std::string> &RegularFiles) :
@@ -178,7 +183,9 @@ private:
 
 public:
 
-    void Init(clang::ASTContext *C, clang::CallGraph *_CG);
+    //MainFile names the generated files if the AST is not built from it
+    void Init(clang::ASTContext *C, clang::CallGraph *_CG,
+              const std::string &MainFile = std::string());
     void Finish();
 
     explicit Stage1_ASTVisitor(CentaurusConfig Config,
@@ -200,6 +207,7 @@ public:
 
     bool VisitAclStmt(clang::AclStmt *ACC);
     bool VisitBinaryOperator(clang::BinaryOperator *BO);
+    bool VisitCompoundStmt(clang::CompoundStmt *CS);
 
 #if 0
     bool TraverseMemberExpr(clang::MemberExpr *S);
@@ -259,6 +267,95 @@ public:
     }
 };
 
+///////////////////////////////////////////////////////////////////////////////
+//                        Stage0 + Stage1
+///////////////////////////////////////////////////////////////////////////////
+
+//Run Stage0 as a pre-pass of Stage1 on the same AST, the input is parsed once.
+//Stage1 rewrites the '_acl' copy of the main file made by Stage0, so its
+//replacements of the main file are moved to the copy.
+class Stages_ASTConsumer : public clang::ASTConsumer {
+private:
+    clang::tooling::Replacements &ReplacementPool;
+    clang::tooling::Replacements MainFilePool;
+
+    Stage0_ASTVisitor Stage0;
+    Stage1_ASTVisitor Stage1;
+
+public:
+    explicit Stages_ASTConsumer(CentaurusConfig Config,
+                                clang::tooling::Replacements &ReplacementPool,
+                                std::vector<std::string> &OutputFiles,
+                                std::vector<std::string> &RegularFiles,
+                                std::vector<std::string> &LibOCLFiles,
+                                std::vector<std::string> &KernelFiles) :
+        ReplacementPool(ReplacementPool),
+        Stage0(Config,OutputFiles,RegularFiles),
+        Stage1(Config,MainFilePool,LibOCLFiles,KernelFiles) {}
+
+    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+        clang::TranslationUnitDecl *TU = Context.getTranslationUnitDecl();
+
+        Stage0.Init(&Context);
+        Stage0.TraverseDecl(TU);
+        Stage0.Finish(&Context);
+
+        const std::string &NewFile = Stage0.getNewFile();
+        if (NewFile.empty())
+            return;
+
+        clang::CallGraph CG;
+        CG.addToCallGraph(TU);
+
+        Stage1.Init(&Context,&CG,NewFile);
+        Stage1.TraverseDecl(TU);
+        Stage1.Finish();
+
+        clang::SourceManager &SM = Context.getSourceManager();
+        std::string FileName = SM.getFileEntryForID(SM.getMainFileID())->getName();
+
+        for (clang::tooling::Replacements::iterator
+                 II = MainFilePool.begin(), EE = MainFilePool.end(); II != EE; ++II) {
+            if (II->getFilePath() != FileName) {
+                ReplacementPool.insert(*II);
+                continue;
+            }
+            ReplacementPool.insert(clang::tooling::Replacement(NewFile,II->getOffset(),II->getLength(),
+                                                               II->getReplacementText()));
+        }
+        MainFilePool.clear();
+    }
+};
+
+class Stages_ConsumerFactory {
+private:
+    CentaurusConfig Config;
+
+    clang::tooling::Replacements &ReplacementPool;
+    std::vector<std::string> &OutputFiles;
+    std::vector<std::string> &RegularFiles;
+    std::vector<std::string> &LibOCLFiles;
+    std::vector<std::string> &KernelFiles;
+
+public:
+    Stages_ConsumerFactory(CentaurusConfig Config,
+                           clang::tooling::Replacements &ReplacementPool,
+                           std::vector<std::string> &OutputFiles,
+                           std::vector<std::string> &RegularFiles,
+                           std::vector<std::string> &LibOCLFiles,
+                           std::vector<std::string> &KernelFiles) :
+        Config(Config),
+        ReplacementPool(ReplacementPool),
+        OutputFiles(OutputFiles), RegularFiles(RegularFiles),
+        LibOCLFiles(LibOCLFiles), KernelFiles(KernelFiles) {}
+
+    std::unique_ptr<clang::ASTConsumer> newASTConsumer() {
+        return std::unique_ptr<clang::ASTConsumer>(new Stages_ASTConsumer(Config,ReplacementPool,
+                                                                          OutputFiles,RegularFiles,
+                                                                          LibOCLFiles,KernelFiles));
+    }
+};
+
 }  //namespace acl
 
 #endif
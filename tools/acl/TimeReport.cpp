@@ -0,0 +1,200 @@
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "Common.hpp"
+#include "TimeReport.hpp"
+
+using namespace llvm;
+using namespace acl;
+
+namespace {
+
+struct TimeSample {
+    std::string Stage;
+    std::string Name;
+    double Wall;
+    double User;
+    double System;
+    //in KB, the peak of the process and of its waited children so far
+    long PeakRSS;
+    long ChildrenPeakRSS;
+};
+
+bool Enabled = false;
+
+// the Timers of the kernel builds are started and stopped on the threads of
+// the CompileScheduler
+std::mutex SampleLock;
+std::vector<TimeSample> Samples;
+
+// A forked worker inherits the running Timers of the driver, so the regions
+// of an input file have their own group.
+TimerGroup *PartGroup = NULL;
+
+TimerGroup &getTimerGroup() {
+    if (PartGroup)
+        return *PartGroup;
+    // never destroyed, the group would print what is left at exit
+    static TimerGroup *TG = new TimerGroup("acl time report");
+    return *TG;
+}
+
+long getPeakRSS(int Who) {
+    struct rusage Usage;
+    if (getrusage(Who,&Usage))
+        return 0;
+    return Usage.ru_maxrss;
+}
+
+std::string getTimeReportPart(const std::string &File) {
+    return RemoveDotExtension(File) + "_acl.times";
+}
+
+bool readPart(const std::string &File, std::vector<TimeSample> &Records) {
+    std::string Part = getTimeReportPart(File);
+    std::ifstream src(Part.c_str());
+    if (!src)
+        return true;
+
+    for (std::string line; std::getline(src,line);) {
+        std::stringstream IS(line);
+        TimeSample S;
+        std::getline(IS,S.Stage,'\t');
+        std::getline(IS,S.Name,'\t');
+        IS >> S.Wall >> S.User >> S.System >> S.PeakRSS >> S.ChildrenPeakRSS;
+        if (!IS)
+            return false;
+        Records.push_back(S);
+    }
+    src.close();
+    unlink(Part.c_str());
+    return true;
+}
+
+}
+
+void
+acl::enableTimeReport() {
+    Enabled = true;
+}
+
+bool
+acl::isTimeReportEnabled() {
+    return Enabled;
+}
+
+TimeRegion::TimeRegion(const std::string &Stage, const std::string &Name)
+    : Stage(Stage), Name(Name)
+{
+    if (!Enabled)
+        return;
+
+    std::lock_guard<std::mutex> Lock(SampleLock);
+    T.reset(new Timer(Stage + ": " + Name,getTimerGroup()));
+    T->startTimer();
+    Start = TimeRecord::getCurrentTime(true);
+}
+
+void
+TimeRegion::stop() {
+    if (!T)
+        return;
+
+    TimeRecord Time = TimeRecord::getCurrentTime(false);
+    Time -= Start;
+
+    TimeSample S;
+    S.Stage = Stage;
+    S.Name = Name;
+    S.Wall = Time.getWallTime();
+    S.User = Time.getUserTime();
+    S.System = Time.getSystemTime();
+    S.PeakRSS = getPeakRSS(RUSAGE_SELF);
+    S.ChildrenPeakRSS = getPeakRSS(RUSAGE_CHILDREN);
+
+    std::lock_guard<std::mutex> Lock(SampleLock);
+    T->stopTimer();
+    T.reset();
+    Samples.push_back(S);
+}
+
+TimeReportPart::TimeReportPart(const std::string &File) : File(File), First(0) {
+    if (!Enabled)
+        return;
+
+    std::lock_guard<std::mutex> Lock(SampleLock);
+    PartGroup = new TimerGroup("acl time report: " + File);
+    First = Samples.size();
+}
+
+TimeReportPart::~TimeReportPart() {
+    if (!Enabled)
+        return;
+
+    std::lock_guard<std::mutex> Lock(SampleLock);
+    PartGroup->print(llvm::outs());
+    delete PartGroup;
+    PartGroup = NULL;
+
+    std::ofstream dst(getTimeReportPart(File).c_str());
+    for (std::vector<TimeSample>::iterator
+             II = Samples.begin() + First, EE = Samples.end(); II != EE; ++II)
+        dst << II->Stage << "\t" << II->Name << "\t"
+            << II->Wall << " " << II->User << " " << II->System << " "
+            << II->PeakRSS << " " << II->ChildrenPeakRSS << "\n";
+    dst.flush();
+    Samples.erase(Samples.begin() + First,Samples.end());
+}
+
+int
+acl::writeTimeReport(const std::string &ReportFile,
+                     const std::vector<std::string> &InputFiles) {
+    std::vector<TimeSample> Records;
+    for (std::vector<std::string>::const_iterator
+             II = InputFiles.begin(), EE = InputFiles.end(); II != EE; ++II) {
+        if (!readPart(*II,Records)) {
+            llvm::outs() << ERROR << "corrupted time report of '" << *II << "'\n";
+            return 1;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> Lock(SampleLock);
+        getTimerGroup().print(llvm::outs());
+        Records.insert(Records.end(),Samples.begin(),Samples.end());
+        Samples.clear();
+    }
+
+    std::error_code EC;
+    raw_fd_ostream dst(ReportFile,EC,sys::fs::F_Text);
+    if (EC) {
+        llvm::outs() << ERROR << "cannot open '" << ReportFile << "': " << EC.message() << "\n";
+        return 1;
+    }
+
+    dst << "{\n  \"samples\": [";
+    for (std::vector<TimeSample>::iterator
+             II = Records.begin(), EE = Records.end(); II != EE; ++II) {
+        dst << (II == Records.begin() ? "\n" : ",\n")
+            << "    {\"stage\": " << quoteJSON(II->Stage)
+            << ", \"name\": " << quoteJSON(II->Name)
+            << ", \"wall\": " << format("%.6f",II->Wall)
+            << ", \"user\": " << format("%.6f",II->User)
+            << ", \"system\": " << format("%.6f",II->System)
+            << ", \"peak_rss_kb\": " << II->PeakRSS
+            << ", \"children_peak_rss_kb\": " << II->ChildrenPeakRSS
+            << "}";
+    }
+    dst << "\n  ]\n}\n";
+
+    llvm::outs() << "Write time report       : '" << ReportFile << "'  -  "
+                 << Records.size() << " sample(s)\n";
+    return 0;
+}
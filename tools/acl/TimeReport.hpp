@@ -0,0 +1,63 @@
+#ifndef ACL_TIME_REPORT_HPP_
+#define ACL_TIME_REPORT_HPP_
+
+#include "llvm/Support/Timer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace acl {
+
+///////////////////////////////////////////////////////////////////////////////
+//                        Time Report
+///////////////////////////////////////////////////////////////////////////////
+
+//-acl-time-report times the stages of the driver, the printing and the call
+//dependencies of the kernels, the kernel builds, the formatting of the
+//generated files and the clang invocations. Every region is a Timer of the
+//TimerGroup of the driver or of an input file and a sample of the JSON
+//report. A forked Stage1 worker writes its samples next to its input file,
+//the driver merges them in the order of the inputs like the parts of the
+//--resource-report.
+
+void enableTimeReport();
+bool isTimeReportEnabled();
+
+//times the enclosing scope if the report is enabled, safe on the kernel
+//build threads. The user and system times are the ones of the process.
+class TimeRegion {
+private:
+    std::unique_ptr<llvm::Timer> T;
+    llvm::TimeRecord Start;
+    std::string Stage;
+    std::string Name;
+
+public:
+    TimeRegion(const std::string &Stage, const std::string &Name);
+    ~TimeRegion() { stop(); }
+
+    //end the region before the end of the scope
+    void stop();
+};
+
+//the regions of the scope are timed in a TimerGroup of File, which is
+//printed at the end of the scope and its samples moved to the part of File
+class TimeReportPart {
+private:
+    std::string File;
+    size_t First;
+
+public:
+    explicit TimeReportPart(const std::string &File);
+    ~TimeReportPart();
+};
+
+//print the Timers of the driver and write the samples of the driver and of
+//the parts of InputFiles as JSON
+int writeTimeReport(const std::string &ReportFile,
+                    const std::vector<std::string> &InputFiles);
+
+}
+
+#endif
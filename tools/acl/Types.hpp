@@ -1,14 +1,22 @@
 #ifndef __ACL_TYPES_H__
 #define __ACL_TYPES_H__
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/SetVector.h"
 
 #include "clang/Basic/Centaurus.h"
 
+#include <algorithm>
+#include <map>
+
 #include "Common.hpp"
 #include "CentaurusConfig.hpp"
 
+namespace llvm {
+    class raw_ostream;
+}
+
 namespace clang {
     class FunctionDecl;
     class ASTContext;
@@ -41,6 +49,22 @@ struct ObjRefDef {
     ObjRefDef() {}
 };
 
+//two adjacent tasks of the same region that run as one kernel, see --fuse-tasks
+struct TaskFusion {
+    clang::centaurus::DirectiveInfo *First;
+    clang::centaurus::DirectiveInfo *Second;
+
+    //kernel argument of each call argument of the second task, the call
+    //arguments of the first task are the first kernel arguments
+    std::vector<unsigned> SecondArgs;
+    unsigned NumArgs;
+
+    //data dependency of the kernel arguments shared by both tasks
+    std::map<unsigned, clang::centaurus::ClauseKind> SharedDeps;
+
+    TaskFusion() : First(0), Second(0), NumArgs(0) {}
+};
+
 struct DataIOSrc {
     std::string NameRef;
     std::string Definition;
@@ -52,9 +76,17 @@ struct DataIOSrc {
         init(Context,DI,RStack);
     }
 
+    DataIOSrc(clang::ASTContext *Context,const TaskFusion &Fusion,
+              clang::centaurus::RegionStack &RStack)
+    {
+        init(Context,Fusion,RStack);
+    }
+
 private:
     void init(clang::ASTContext *Context,clang::centaurus::DirectiveInfo *DI,
               clang::centaurus::RegionStack &RStack);
+    void init(clang::ASTContext *Context,const TaskFusion &Fusion,
+              clang::centaurus::RegionStack &RStack);
 };
 
 struct PTXASInfo {
@@ -88,6 +120,12 @@ struct DeviceBin : public ObjRefDef {
     ObjRefDef Bin;
     struct PTXASInfo Log;
 
+    //the fastest local size found by --autotune, empty if not tuned
+    std::vector<size_t> TunedLocal;
+
+    //the binary, embedded from a side file of the generated sources
+    std::string Data;
+
     explicit DeviceBin(std::string &PlatformName,
                        std::string &SymbolName,
                        std::string &PrefixDef,
@@ -96,17 +134,160 @@ struct DeviceBin : public ObjRefDef {
                        std::string &RawLog,
                        const int id);
 
-    std::string ToHex(const std::string &src);
+    //the build log is already parsed, e.g. found in the kernel cache
+    explicit DeviceBin(std::string &PlatformName,
+                       std::string &SymbolName,
+                       std::string &PrefixDef,
+                       std::string &APINameRef,
+                       std::string &BinArray,
+                       const PTXASInfo &Info,
+                       const int id);
+
+    //definition of Bin that includes the binary from Path
+    std::string printIncbin(const std::string &Path) const;
 
+    //add the TunedLocal to the Definition
+    void setTunedLocal(const std::vector<size_t> &Local);
+
+private:
+    void init(std::string &SymbolName,
+              std::string &PrefixDef,
+              std::string &APINameRef,
+              std::string &BinArray,
+              const int id);
 };
 
 struct PlatformBin : public ObjRefDef, public std::vector<DeviceBin> {
     //if empty ignore this KernelBin
     std::string PlatformName;
+    //the source and the log of a failed build, see CompileScheduler::run()
+    std::string BuildError;
 
     explicit PlatformBin(std::string PlatformName) : PlatformName(PlatformName) {}
 
     PlatformBin() {}
+
+    //the device table of the Definition
+    void printDeviceTable();
+};
+
+struct KernelRefDef;
+
+//the knobs of an approximate kernel that acl generates from the accurate one
+//of a task without approxfun(), see the perforate() and relaxed_math clauses
+struct KernelApproximation {
+    //every PerforationRate-th iteration of the innermost loops is executed
+    unsigned PerforationRate;
+    //build with -cl-fast-relaxed-math
+    bool RelaxedMath;
+
+    KernelApproximation() : PerforationRate(1), RelaxedMath(false) {}
+
+    bool empty() const { return PerforationRate <= 1 && !RelaxedMath; }
+
+    //appended to the name of the accurate kernel
+    std::string getSuffix() const {
+        std::string Suffix = "__approx";
+        if (PerforationRate > 1)
+            Suffix += "_perf" + toString(PerforationRate);
+        if (RelaxedMath)
+            Suffix += "_relaxed";
+        return Suffix + "__";
+    }
+};
+
+//the constant integer arguments of a task call site, see --specialize-kernels
+struct KernelSpecialization {
+    //the unique name of the specialised kernel
+    std::string Name;
+    //parameter index and the printed constant
+    std::vector<std::pair<unsigned,std::string> > Constants;
+
+    bool empty() const { return Constants.empty(); }
+
+    //equal for the call sites that share the specialised kernel
+    std::string getKey(const std::string &Kernel) const {
+        std::string Key = Kernel;
+        for (std::vector<std::pair<unsigned,std::string> >::const_iterator
+                 II = Constants.begin(), EE = Constants.end(); II != EE; ++II)
+            Key += " " + toString(II->first) + "=" + II->second;
+        return Key;
+    }
+};
+
+//the body of an element-wise kernel rewritten to OpenCL vector types, see
+//--cpu-vector-width
+struct KernelVectorization {
+    //elements per work-item
+    unsigned Width;
+    //printed instead of the body of the kernel
+    std::string Body;
+
+    KernelVectorization() : Width(0) {}
+
+    bool empty() const { return !Width; }
+
+    //appended to the name of the accurate kernel
+    std::string getSuffix() const {
+        return "__vec" + toString(Width);
+    }
+};
+
+//an argument of a kernel launched by --autotune
+struct AutotuneArg {
+    enum ArgKind {
+        AK_BUFFER,   //zeroed global buffer of the size of the data clause
+        AK_SCALAR    //the constant argument of the task
+    };
+
+    ArgKind Kind;
+    //bytes of a buffer
+    size_t Size;
+    //host bytes of a scalar
+    std::string Value;
+
+    explicit AutotuneArg(size_t Size) : Kind(AK_BUFFER), Size(Size) {}
+    explicit AutotuneArg(const std::string &Value) :
+        Kind(AK_SCALAR), Size(Value.size()), Value(Value) {}
+};
+
+//how --autotune launches a kernel, empty if it is not tuned
+struct AutotuneSpec {
+    std::string KernelName;
+    std::vector<AutotuneArg> Args;
+    //the global size of each dimension of the first task of the kernel
+    std::vector<size_t> GlobalSize;
+
+    bool empty() const { return KernelName.empty(); }
+};
+
+//Collects the pending kernel builds of a translation unit and runs them on a
+//bounded pool of threads. The unit of work is one kernel variant on one
+//platform. Results are stored in enqueue order, no matter which build
+//finishes first.
+class CompileScheduler {
+private:
+    struct CompileJob {
+        KernelRefDef *Kernel;
+        std::string Src;
+        std::string SymbolName;
+        std::string PrefixDef;
+        std::vector<std::string> Options;
+    };
+
+    std::vector<CompileJob> Jobs;
+
+public:
+    void enqueue(KernelRefDef *Kernel, const std::string &Src,
+                 const std::string &SymbolName, const std::string &PrefixDef,
+                 const std::vector<std::string> &Options);
+
+    //fill the Binary of every enqueued kernel, return 0 on success. The
+    //logs of the failed builds are printed after all the builds ended.
+    int run(const CentaurusConfig &ACLConfig);
+
+    bool empty() const { return Jobs.empty(); }
+    size_t size() const { return Jobs.size(); }
 };
 
 struct KernelRefDef {
@@ -123,25 +304,119 @@ struct KernelRefDef {
 
     std::vector<PlatformBin> Binary;
 
-    KernelRefDef(const CentaurusConfig &ACLConfig) : ACLConfig(ACLConfig) {}
+    //work-items per work-group of the tasks that run this kernel,
+    //0 if a task has no compile time geometry
+    std::vector<size_t> WorkGroupSizes;
+
+    void addWorkGroupSize(size_t Size) {
+        if (std::find(WorkGroupSizes.begin(),WorkGroupSizes.end(),Size) == WorkGroupSizes.end())
+            WorkGroupSizes.push_back(Size);
+    }
+
+    //the task site code of the kernel, the copy of the descriptor of a
+    //launch, empty if the descriptor is static
+    std::string SiteDefinition;
+
+    //the launch of the kernel for --autotune
+    AutotuneSpec Tune;
+
+    //set Tune from the first task of the kernel
+    void setAutotune(clang::ASTContext *Context, clang::FunctionDecl *FD,
+                     clang::centaurus::DirectiveInfo *DI);
+
+    //the vectorised kernel the runtime runs on CPU devices, not owned
+    KernelRefDef *CPUVariant;
+    //elements per work-item if this is a CPU variant, 0 otherwise
+    unsigned VectorWidth;
+
+    KernelRefDef(const CentaurusConfig &ACLConfig) :
+        ACLConfig(ACLConfig), CPUVariant(NULL), VectorWidth(0),
+        InlineSize(0), StaticDeviceType(true), Finalized(true) {}
 
     void findCallDeps(clang::FunctionDecl *StartFD, clang::CallGraph *CG,
                       llvm::SmallSetVector<clang::FunctionDecl *,sizeof(clang::FunctionDecl *)> &Deps);
 
-    //return the size of the compiled kernel in bytes, 0 if cannot compile
-    int compile(std::string src, std::string SymbolName, std::string PrefixDef,
-                const std::vector<std::string> &options = std::vector<std::string>());
+    //call after the CompileScheduler has filled the Binary
+    void finalize();
+
+    //the file scope definitions of the impl file, streamed instead of kept
+    //in the HostCode and InlineDeviceCode Definitions
+    void printInlineSource(llvm::raw_ostream &OS) const;
+    void printHostCode(llvm::raw_ostream &OS) const;
+
+    //the descriptor referenced by the task sites
+    std::string getHostRef() const {
+        return HostCode.NameRef.compare("NULL") == 0 ? HostCode.NameRef : "&" + HostCode.NameRef;
+    }
+
+    //the descriptor of a launch, see SiteDefinition
+    std::string getSiteRef() const {
+        return SiteDefinition.empty() ? getHostRef() : "&" + HostCode.NameRef + "__site";
+    }
 
     KernelRefDef(const CentaurusConfig &ACLConfig,
+                 CompileScheduler &Scheduler,
                  clang::ASTContext *Context,clang::FunctionDecl *FD, clang::CallGraph *CG,
                  const clang::centaurus::DirectiveInfo *DI,
                  std::string &Extensions, std::string &UserTypes,
                  const enum clang::centaurus::PrintSubtaskType = clang::centaurus::K_PRINT_ALL);
 
+    //the kernel of a TaskFusion, FusedKernel calls FirstFD and SecondFD
+    KernelRefDef(const CentaurusConfig &ACLConfig,
+                 CompileScheduler &Scheduler,
+                 clang::ASTContext *Context,
+                 clang::FunctionDecl *FirstFD, clang::FunctionDecl *SecondFD,
+                 const ObjRefDef &FusedKernel, clang::CallGraph *CG,
+                 const clang::centaurus::DirectiveInfo *DI,
+                 std::string &Extensions, std::string &UserTypes);
+
+    //the approximate kernel of a task without approxfun(), generated from FD
+    KernelRefDef(const CentaurusConfig &ACLConfig,
+                 CompileScheduler &Scheduler,
+                 clang::ASTContext *Context,clang::FunctionDecl *FD,
+                 const KernelApproximation &Approx, clang::CallGraph *CG,
+                 const clang::centaurus::DirectiveInfo *DI,
+                 std::string &Extensions, std::string &UserTypes);
+
+    //the accurate kernel FD with the constant arguments of a call site
+    KernelRefDef(const CentaurusConfig &ACLConfig,
+                 CompileScheduler &Scheduler,
+                 clang::ASTContext *Context,clang::FunctionDecl *FD,
+                 const KernelSpecialization &Spec, clang::CallGraph *CG,
+                 const clang::centaurus::DirectiveInfo *DI,
+                 std::string &Extensions, std::string &UserTypes);
+
+    //the CPU variant of the accurate kernel FD
+    KernelRefDef(const CentaurusConfig &ACLConfig,
+                 CompileScheduler &Scheduler,
+                 clang::ASTContext *Context,clang::FunctionDecl *FD,
+                 const KernelVectorization &Vec, clang::CallGraph *CG,
+                 const clang::centaurus::DirectiveInfo *DI,
+                 std::string &Extensions, std::string &UserTypes);
+
     size_t getKernelUID(std::string Name);
 
     std::string setDeviceType(const clang::centaurus::DirectiveInfo *DI, const clang::centaurus::ClauseKind CK);
 
+private:
+    void init(CompileScheduler &Scheduler, clang::ASTContext *Context,
+              llvm::ArrayRef<clang::FunctionDecl *> Kernels, const ObjRefDef &FusedKernel,
+              clang::CallGraph *CG, const clang::centaurus::DirectiveInfo *DI,
+              std::string &Extensions, std::string &UserTypes,
+              const enum clang::centaurus::PrintSubtaskType SubtaskPrintMode,
+              const KernelApproximation *Approx = NULL,
+              const KernelSpecialization *Spec = NULL,
+              const KernelVectorization *Vec = NULL);
+
+    //the OpenCL source of the kernel, unescaped
+    std::string InlineSource;
+
+    //kept until finalize()
+    std::string PrefixDef;
+    std::string DeviceType;
+    size_t InlineSize;
+    bool StaticDeviceType;
+    bool Finalized;
 };
 
 }
@@ -20,11 +20,18 @@
 #include "Stages.hpp"
 #include "CentaurusConfig.hpp"
 #include "ClangFormat.hpp"
+#include "ObjCompiler.hpp"
+#include "ResourceReport.hpp"
+#include "TimeReport.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
 #include <cstdlib>
+#include <cerrno>
 
+#include <poll.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -42,6 +49,22 @@ using namespace acl;
 
 static llvm::cl::OptionCategory aclCategory("acl options");
 
+// the files of a clang invocation, for the time report
+static std::string getClangFiles(SmallVector<const char *, 256> &cli) {
+    std::string Files;
+    for (SmallVector<const char *, 256>::iterator
+             II = cli.begin(), EE = cli.end(); II != EE; ++II) {
+        if (**II == '-') {
+            // skip the output file
+            if (StringRef(*II).equals("-o") && II + 1 != EE)
+                ++II;
+            continue;
+        }
+        Files += (Files.size() ? " " : "") + std::string(*II);
+    }
+    return Files;
+}
+
 int runClang(const acl::CentaurusConfig &Config, std::string Path, SmallVector<const char *, 256> &cli) {
 #if 1
     llvm::outs() << "\n" << DEBUG << Path << " ";
@@ -52,6 +75,8 @@ int runClang(const acl::CentaurusConfig &Config, std::string Path, SmallVector<c
     llvm::outs() << "\n";
 #endif
 
+    TimeRegion Time("clang",getClangFiles(cli));
+
     using namespace clang::driver;
 
     /////////////////////////////////////////////////////////////////////////////////////
@@ -163,13 +188,267 @@ int CheckGeneratedSourceFiles(int argc, const char *argv[], const acl::Centaurus
     return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//                        Translation Units
+///////////////////////////////////////////////////////////////////////////////
+
+// the files generated by Stage0 and Stage1 for one translation unit
+struct TUFiles {
+    std::vector<std::string> RegularFiles;
+    std::vector<std::string> OutputFiles;
+    std::vector<std::string> LibOCLFiles;
+    std::vector<std::string> KernelFiles;
+};
+
+static int runStagesOnTU(const acl::CentaurusConfig &Config,
+                         const CompilationDatabase &Compilations,
+                         const std::string &File, TUFiles &Files) {
+    // outlives the regions below
+    TimeReportPart Part(File);
+
+    std::vector<std::string> Input(1,File);
+
+    // Stage0 and Stage1 share one parse of the input file
+    RefactoringTool Tool(Compilations,Input);
+    Stages_ConsumerFactory Stages(Config,Tool.getReplacements(),Files.OutputFiles,Files.RegularFiles,
+                                  Files.LibOCLFiles,Files.KernelFiles);
+    {
+        TimeRegion Time("stage","Stage0/Stage1 " + File);
+        if (Tool.runAndSave(newFrontendActionFactory(&Stages).get())) {
+            llvm::errs() << "Stage0/Stage1 failed on '" << File << "'  -  exit.\n";
+            return 1;
+        }
+    }
+
+    if (Files.OutputFiles.empty())
+        return 0;
+
+    int status = 0;
+
+    std::string Style = "LLVM";
+    for (std::vector<std::string>::iterator
+             II = Files.OutputFiles.begin(),
+             EE = Files.OutputFiles.end(); II != EE; ++II) {
+        TimeRegion Time("format",*II);
+        status += clang_format_main(*II,Style);
+    }
+    for (std::vector<std::string>::iterator
+             II = Files.KernelFiles.begin(),
+             EE = Files.KernelFiles.end(); II != EE; ++II) {
+        TimeRegion Time("format",*II);
+        status += clang_format_main(*II,Style);
+    }
+
+    if (status != 0) {
+        llvm::errs() << "Format new generated source files of '" << File << "' failed  -  exit.\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+// a forked worker reports its generated files through a pipe, one per line
+static void writeTUFiles(int fd, const TUFiles &Files) {
+    raw_fd_ostream OS(fd,/*shouldClose=*/true);
+#define WRITE(kind,list)                                                \
+    for (std::vector<std::string>::const_iterator                       \
+             II = Files.list.begin(), EE = Files.list.end(); II != EE; ++II) \
+        OS << kind << " " << *II << "\n";
+    WRITE('R',RegularFiles);
+    WRITE('O',OutputFiles);
+    WRITE('L',LibOCLFiles);
+    WRITE('K',KernelFiles);
+#undef WRITE
+}
+
+static void readTUFiles(int fd, TUFiles &Files) {
+    std::string Data;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd,buffer,sizeof(buffer))) > 0)
+        Data.append(buffer,n);
+
+    std::stringstream IS(Data);
+    for (std::string line; std::getline(IS,line);) {
+        if (line.size() < 3)
+            continue;
+        std::string File = line.substr(2);
+        switch (line[0]) {
+        case 'R': Files.RegularFiles.push_back(File); break;
+        case 'O': Files.OutputFiles.push_back(File); break;
+        case 'L': Files.LibOCLFiles.push_back(File); break;
+        case 'K': Files.KernelFiles.push_back(File); break;
+        }
+    }
+}
+
+// Run Stage0, Stage1 and formatting on every translation unit, in parallel
+// forked workers if we are allowed to. The generated files are collected in
+// the order of the input files, no matter which worker finishes first.
+static int runStages(acl::CentaurusConfig &Config, const CompilationDatabase &Compilations) {
+    const size_t NumTU = Config.InputFiles.size();
+    std::vector<TUFiles> Results(NumTU);
+
+    size_t Parallel = std::min<size_t>(Config.Jobs,NumTU);
+
+    llvm::outs() << "Stage0/Stage1: Transform " << NumTU << " input file(s) ...\n";
+
+    if (Parallel <= 1) {
+        for (size_t i=0; i<NumTU; ++i) {
+            acl::CentaurusConfig TUConfig = Config;
+            TUConfig.TUIndex = i;
+            if (runStagesOnTU(TUConfig,Compilations,Config.InputFiles[i],Results[i]))
+                return 1;
+        }
+    }
+    else {
+        struct Worker {
+            int pid;
+            int fd;
+            size_t TU;
+        };
+        std::vector<Worker> Running;
+
+        // share the jobs between the workers and their kernel builds
+        const unsigned WorkerJobs = std::max<unsigned>(1,Config.Jobs / Parallel);
+
+        int Failed = 0;
+        size_t Next = 0;
+        while (Next < NumTU || !Running.empty()) {
+            if (!Failed && Next < NumTU && Running.size() < Parallel) {
+                int fds[2];
+                if (pipe(fds)) {
+                    llvm::outs() << "pipe() failed  -  exit.\n";
+                    Failed = 1;
+                    continue;
+                }
+
+                // do not duplicate buffered output in the worker
+                llvm::outs().flush();
+                std::cout.flush();
+
+                int pid = fork();
+                if (pid < 0) {
+                    llvm::outs() << "fork() failed  -  exit.\n";
+                    close(fds[0]);
+                    close(fds[1]);
+                    Failed = 1;
+                    continue;
+                }
+                if (!pid) {
+                    close(fds[0]);
+                    acl::CentaurusConfig TUConfig = Config;
+                    TUConfig.TUIndex = Next;
+                    TUConfig.Jobs = WorkerJobs;
+                    TUFiles Files;
+                    int Res = runStagesOnTU(TUConfig,Compilations,Config.InputFiles[Next],Files);
+                    if (!Res)
+                        writeTUFiles(fds[1],Files);
+                    llvm::outs().flush();
+                    std::cout.flush();
+                    _exit(Res);
+                }
+
+                close(fds[1]);
+                Worker W = { pid, fds[0], Next++ };
+                Running.push_back(W);
+                continue;
+            }
+
+            if (Running.empty())
+                break;
+
+            // reap whichever worker ends first, its pipe is readable once it
+            // wrote its files or exited, and refill its slot
+            std::vector<struct pollfd> fds(Running.size());
+            for (size_t i=0; i<Running.size(); ++i) {
+                fds[i].fd = Running[i].fd;
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+            if (poll(fds.data(),fds.size(),-1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                llvm::outs() << "poll() failed  -  exit.\n";
+                Failed = 1;
+                fds[0].revents = POLLHUP;
+            }
+            size_t Done = 0;
+            while (!fds[Done].revents)
+                ++Done;
+
+            Worker W = Running[Done];
+            Running.erase(Running.begin() + Done);
+            readTUFiles(W.fd,Results[W.TU]);
+            close(W.fd);
+
+            int status;
+            if (waitpid(W.pid,&status,0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+                llvm::outs() << "Fail : worker for '" << Config.InputFiles[W.TU] << "'\n";
+                Failed = 1;
+            }
+        }
+
+        if (Failed)
+            return 1;
+    }
+
+    for (std::vector<TUFiles>::iterator
+             II = Results.begin(), EE = Results.end(); II != EE; ++II) {
+        Config.RegularFiles.insert(Config.RegularFiles.end(),II->RegularFiles.begin(),II->RegularFiles.end());
+        Config.OutputFiles.insert(Config.OutputFiles.end(),II->OutputFiles.begin(),II->OutputFiles.end());
+        Config.LibOCLFiles.insert(Config.LibOCLFiles.end(),II->LibOCLFiles.begin(),II->LibOCLFiles.end());
+        Config.KernelFiles.insert(Config.KernelFiles.end(),II->KernelFiles.begin(),II->KernelFiles.end());
+    }
+
+    return 0;
+}
+
 // CommonOptionsParser declares HelpMessage with a description of the common
 // command-line options related to the compilation database and input files.
 // It's nice to have this help message in all tools.
 static cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage);
 
 // A help message for this specific tool can be added afterwards.
-static cl::extrahelp MoreHelp("\nInvocation\n\t./acl input-files [-- compiler-flags]\n\n");
+static cl::extrahelp MoreHelp("\nInvocation\n\t./acl [acl-options] input-files [-- compiler-flags]\n\n"
+                               "acl options\n"
+                               "\t--profile                 build in profile mode\n"
+                               "\t--profile-sample=<n>      count the basic blocks of one work-group in n in\n"
+                               "\t                          profile mode\n"
+                               "\t-j <N>                    run up to N jobs (input files, kernel builds) in parallel\n"
+                               "\t--kernel-cache=<dir>      kernel binary cache directory\n"
+                               "\t--no-kernel-cache         always rebuild the OpenCL kernels\n"
+                               "\t--single-object           link at IR level, emit one object without 'ld -r'\n"
+                               "\t--syntax-check            check the generated files before compiling them\n"
+                               "\t--fuse-tasks              run adjacent tasks that chain through their data\n"
+                               "\t                          clauses as one kernel, if both kernels index the\n"
+                               "\t                          written buffers by get_global_id() only\n"
+                               "\t--static-task-sites       identify the task sites by a static table instead\n"
+                               "\t                          of a source location string per launch. The\n"
+                               "\t                          table holds the task dependencies proven from\n"
+                               "\t                          the data clauses and a dynamic_deps flag for\n"
+                               "\t                          the sites the runtime must check\n"
+                               "\t--batch-tasks             create the tasks of a counted loop whose body is\n"
+                               "\t                          a single task by one runtime call\n"
+                               "\t--elide-transfers         keep on the device the local buffers the host\n"
+                               "\t                          code does not use after the task that writes them\n"
+                               "\t--specialize-kernels      build a copy of the kernel for the constant integer\n"
+                               "\t                          arguments of each task call site\n"
+                               "\t--strip-kernel-sources    print only the declarations a kernel uses instead\n"
+                               "\t                          of including the headers that define them\n"
+                               "\t--cpu-vector-width=<n>    add a variant of the element-wise kernels for CPU\n"
+                               "\t                          devices that computes n (2, 4, 8, 16) elements\n"
+                               "\t                          per work-item\n"
+                               "\t--autotune                run the kernels with a constant launch on the\n"
+                               "\t                          available OpenCL devices and record the fastest\n"
+                               "\t                          local size per device, see --kernel-cache\n"
+                               "\t--kernel-backend=<name>   build the kernels with 'opencl' or 'spir'\n"
+                               "\t--resource-report=<file>  write the per device resources of the kernels\n"
+                               "\t                          as JSON, or as CSV if <file> ends with .csv\n"
+                               "\t-acl-time-report[=<file>] print the time and peak memory of the stages,\n"
+                               "\t                          kernel builds, formatting and clang invocations\n"
+                               "\t                          and write them as JSON to <file>, by default\n"
+                               "\t                          acl_time_report.json\n\n");
 
 int main(int argc, const char *argv[]) {
     acl::CentaurusConfig Config(argc,argv);
@@ -180,6 +459,9 @@ int main(int argc, const char *argv[]) {
         return 0;
     }
 
+    if (Config.TimeReport.size())
+        enableTimeReport();
+
     if (!Config.InputFiles.size()) {
         //treat as raw clang invocation
         //llvm::outs() << WARNING << "no input files, enter clang mode.\n";
@@ -227,6 +509,9 @@ int main(int argc, const char *argv[]) {
 
         //llvm::outs() << DEBUG << "Exit clang mode.\n";
 
+        if (Config.TimeReport.size() && writeTimeReport(Config.TimeReport,Config.InputFiles))
+            return 1;
+
         return 0;
     }
 
@@ -274,22 +559,16 @@ int main(int argc, const char *argv[]) {
 
     Config.InputFiles = OptionsParser.getSourcePathList();
 
-    if (Config.InputFiles.size() != 1) {
-        llvm::outs() << "Unsupported multiple input files  -  exit.\n";
-        return 1;
+    {
+        TimeRegion Time("stage","Stage0/Stage1");
+        if (runStages(Config,OptionsParser.getCompilations()))
+            return 1;
     }
 
-    //After Stage0, proccess only the files that contain Centaurus Directives and main() function
-
-    llvm::outs() << "Stage0: Check input files ...\n";
-    RefactoringTool Tool0(OptionsParser.getCompilations(), Config.InputFiles);
-    Stage0_ConsumerFactory Stage0(Config,Config.OutputFiles,Config.RegularFiles);
-    if (Tool0.runAndSave(newFrontendActionFactory(&Stage0).get())) {
-        llvm::errs() << "Stage0 failed - exit.\n";
+    if (Config.ResourceReport.size() && writeResourceReport(Config.ResourceReport,Config.OutputFiles))
         return 1;
-    }
 
-    if (!Config.RegularFiles.empty()) {
+    if (Config.OutputFiles.empty()) {
         //llvm::outs() << WARNING << "Source code has no directives, enter clang mode.\n";
 
         SmallVector<const char *, 256> cli;
@@ -318,110 +597,24 @@ int main(int argc, const char *argv[]) {
 
         //llvm::outs() << DEBUG << "Exit clang mode.\n";
 
-        return 0;
-    }
-
-    if (Config.OutputFiles.empty()) {
-        llvm::outs() << "UNEXPECTED ERROR: Source code has no directives, nothing to do - exit.\n";
-        return 1;
-    }
-
-    llvm::outs() << "Stage1: Transform source code ...\n";
-    RefactoringTool Tool1(OptionsParser.getCompilations(), Config.OutputFiles);
-    Stage1_ConsumerFactory Stage1(Config,Tool1.getReplacements(),Config.LibOCLFiles,Config.KernelFiles);
-    if (Tool1.runAndSave(newFrontendActionFactory(&Stage1).get())) {
-        llvm::errs() << "Stage1 failed - exit.\n";
-        return 1;
-    }
-
-#if 0
-    // Clang does not like the keyword 'static' for function declarations.
-    // The underlying OpenCL compiler is happy with it.
-    if (!Config.KernelFiles.empty()) {
-        std::vector<std::string> kernel_conf;
-        /* clang
-           -S
-           -emit-llvm
-           -o test.ll
-           -x cl
-           -I./libclc/generic/include
-           -include clc/clc.h
-           -Dcl_clang_storage_class_specifiers
-           -w
-        */
-
-        kernel_conf.push_back("--");
-        kernel_conf.push_back("-S");
-        kernel_conf.push_back("-o tmp.ll");
-        kernel_conf.push_back("-I.");
-        //kernel_conf.push_back("-I./libclc/generic/include");
-        //kernel_conf.push_back("-include clc/clc.h");
-        //kernel_conf.push_back("-Dcl_clang_storage_class_specifiers");
-        kernel_conf.push_back("-Wno-implicit-function-declaration");
-        kernel_conf.push_back("-x");
-        kernel_conf.push_back("cl");
-        //kernel_conf.push_back("-w");
-
-        int KernelARGC = 1 + Config.KernelFiles.size() + kernel_conf.size();
-        const char **KernelARGV = new const char*[1 + Config.KernelFiles.size() + kernel_conf.size()];
-
-        KernelARGV[0] = argv[0];
-        int i = 1;
-        for (std::vector<std::string>::iterator II = Config.KernelFiles.begin(),
-                 EE = Config.KernelFiles.end(); II != EE; ++II,++i)
-            KernelARGV[i] = (*II).c_str();
-        for (std::vector<std::string>::size_type i=0; i<kernel_conf.size(); ++i)
-            KernelARGV[1 + Config.KernelFiles.size() + i] = kernel_conf[i].c_str();
-
-        llvm::outs() << "Check new generated device files ...\n";
-        CommonOptionsParser KernelOptionsParser(KernelARGC, KernelARGV, aclCategory);
-        ClangTool Tool6(KernelOptionsParser.getCompilations(),Config.KernelFiles);
-        if (Tool6.run(newFrontendActionFactory<SyntaxOnlyAction>().get())) {
-            llvm::errs() << "FATAL: __internal_error__: illegal device code  -  Exit.\n";
+        if (Config.TimeReport.size() && writeTimeReport(Config.TimeReport,Config.InputFiles))
             return 1;
-        }
-    }
-#endif
-
-    llvm::outs() << "\n";
-    llvm::outs() << "Format new generated source files ... ";
-
-    int status = 0;
 
-    std::string Style = "LLVM";
-    for (std::vector<std::string>::iterator
-             II = Config.OutputFiles.begin(),
-             EE = Config.OutputFiles.end(); II != EE; ++II) {
-        status += clang_format_main(*II,Style);
-    }
-#if 0
-    for (std::vector<std::string>::iterator
-             II = Config.LibOCLFiles.begin(),
-             EE = Config.LibOCLFiles.end(); II != EE; ++II) {
-        status += clang_format_main(*II,Style);
-    }
-#endif
-    for (std::vector<std::string>::iterator
-             II = Config.KernelFiles.begin(),
-             EE = Config.KernelFiles.end(); II != EE; ++II) {
-        status += clang_format_main(*II,Style);
+        return 0;
     }
 
-    //errs() << "status = " << status << "\n";
-    if (status != 0) {
-        llvm::outs() << "Fail\n";
-        return 1;
+    // otherwise the compilation of the objects validates the generated files
+    if (Config.SyntaxCheck) {
+        TimeRegion Time("stage","Check");
+        if (CheckGeneratedSourceFiles(argc,argv,Config))
+            return 1;
     }
-    llvm::outs() << "OK\n";
-
-#if 1
-    if (CheckGeneratedSourceFiles(argc,argv,Config))
-        return 1;
-#endif
 
     llvm::outs() << "Generate temporary object files ... ";
 
     {
+        TimeRegion ObjTime("stage","Generate temporary object files");
+
         SmallVector<const char *, 256> cli;
 
         //cli.push_back("-###");
@@ -442,44 +635,78 @@ int main(int argc, const char *argv[]) {
 
         std::vector<std::string> TmpObjList;
 
+        // host code generated by Stage1
+        std::vector<std::string> GeneratedSources(Config.OutputFiles);
         for (std::vector<std::string>::iterator
-                 II = Config.OutputFiles.begin(),
-                 EE = Config.OutputFiles.end(); II != EE; ++II) {
-#if 0
+                 II = Config.LibOCLFiles.begin(),
+                 EE = Config.LibOCLFiles.end(); II != EE; ++II) {
             if (GetDotExtension(*II).compare(".c") != 0)
                 continue;
-#endif
-            std::string obj = RemoveDotExtension(*II) + ".o";
-            obj = GetBasename(obj);
-            //llvm::outs() << obj << "\n";
-            TmpObjList.push_back(obj);
-
-            cli.push_back(II->c_str());
-            cli.push_back("-o");
-            cli.push_back(obj.c_str());
-            Res += runClang(Config,Config.ClangPath,cli);
-            cli.pop_back();
-            cli.pop_back();
-            cli.pop_back();
+            GeneratedSources.push_back(*II);
         }
 
+        // translation units without directives, compile them as they are
+        SmallVector<const char *, 256> regcli;
+        regcli.push_back("-Wall");
+        regcli.push_back("-c");
         for (std::vector<std::string>::iterator
-                 II = Config.LibOCLFiles.begin(),
-                 EE = Config.LibOCLFiles.end(); II != EE; ++II) {
-            if (GetDotExtension(*II).compare(".c") != 0)
-                continue;
-            std::string obj = RemoveDotExtension(*II) + ".o";
-            obj = GetBasename(obj);
-            //llvm::outs() << obj << "\n";
-            TmpObjList.push_back(obj);
+                 II = Config.ExtraCompilerFlags.begin(),
+                 EE = Config.ExtraCompilerFlags.end(); II != EE; ++II)
+            regcli.push_back(II->c_str());
 
-            cli.push_back(II->c_str());
-            cli.push_back("-o");
-            cli.push_back(obj.c_str());
-            Res += runClang(Config,Config.ClangPath,cli);
-            cli.pop_back();
-            cli.pop_back();
-            cli.pop_back();
+        std::string ObjFile = RemoveDotExtension(Config.InputFiles.front()) + ".o";
+        ObjFile = GetBasename(ObjFile);
+
+        if (Config.CompileOnly && Config.UserDefinedOutputFile.size())
+            ObjFile = Config.UserDefinedOutputFile;
+
+        acl::ObjectCompiler ObjCompiler(Config);
+        const bool InProcess = !ObjCompiler.addSources(cli,GeneratedSources)
+            && !ObjCompiler.addSources(regcli,Config.RegularFiles);
+
+        if (!InProcess && Config.SingleObject)
+            llvm::outs() << WARNING << "cannot compile in process, merge the objects with '"
+                         << Config.LinkerPath << " -r'\n";
+
+        const bool MergeObjects = !InProcess || !Config.SingleObject;
+
+        if (InProcess && Config.SingleObject)
+            Res = ObjCompiler.emitSingleObject(ObjFile);
+        else if (InProcess)
+            Res = ObjCompiler.emitObjects(TmpObjList);
+        else {
+            for (std::vector<std::string>::iterator
+                     II = GeneratedSources.begin(),
+                     EE = GeneratedSources.end(); II != EE; ++II) {
+                std::string obj = RemoveDotExtension(*II) + ".o";
+                obj = GetBasename(obj);
+                //llvm::outs() << obj << "\n";
+                TmpObjList.push_back(obj);
+
+                cli.push_back(II->c_str());
+                cli.push_back("-o");
+                cli.push_back(obj.c_str());
+                Res += runClang(Config,Config.ClangPath,cli);
+                cli.pop_back();
+                cli.pop_back();
+                cli.pop_back();
+            }
+
+            for (std::vector<std::string>::iterator
+                     II = Config.RegularFiles.begin(),
+                     EE = Config.RegularFiles.end(); II != EE; ++II) {
+                std::string obj = RemoveDotExtension(*II) + ".o";
+                obj = GetBasename(obj);
+                TmpObjList.push_back(obj);
+
+                regcli.push_back(II->c_str());
+                regcli.push_back("-o");
+                regcli.push_back(obj.c_str());
+                Res += runClang(Config,Config.ClangPath,regcli);
+                regcli.pop_back();
+                regcli.pop_back();
+                regcli.pop_back();
+            }
         }
 
         if (Res) {
@@ -487,14 +714,11 @@ int main(int argc, const char *argv[]) {
             return 1;
         }
         llvm::outs() << "OK\n";
+        ObjTime.stop();
 
-        std::string ObjFile = RemoveDotExtension(Config.InputFiles.front()) + ".o";
-        ObjFile = GetBasename(ObjFile);
-
-        if (Config.CompileOnly && Config.UserDefinedOutputFile.size())
-            ObjFile = Config.UserDefinedOutputFile;
+        if (MergeObjects) {
+            TimeRegion Time("stage","Merge");
 
-        {
             SmallVector<const char *, 256> ldcli;
             ldcli.push_back(Config.LinkerPath.c_str());
             ldcli.push_back("-r");
@@ -554,6 +778,8 @@ int main(int argc, const char *argv[]) {
         }
 
         if (!Config.CompileOnly) {
+            TimeRegion Time("stage","Link");
+
             llvm::outs() << "Link with runtime ... ";
 
 #if 1
@@ -649,14 +875,19 @@ int main(int argc, const char *argv[]) {
         llvm::outs() << "Success!\n";
     }
 
+    if (Config.TimeReport.size() && writeTimeReport(Config.TimeReport,Config.InputFiles))
+        return 1;
+
     llvm::llvm_shutdown();
 
     return 0;
 }
 
 acl::CentaurusConfig::CentaurusConfig(int argc, const char *argv[]) :
-    ProfileMode(false), CompileOnly(false), isCXX(false), NoArgs(false)
-    , NvidiaDriverVersion(MIN_NVIDIA_DRIVER_VERSION)
+    ProfileMode(false), CompileOnly(false), isCXX(false), NoArgs(false), UseKernelCache(true)
+    , SingleObject(false), SyntaxCheck(false), FuseTasks(false), StaticTaskSites(false), BatchTasks(false), ElideTransfers(false)
+    , SpecializeKernels(false), StripKernelSources(false), Autotune(false)
+    , NvidiaDriverVersion(MIN_NVIDIA_DRIVER_VERSION), Jobs(1), ProfileSample(1), CPUVectorWidth(0), TUIndex(0)
 {
     if (const char *path = std::getenv("CENTAURUS_INSTALL_PATH"))
         InstallPath = path;
@@ -682,6 +913,12 @@ acl::CentaurusConfig::CentaurusConfig(int argc, const char *argv[]) :
         }
     }
 
+    // acl owned cache of OpenCL kernel binaries, see KernelCache.hpp
+    if (const char *path = std::getenv("CENTAURUS_KERNEL_CACHE_PATH"))
+        KernelCachePath = path;
+    else if (const char *home = std::getenv("HOME"))
+        KernelCachePath = std::string(home) + "/.centaurus/kernel_cache";
+
     if (NvidiaDriverVersion < MIN_NVIDIA_DRIVER_VERSION)
         NvidiaDriverVersion = MIN_NVIDIA_DRIVER_VERSION;
 
@@ -714,6 +951,48 @@ acl::CentaurusConfig::CentaurusConfig(int argc, const char *argv[]) :
         }
         if (Option.compare("--profile") == 0)
             ProfileMode = true;
+        else if (Option.compare(0,17,"--profile-sample=") == 0)
+            ProfileSample = atoi(Option.substr(17).c_str());
+        else if (Option.compare("-j") == 0) {
+            if (i + 1 < argc) {
+                Jobs = atoi(argv[i+1]);
+                i++;
+            }
+        }
+        else if (Option.compare(0,2,"-j") == 0)
+            Jobs = atoi(Option.substr(2).c_str());
+        else if (Option.compare("--no-kernel-cache") == 0)
+            UseKernelCache = false;
+        else if (Option.compare(0,15,"--kernel-cache=") == 0)
+            KernelCachePath = Option.substr(15);
+        else if (Option.compare("--single-object") == 0)
+            SingleObject = true;
+        else if (Option.compare("--syntax-check") == 0)
+            SyntaxCheck = true;
+        else if (Option.compare("--fuse-tasks") == 0)
+            FuseTasks = true;
+        else if (Option.compare("--static-task-sites") == 0)
+            StaticTaskSites = true;
+        else if (Option.compare("--batch-tasks") == 0)
+            BatchTasks = true;
+        else if (Option.compare("--elide-transfers") == 0)
+            ElideTransfers = true;
+        else if (Option.compare("--specialize-kernels") == 0)
+            SpecializeKernels = true;
+        else if (Option.compare("--strip-kernel-sources") == 0)
+            StripKernelSources = true;
+        else if (Option.compare("--autotune") == 0)
+            Autotune = true;
+        else if (Option.compare(0,19,"--cpu-vector-width=") == 0)
+            CPUVectorWidth = atoi(Option.substr(19).c_str());
+        else if (Option.compare(0,17,"--kernel-backend=") == 0)
+            KernelBackend = Option.substr(17);
+        else if (Option.compare(0,18,"--resource-report=") == 0)
+            ResourceReport = Option.substr(18);
+        else if (Option.compare("-acl-time-report") == 0)
+            TimeReport = "acl_time_report.json";
+        else if (Option.compare(0,17,"-acl-time-report=") == 0)
+            TimeReport = Option.substr(17);
         else
             InputFiles.push_back(Option);
     }
@@ -742,6 +1021,18 @@ acl::CentaurusConfig::CentaurusConfig(int argc, const char *argv[]) :
             ExtraCompilerFlags.push_back(Option);
     }
 
+    if (!Jobs)
+        Jobs = 1;
+    if (!ProfileSample)
+        ProfileSample = 1;
+
+    // the widths of the OpenCL vector types
+    if (CPUVectorWidth != 2 && CPUVectorWidth != 4 &&
+        CPUVectorWidth != 8 && CPUVectorWidth != 16) {
+        if (CPUVectorWidth)
+            llvm::outs() << WARNING << "unsupported CPU vector width '" << CPUVectorWidth << "', ignored\n";
+        CPUVectorWidth = 0;
+    }
 }
 
 void
@@ -750,7 +1041,24 @@ acl::CentaurusConfig::print() const {
     llvm::outs() << DEBUG
                  << "\nCentaurus Configuration:\n"
                  << PRINT(ProfileMode)
+                 << PRINT(ProfileSample)
                  << PRINT(CompileOnly)
+                 << PRINT(Jobs)
+                 << PRINT(UseKernelCache)
+                 << PRINT(SingleObject)
+                 << PRINT(SyntaxCheck)
+                 << PRINT(FuseTasks)
+                 << PRINT(StaticTaskSites)
+                 << PRINT(BatchTasks)
+                 << PRINT(ElideTransfers)
+                 << PRINT(SpecializeKernels)
+                 << PRINT(StripKernelSources)
+                 << PRINT(CPUVectorWidth)
+                 << PRINT(Autotune)
+                 << PRINT(KernelCachePath)
+                 << PRINT(KernelBackend)
+                 << PRINT(ResourceReport)
+                 << PRINT(TimeReport)
                  << PRINT(UserDefinedOutputFile)
                  << "\n"
         ;
@@ -25,16 +25,27 @@
 
 #include <sstream>
 #include <iomanip>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <set>
+#include <memory>
+#include <cstring>
+#include <algorithm>
 
 #include "Types.hpp"
 #include "Common.hpp"
 #include "ocl_utils.hpp"
+#include "KernelCache.hpp"
+#include "CompileBackend.hpp"
+#include "TimeReport.hpp"
 
 namespace {
 
 const char *_blacklist[] = { "GeForce 210" };
 const std::vector<const char *> Blacklist(_blacklist,_blacklist + 1);
 
+// empty on error, this runs on the build threads and must not exit
 std::vector<std::string> getProgBinary(cl_program cpProgram, cl_device_id *clDevices, cl_uint device_num)
 {
     cl_int errcode;
@@ -42,14 +53,14 @@ std::vector<std::string> getProgBinary(cl_program cpProgram, cl_device_id *clDev
     // Grab the number of devices associated witht the program
     cl_uint num_devices;
     errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, NULL);
-    checkError(errcode, CL_SUCCESS);
+    if (errcode != CL_SUCCESS || !num_devices)
+        return std::vector<std::string>();
 
     // Grab the device ids
-    cl_device_id* devices = (cl_device_id*) malloc(num_devices * sizeof(cl_device_id));
-    if (!devices)
+    std::vector<cl_device_id> devices(num_devices);
+    errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices.data(), 0);
+    if (errcode != CL_SUCCESS)
         return std::vector<std::string>();
-    errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices, 0);
-    checkError(errcode, CL_SUCCESS);
 
     //sanity checks
     assert(num_devices == device_num);
@@ -57,35 +68,21 @@ std::vector<std::string> getProgBinary(cl_program cpProgram, cl_device_id *clDev
         assert(devices[i] == clDevices[i]);
 
     // Grab the sizes of the binaries
-    size_t* binary_sizes = (size_t*)malloc(num_devices * sizeof(size_t));
-    if (!binary_sizes)
+    std::vector<size_t> binary_sizes(num_devices);
+    errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), binary_sizes.data(), NULL);
+    if (errcode != CL_SUCCESS)
         return std::vector<std::string>();
-    errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), binary_sizes, NULL);
-    checkError(errcode, CL_SUCCESS);
 
     // Now get the binaries
-    char** ptx_code = (char**) malloc(num_devices * sizeof(char*));
-    if (!ptx_code)
-        return std::vector<std::string>();
+    std::vector<std::string> Binary(num_devices);
+    std::vector<char *> ptx_code(num_devices);
     for( unsigned int i=0; i<num_devices; ++i) {
-        ptx_code[i]= (char*)malloc(binary_sizes[i]);
-    }
-    errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_BINARIES, num_devices * sizeof(ptx_code), ptx_code, NULL);
-    checkError(errcode, CL_SUCCESS);
-
-    std::vector<std::string> Binary;
-    for(unsigned int i=0; i<num_devices; ++i) {
-        std::string bin(ptx_code[i],binary_sizes[i]);
-        Binary.push_back(bin);
+        Binary[i].resize(binary_sizes[i]);
+        ptx_code[i] = binary_sizes[i] ? &Binary[i][0] : NULL;
     }
-
-    // Cleanup
-    free( devices );
-    free( binary_sizes );
-    for( unsigned int i=0; i<num_devices; ++i) {
-        free(ptx_code[i]);
-    }
-    free( ptx_code );
+    errcode = clGetProgramInfo(cpProgram, CL_PROGRAM_BINARIES, num_devices * sizeof(char *), ptx_code.data(), NULL);
+    if (errcode != CL_SUCCESS)
+        return std::vector<std::string>();
 
     return Binary;
 }
@@ -104,9 +101,7 @@ std::vector<std::string> ocltLogBuildInfo(cl_program cpProgram, cl_device_id *cd
     for (i=0; i<device_num; ++i) {
         size_t log_size;
         errcode = clGetProgramBuildInfo(cpProgram, cdDevice[i], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        checkError(errcode, CL_SUCCESS);
-
-        if (log_size <= 2) {
+        if (errcode != CL_SUCCESS || log_size <= 2) {
             out.push_back(std::string());
             continue;
         }
@@ -118,7 +113,11 @@ std::vector<std::string> ocltLogBuildInfo(cl_program cpProgram, cl_device_id *cd
         }
 
         errcode = clGetProgramBuildInfo(cpProgram, cdDevice[i], CL_PROGRAM_BUILD_LOG, log_size, buildLog, NULL);
-        checkError(errcode, CL_SUCCESS);
+        if (errcode != CL_SUCCESS) {
+            out.push_back(std::string());
+            free(buildLog);
+            continue;
+        }
 
         buildLog[log_size] = '\0';
         std::string log(buildLog,log_size);
@@ -129,6 +128,45 @@ std::vector<std::string> ocltLogBuildInfo(cl_program cpProgram, cl_device_id *cd
     return out;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Get the identity of platforms and devices for the kernel cache
+////////////////////////////////////////////////////////////////////////////////
+
+std::string getPlatformInfoString(cl_platform_id cpPlatform, cl_platform_info param)
+{
+    size_t size = 0;
+    if (clGetPlatformInfo(cpPlatform, param, 0, NULL, &size) != CL_SUCCESS || !size)
+        return std::string();
+    std::vector<char> info(size);
+    if (clGetPlatformInfo(cpPlatform, param, size, &info[0], NULL) != CL_SUCCESS)
+        return std::string();
+    return std::string(&info[0],strnlen(&info[0],size));
+}
+
+std::string getDeviceInfoString(cl_device_id cdDevice, cl_device_info param)
+{
+    size_t size = 0;
+    if (clGetDeviceInfo(cdDevice, param, 0, NULL, &size) != CL_SUCCESS || !size)
+        return std::string();
+    std::vector<char> info(size);
+    if (clGetDeviceInfo(cdDevice, param, size, &info[0], NULL) != CL_SUCCESS)
+        return std::string();
+    return std::string(&info[0],strnlen(&info[0],size));
+}
+
+std::string getDeviceIdentity(cl_platform_id cpPlatform, cl_device_id *cdDevice, cl_uint device_num)
+{
+    std::string Identity = getPlatformInfoString(cpPlatform, CL_PLATFORM_NAME) + "\n"
+        + getPlatformInfoString(cpPlatform, CL_PLATFORM_VERSION) + "\n";
+    for (cl_uint i=0; i<device_num; ++i) {
+        Identity += getDeviceInfoString(cdDevice[i], CL_DEVICE_VENDOR) + "\n"
+            + getDeviceInfoString(cdDevice[i], CL_DEVICE_NAME) + "\n"
+            + getDeviceInfoString(cdDevice[i], CL_DEVICE_VERSION) + "\n"
+            + getDeviceInfoString(cdDevice[i], CL_DRIVER_VERSION) + "\n";
+    }
+    return Identity;
+}
+
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -146,51 +184,80 @@ DeviceBin::DeviceBin(std::string &PlatformName,
                      const int id)
     : PlatformName(PlatformName), Log(RawLog,PlatformName)
 {
-#if 1
-    std::string HexBinArray = ToHex(BinArray);
-#else
-    std::string HexBinArray;
-#endif
-    std::string _NameRef = "__bin__" + APINameRef + "__" + SymbolName;
+    init(SymbolName,PrefixDef,APINameRef,BinArray,id);
+}
 
-    const std::string StaticInfoDeclName = "__acl_static_info_"
-        + PrefixDef + "_" + PlatformName + "_" + toString(id);
-    std::string StaticInfoLogDecl = "struct _device_bin_static_info "
-        + StaticInfoDeclName + " = " + Log.printDeclInit() + ";";
+DeviceBin::DeviceBin(std::string &PlatformName,
+                     std::string &SymbolName,
+                     std::string &PrefixDef,
+                     std::string &APINameRef,
+                     std::string &BinArray,
+                     const PTXASInfo &Info,
+                     const int id)
+    : PlatformName(PlatformName), Log(Info)
+{
+    init(SymbolName,PrefixDef,APINameRef,BinArray,id);
+}
+
+void
+DeviceBin::init(std::string &SymbolName,
+                std::string &PrefixDef,
+                std::string &APINameRef,
+                std::string &BinArray,
+                const int id) {
+    Data = BinArray;
+
+    std::string _NameRef = "__bin__" + APINameRef + "__" + SymbolName;
 
+    // the initializer of an entry of the device table of the platform
     NameRef = APINameRef;
-    Definition = StaticInfoLogDecl + "struct _device_bin " + APINameRef + " = {"
-        + ".bin = " + _NameRef
+    Definition = "{"
+        ".bin = " + _NameRef
         + ",.bin_size = " + toString(BinArray.size())
-        + ",.static_info = " + StaticInfoDeclName
-        + "};";
+        + ",.static_info = " + Log.printDeclInit()
+        + "}";
 
+    // Bin.Definition is emitted by Stage1, once Data is written to a side file
     Bin.NameRef = _NameRef;
-    Bin.Definition = "const unsigned char " + _NameRef
-        + "[" + toString(BinArray.size()) + "]"
-        +" = "
-        + "{" + HexBinArray + "};";
     Bin.HeaderDecl = "extern const unsigned char " + _NameRef
         + "[" + toString(BinArray.size()) + "];";
 }
 
-std::string
-DeviceBin::ToHex(const std::string &src) {
-    std::string out;
-    //llvm::raw_string_ostream OS(out);
-    std::stringstream OS;
+void
+DeviceBin::setTunedLocal(const std::vector<size_t> &Local) {
+    TunedLocal = Local;
 
-    for (size_t i=0; i<src.size(); ++i) {
+    std::string Init;
+    for (std::vector<size_t>::size_type i=0; i<Local.size(); ++i)
+        Init += (i ? "," : "") + toString(Local[i]);
+    // before the closing brace of the initializer
+    Definition.insert(Definition.size() - 1,",.tuned_local = {" + Init + "}");
+}
+
+void
+PlatformBin::printDeviceTable() {
+    std::string DevTable;
+    for (size_type i=0; i<size(); ++i) {
         if (i)
-            OS << ",";
-        OS << "0x"
-           << std::setfill('0')
-           << std::setw(2)
-           << std::hex
-           << (int)(unsigned char)src[i];
+            DevTable += ",";
+        DevTable += (*this)[i].Definition;
     }
 
-    return OS.str();
+    Definition = "static struct _device_bin " + NameRef
+        + "[" + toString(size()) + "] = {" + DevTable + "};";
+}
+
+std::string
+DeviceBin::printIncbin(const std::string &Path) const {
+    // raw section, the host compiler does not parse the binary as an array
+    return "__asm__(\".section .rodata\\n\"\n"
+        "\".globl " + Bin.NameRef + "\\n\"\n"
+        "\".type " + Bin.NameRef + ", @object\\n\"\n"
+        "\".balign 16\\n\"\n"
+        "\"" + Bin.NameRef + ":\\n\"\n"
+        "\".incbin \\\"" + Path + "\\\"\\n\"\n"
+        "\".size " + Bin.NameRef + ", " + toString(Data.size()) + "\\n\"\n"
+        "\".previous\\n\");\n";
 }
 
 PTXASInfo::PTXASInfo(std::string Log, std::string PlatformName) :
@@ -317,9 +384,41 @@ cl_uint blacklist(const std::string &PlatformName, cl_device_id *cdDevice, cl_ui
     return device_num;
 }
 
+PlatformBin
+createPlatformBin(std::string &PlatformName, std::string &SymbolName, std::string &PrefixDef,
+                  KernelCacheEntry &Entry) {
+    PlatformBin PlatformBinary(PlatformName);
+    // the device table, static data of the impl file
+    std::string DevTableName = PrefixDef + PlatformName + "_DEV_TABLE";
+    PlatformBinary.NameRef = DevTableName;
+
+    for (std::vector<std::string>::size_type i=0; i<Entry.size(); ++i) {
+        std::string APINameRef = PrefixDef + PlatformName + "__device" + toString(i);
+
+        DeviceBin DeviceBinary(PlatformName,SymbolName,PrefixDef,APINameRef,
+                               Entry.Binaries[i],Entry.Info[i],i);
+        PlatformBinary.push_back(DeviceBinary);
+    }
+
+    PlatformBinary.printDeviceTable();
+
+    return PlatformBinary;
+}
+
+PlatformBin
+createFailedPlatformBin(const std::string &Log) {
+    PlatformBin PlatformBinary;
+    PlatformBinary.BuildError = Log.size() ? Log : std::string(ERROR) + "kernel build failed\n";
+    return PlatformBinary;
+}
+
+static std::string getOpenCLError(const char *Call, cl_int errcode) {
+    return std::string(ERROR) + "OpenCL error " + toString(errcode) + " in " + Call + "\n";
+}
+
 PlatformBin _compile(std::string src, std::string SymbolName, std::string PrefixDef,
                    const std::vector<std::string> &options,
-                   cl_platform_id cpPlatform) {
+                   cl_platform_id cpPlatform, const KernelCache &Cache) {
     cl_context       clGPUContext;
     cl_program       clProgram;
 
@@ -394,24 +493,45 @@ PlatformBin _compile(std::string src, std::string SymbolName, std::string Prefix
 
     cl_uint device_num;
     errcode = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_ALL, 0, NULL, &device_num);
-    checkError(errcode, CL_SUCCESS);
+    if (errcode != CL_SUCCESS)
+        return createFailedPlatformBin(getOpenCLError("clGetDeviceIDs",errcode));
 
     cl_device_id *cdDevice = (cl_device_id *)malloc(sizeof(cl_device_id)*device_num);
 
     // Get a GPU device
     errcode = clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_ALL, device_num, cdDevice, NULL);
-    checkError(errcode, CL_SUCCESS);
+    if (errcode != CL_SUCCESS) {
+        free(cdDevice);
+        return createFailedPlatformBin(getOpenCLError("clGetDeviceIDs",errcode));
+    }
 
     device_num = blacklist(PlatformName,cdDevice,device_num);
 
+    // skip the OpenCL driver if we have already built this kernel
+    const std::string CacheKey =
+        Cache.getKey(src,BuildOptions,getDeviceIdentity(cpPlatform,cdDevice,device_num));
+    KernelCacheEntry Entry;
+    if (Cache.lookup(CacheKey,Entry) && Entry.size() == device_num) {
+        free(cdDevice);
+        return createPlatformBin(PlatformName,SymbolName,PrefixDef,Entry);
+    }
+
     clGPUContext = clCreateContext(0, device_num, cdDevice, NULL, NULL, &errcode);
-    checkError(errcode, CL_SUCCESS);
+    if (errcode != CL_SUCCESS) {
+        free(cdDevice);
+        return createFailedPlatformBin(getOpenCLError("clCreateContext",errcode));
+    }
 
     // get the list of devices associated with context
     errcode = clGetContextInfo(clGPUContext, CL_CONTEXT_DEVICES, 0, NULL, &dataBytes);
     cl_device_id *cdDevices = (cl_device_id *)malloc(dataBytes);
     errcode |= clGetContextInfo(clGPUContext, CL_CONTEXT_DEVICES, dataBytes, cdDevices, NULL);
-    checkError(errcode, CL_SUCCESS);
+    if (errcode != CL_SUCCESS) {
+        free(cdDevice);
+        free(cdDevices);
+        clReleaseContext(clGPUContext);
+        return createFailedPlatformBin(getOpenCLError("clGetContextInfo",errcode));
+    }
 
     //sanity check
     for (unsigned int i=0; i<device_num; ++i)
@@ -421,105 +541,476 @@ PlatformBin _compile(std::string src, std::string SymbolName, std::string Prefix
 
     const char *c_str = src.c_str();
     clProgram = clCreateProgramWithSource(clGPUContext, 1, (const char **)&c_str, &srcLength, &errcode);
-    checkError(errcode, CL_SUCCESS);
+    if (errcode != CL_SUCCESS) {
+        free(cdDevices);
+        clReleaseContext(clGPUContext);
+        return createFailedPlatformBin(getOpenCLError("clCreateProgramWithSource",errcode));
+    }
 
-    errcode = clBuildProgram(clProgram, 0, NULL, BuildOptions.c_str(), NULL, NULL);
+    {
+        // one call for all the devices of the platform
+        TimeRegion Time("build",PlatformName + " " + SymbolName
+                        + " (" + toString(device_num) + " device(s))");
+        errcode = clBuildProgram(clProgram, 0, NULL, BuildOptions.c_str(), NULL, NULL);
+    }
 
     // Get the build log... Without doing this it is next to impossible to
     // debug a failed .cl build
     std::vector<std::string> RawBuildLogs = ocltLogBuildInfo(clProgram, cdDevices, device_num);
     if(errcode != CL_SUCCESS) {
-        std::cout << DEBUG
-                  << src << "\n";
+        // printed by CompileScheduler::run(), other builds may be running
+        std::string Log = std::string(DEBUG) + src + "\n";
         for (std::vector<std::string>::iterator
                  II = RawBuildLogs.begin(), EE = RawBuildLogs.end(); II != EE; ++II)
-            std::cout << DEBUG
-                      << "LOG:\n" << *II << "\n";
-        checkError(errcode, CL_SUCCESS);
+            Log += std::string(DEBUG) + "LOG:\n" + *II + "\n";
+        Log += getOpenCLError("clBuildProgram",errcode);
 
-        return PlatformBin();
+        free(cdDevices);
+        clReleaseProgram(clProgram);
+        clReleaseContext(clGPUContext);
+        return createFailedPlatformBin(Log);
     }
 
     // Store the binary in the file system
     std::vector<std::string> BinArray = getProgBinary(clProgram, cdDevices, device_num);
 
-    errcode |= clReleaseProgram(clProgram);
-    errcode |= clReleaseContext(clGPUContext);
-    checkError(errcode, CL_SUCCESS);
+    clReleaseProgram(clProgram);
+    clReleaseContext(clGPUContext);
 
     free(cdDevices);
 
+    if (!BinArray.size())
+        return createFailedPlatformBin(std::string(ERROR) + "cannot get the binaries of '"
+                                       + SymbolName + "' from the OpenCL driver\n");
+
     //sanity check
     assert(RawBuildLogs.size() == BinArray.size());
 
-    if (!BinArray.size()) {
-        //ObjRefDef Empty("NULL",std::string());
-        //return KernelBin(std::string(),Empty,std::string());
-        return PlatformBin();
+    for (std::vector<std::string>::size_type i=0; i<BinArray.size(); ++i) {
+        Entry.Binaries.push_back(BinArray[i]);
+        Entry.Info.push_back(PTXASInfo(RawBuildLogs[i],PlatformName));
     }
+    Cache.store(CacheKey,Entry);
 
-    PlatformBin PlatformBinary(PlatformName);
-    PlatformBinary.NameRef = PrefixDef + PlatformName;
+    return createPlatformBin(PlatformName,SymbolName,PrefixDef,Entry);
+}
 
-    std::string DevTableName = PrefixDef + PlatformName + "_DEV_TABLE";
-    std::string DevTable = "struct _device_bin *" + DevTableName + " = (struct _device_bin*)acl_malloc(sizeof(struct _device_bin)*" + toString(BinArray.size()) + ");";
-    for (std::vector<std::string>::size_type i=0; i<BinArray.size(); ++i) {
-        std::string APINameRef = PrefixDef + PlatformName + "__device" + toString(i);
-        DevTable += DevTableName + "[" + toString(i) + "] = " + APINameRef + ";";
+// the local sizes of powers of 2 that divide the global size, in the limits
+// of the kernel and of the device
+static std::vector<std::vector<size_t> >
+getLocalSizeCandidates(const std::vector<size_t> &GlobalSize, size_t MaxSize, const size_t *MaxItems) {
+    size_t G[3] = { 1, 1, 1 };
+    for (size_t d = 0; d < GlobalSize.size(); ++d)
+        G[d] = GlobalSize[d];
+
+    std::vector<std::vector<size_t> > Candidates;
+    for (size_t x = 1; x <= G[0] && x <= MaxItems[0] && x <= MaxSize; x *= 2)
+        for (size_t y = 1; y <= G[1] && y <= MaxItems[1] && x * y <= MaxSize; y *= 2)
+            for (size_t z = 1; z <= G[2] && z <= MaxItems[2] && x * y * z <= MaxSize; z *= 2) {
+                if (G[0] % x || G[1] % y || G[2] % z)
+                    continue;
+                const size_t Local[] = { x, y, z };
+                Candidates.push_back(std::vector<size_t>(Local,Local + GlobalSize.size()));
+            }
+    return Candidates;
+}
 
-        DeviceBin DeviceBinary(PlatformName,SymbolName,PrefixDef,APINameRef,
-                               BinArray[i],RawBuildLogs[i],i);
-        PlatformBinary.push_back(DeviceBinary);
+// a launch of --autotune that runs longer is abandoned, a kernel that does not
+// terminate with the launch of its task must not hang the build
+#define ACL_AUTOTUNE_TIMEOUT_MS 2000
+
+// wait for Event until the timeout of --autotune, false if it did not complete
+static bool waitForKernel(cl_event Event) {
+    const std::chrono::steady_clock::time_point Deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(ACL_AUTOTUNE_TIMEOUT_MS);
+    for (;;) {
+        cl_int Status = CL_QUEUED;
+        if (clGetEventInfo(Event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int),
+                           &Status, NULL) != CL_SUCCESS || Status < 0)
+            return false;
+        if (Status == CL_COMPLETE)
+            return true;
+        if (std::chrono::steady_clock::now() > Deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
+}
 
-    PlatformBinary.Definition = DevTable
-        + "struct _platform_bin " + PlatformBinary.NameRef + " = {"
-        + ".device_table = " + DevTableName
-        + ",.device_num = " + toString(BinArray.size())
-        + "};";
+// the best time in ns of a few launches after a warm-up launch, 0 on error.
+// TimedOut is set if a launch did not complete in time, the queue is busy then.
+static cl_ulong timeKernel(cl_command_queue Queue, cl_kernel Kernel,
+                           const std::vector<size_t> &Global, const std::vector<size_t> &Local,
+                           bool &TimedOut) {
+    cl_ulong Best = 0;
+    for (int Run = 0; Run < 4; ++Run) {
+        cl_event Event;
+        if (clEnqueueNDRangeKernel(Queue, Kernel, Global.size(), NULL, Global.data(), Local.data(),
+                                   0, NULL, &Event) != CL_SUCCESS)
+            return 0;
+        clFlush(Queue);
+        if (!waitForKernel(Event)) {
+            cl_int Status = CL_QUEUED;
+            clGetEventInfo(Event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &Status, NULL);
+            TimedOut = Status >= 0;
+            if (!TimedOut)
+                clReleaseEvent(Event);
+            return 0;
+        }
 
-    return PlatformBinary;
+        cl_ulong Start = 0;
+        cl_ulong End = 0;
+        clGetEventProfilingInfo(Event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &Start, NULL);
+        clGetEventProfilingInfo(Event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &End, NULL);
+        clReleaseEvent(Event);
+
+        const cl_ulong Time = End > Start ? End - Start : 1;
+        if (Run && (!Best || Time < Best))
+            Best = Time;
+    }
+    return Best;
 }
 
-int
-KernelRefDef::compile(std::string src, std::string SymbolName, std::string PrefixDef,
-                      const std::vector<std::string> &options)
+// the args of the task of Spec, the buffers are released by the caller
+static bool setAutotuneArgs(cl_context Context, cl_kernel Kernel, const AutotuneSpec &Spec,
+                            std::vector<cl_mem> &Buffers) {
+    for (cl_uint i = 0; i < Spec.Args.size(); ++i) {
+        const AutotuneArg &A = Spec.Args[i];
+        cl_int errcode;
+        if (A.Kind == AutotuneArg::AK_BUFFER) {
+            std::vector<char> Zero(A.Size ? A.Size : 1, 0);
+            cl_mem Mem = clCreateBuffer(Context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                        Zero.size(), Zero.data(), &errcode);
+            if (errcode != CL_SUCCESS)
+                return false;
+            Buffers.push_back(Mem);
+            errcode = clSetKernelArg(Kernel, i, sizeof(cl_mem), &Mem);
+        }
+        else
+            errcode = clSetKernelArg(Kernel, i, A.Value.size(), A.Value.data());
+        if (errcode != CL_SUCCESS)
+            return false;
+    }
+    return true;
+}
+
+// the launch of Spec in the key of the tuned local size
+static std::string getLaunchDesc(const AutotuneSpec &Spec) {
+    std::ostringstream Desc;
+    Desc << Spec.KernelName;
+    for (size_t d = 0; d < Spec.GlobalSize.size(); ++d)
+        Desc << (d ? "x" : " ") << Spec.GlobalSize[d];
+    for (size_t i = 0; i < Spec.Args.size(); ++i) {
+        const AutotuneArg &A = Spec.Args[i];
+        if (A.Kind == AutotuneArg::AK_BUFFER)
+            Desc << " buffer:" << A.Size;
+        else {
+            Desc << " scalar:";
+            for (size_t b = 0; b < A.Value.size(); ++b)
+                Desc << std::hex << std::setw(2) << std::setfill('0')
+                     << (unsigned)(unsigned char)A.Value[b] << std::dec;
+        }
+    }
+    return Desc.str();
+}
+
+static void printTunedLocal(const AutotuneSpec &Spec, const std::string &PlatformName, cl_uint Device,
+                            const std::vector<size_t> &Local) {
+    std::cout << NOTE << "autotune '" << Spec.KernelName << "' on "
+              << PlatformName << " device " << Device << "  -  local size ";
+    for (size_t d = 0; d < Local.size(); ++d)
+        std::cout << (d ? "x" : "") << Local[d];
+}
+
+// The local size is chosen by timing, which varies from run to run. The choice
+// is stored in the kernel cache so that the generated code of the same kernel
+// on the same device does not change with each build.
+bool _autotune(PlatformBin &Bin, cl_platform_id cpPlatform, const AutotuneSpec &Spec,
+               const KernelCache &Cache) {
+    // the devices a launch timed out on, their queue may still be busy
+    static std::set<cl_device_id> HungDevices;
+
+    if (Bin.empty() || Spec.GlobalSize.empty() || Spec.GlobalSize.size() > 3)
+        return false;
+
+    // the devices in the order of the device table, see _compile()
+    cl_uint device_num;
+    if (clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_ALL, 0, NULL, &device_num) != CL_SUCCESS)
+        return false;
+    std::vector<cl_device_id> cdDevice(device_num);
+    if (clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_ALL, device_num, cdDevice.data(), NULL) != CL_SUCCESS)
+        return false;
+    device_num = blacklist(Bin.PlatformName, cdDevice.data(), device_num);
+    if (device_num != Bin.size())
+        return false;
+
+    const std::string Launch = getLaunchDesc(Spec);
+
+    bool Tuned = false;
+    for (cl_uint i = 0; i < device_num; ++i) {
+        DeviceBin &Device = Bin[i];
+
+        const std::string TuneKey =
+            Cache.getTuneKey(Device.Data,Launch,getDeviceIdentity(cpPlatform,&cdDevice[i],1));
+        std::vector<size_t> CachedLocal;
+        if (Cache.lookupLocalSize(TuneKey,CachedLocal) &&
+            CachedLocal.size() == Spec.GlobalSize.size()) {
+            Device.setTunedLocal(CachedLocal);
+            Tuned = true;
+
+            printTunedLocal(Spec, Bin.PlatformName, i, CachedLocal);
+            std::cout << " from the kernel cache\n";
+            continue;
+        }
+
+        if (HungDevices.count(cdDevice[i]))
+            continue;
+
+        cl_int errcode;
+        cl_context clContext = clCreateContext(0, 1, &cdDevice[i], NULL, NULL, &errcode);
+        if (errcode != CL_SUCCESS)
+            continue;
+        cl_command_queue clQueue = clCreateCommandQueue(clContext, cdDevice[i],
+                                                        CL_QUEUE_PROFILING_ENABLE, &errcode);
+
+        const unsigned char *BinData = (const unsigned char *)Device.Data.data();
+        const size_t BinSize = Device.Data.size();
+        cl_program clProgram = 0;
+        cl_kernel clKernel = 0;
+        if (errcode == CL_SUCCESS)
+            clProgram = clCreateProgramWithBinary(clContext, 1, &cdDevice[i], &BinSize, &BinData,
+                                                  NULL, &errcode);
+        if (errcode == CL_SUCCESS)
+            errcode = clBuildProgram(clProgram, 1, &cdDevice[i], NULL, NULL, NULL);
+        if (errcode == CL_SUCCESS)
+            clKernel = clCreateKernel(clProgram, Spec.KernelName.c_str(), &errcode);
+
+        bool TimedOut = false;
+        std::vector<cl_mem> Buffers;
+        if (errcode == CL_SUCCESS && setAutotuneArgs(clContext, clKernel, Spec, Buffers)) {
+            size_t MaxSize = 0;
+            size_t MaxItems[16] = { 0 };
+            clGetKernelWorkGroupInfo(clKernel, cdDevice[i], CL_KERNEL_WORK_GROUP_SIZE,
+                                     sizeof(size_t), &MaxSize, NULL);
+            clGetDeviceInfo(cdDevice[i], CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(MaxItems), MaxItems, NULL);
+
+            std::vector<std::vector<size_t> > Candidates =
+                getLocalSizeCandidates(Spec.GlobalSize, MaxSize, MaxItems);
+            std::vector<size_t> BestLocal;
+            cl_ulong BestTime = 0;
+            for (std::vector<std::vector<size_t> >::iterator
+                     II = Candidates.begin(), EE = Candidates.end(); II != EE && !TimedOut; ++II) {
+                const cl_ulong Time = timeKernel(clQueue, clKernel, Spec.GlobalSize, *II, TimedOut);
+                if (Time && (!BestTime || Time < BestTime)) {
+                    BestTime = Time;
+                    BestLocal = *II;
+                }
+            }
+
+            if (TimedOut) {
+                std::cout << WARNING << "autotune '" << Spec.KernelName << "' on "
+                          << Bin.PlatformName << " device " << i << "  -  a launch took more than "
+                          << ACL_AUTOTUNE_TIMEOUT_MS << " ms, do not tune on this device\n";
+                HungDevices.insert(cdDevice[i]);
+            }
+            else if (BestLocal.size()) {
+                Device.setTunedLocal(BestLocal);
+                Cache.storeLocalSize(TuneKey,BestLocal);
+                Tuned = true;
+
+                printTunedLocal(Spec, Bin.PlatformName, i, BestLocal);
+                std::cout << " of " << Candidates.size() << " in " << BestTime / 1000 << " us\n";
+            }
+        }
+
+        // the objects of a busy queue cannot be released without waiting for
+        // the kernel, leave them to the exit of acl
+        if (TimedOut)
+            continue;
+
+        for (std::vector<cl_mem>::iterator
+                 II = Buffers.begin(), EE = Buffers.end(); II != EE; ++II)
+            clReleaseMemObject(*II);
+        if (clKernel)
+            clReleaseKernel(clKernel);
+        if (clProgram)
+            clReleaseProgram(clProgram);
+        if (clQueue)
+            clReleaseCommandQueue(clQueue);
+        clReleaseContext(clContext);
+    }
+
+    if (Tuned)
+        Bin.printDeviceTable();
+    return Tuned;
+}
+
+void
+CompileScheduler::enqueue(KernelRefDef *Kernel, const std::string &Src,
+                          const std::string &SymbolName, const std::string &PrefixDef,
+                          const std::vector<std::string> &Options) {
+    CompileJob Job;
+    Job.Kernel = Kernel;
+    Job.Src = Src;
+    Job.SymbolName = SymbolName;
+    Job.PrefixDef = PrefixDef;
+    Job.Options = Options;
+    Jobs.push_back(Job);
+}
+
+namespace {
+
+// one target per installed OpenCL platform
+class OpenCLBackend : public CompileBackend {
+private:
+    std::vector<cl_platform_id> Platforms;
+
+public:
+    explicit OpenCLBackend(const std::vector<cl_platform_id> &Platforms) :
+        Platforms(Platforms) {}
+
+    const char *getName() const { return "OpenCL"; }
+    size_t getNumTargets() const { return Platforms.size(); }
+
+    PlatformBin compile(const std::string &Src, const std::string &SymbolName,
+                        const std::string &PrefixDef,
+                        const std::vector<std::string> &Options,
+                        size_t Target, const KernelCache &Cache) {
+        return _compile(Src,SymbolName,PrefixDef,Options,Platforms[Target],Cache);
+    }
+
+    bool autotune(PlatformBin &Bin, size_t Target, const AutotuneSpec &Spec,
+                  const KernelCache &Cache) {
+        return _autotune(Bin,Platforms[Target],Spec,Cache);
+    }
+};
+
+}
+
+CompileBackend *
+createOpenCLBackend(const CentaurusConfig &ACLConfig)
 {
     cl_uint         num_platforms;
-    cl_platform_id* clPlatformIDs;
     cl_int          status;
 
-#if 0
-    std::cout << DEBUG << "________________src________________\n";
-    std::cout << src;
-    std::cout << DEBUG << "________________src________________\n";
-#endif
-
     status = clGetPlatformIDs(0, NULL, &num_platforms);
     if (status != CL_SUCCESS)
     {
         std::cerr << "Error " << status << "in clGetPlatformIDs" << std::endl;
-        return -1;
+        return NULL;
     }
     if(num_platforms == 0)
     {
         std::cerr << "No OpenCL platform found!";
-        return -2;
+        return NULL;
     }
-    else
-    {
-        clPlatformIDs = (cl_platform_id*)malloc(num_platforms * sizeof(cl_platform_id));
 
-        status = clGetPlatformIDs(num_platforms, clPlatformIDs, NULL);
-        for(uint i = 0; i < num_platforms; ++i)
-        {
-            PlatformBin PlatformBinary = _compile(src,SymbolName,PrefixDef,options,clPlatformIDs[i]);
-            Binary.push_back(PlatformBinary);
+    std::vector<cl_platform_id> clPlatformIDs(num_platforms);
+    status = clGetPlatformIDs(num_platforms, clPlatformIDs.data(), NULL);
+    checkError(status, CL_SUCCESS);
+
+    return new OpenCLBackend(clPlatformIDs);
+}
+
+CompileBackend *
+createCompileBackend(const CentaurusConfig &ACLConfig)
+{
+    if (ACLConfig.KernelBackend.compare("spir") == 0)
+        return createSPIRBackend(ACLConfig);
+
+    if (ACLConfig.KernelBackend.compare("opencl") == 0)
+        return createOpenCLBackend(ACLConfig);
+
+    if (ACLConfig.KernelBackend.size())
+        std::cout << WARNING << "unknown kernel backend '" << ACLConfig.KernelBackend << "'\n";
+
+    // auto: do not leave the platform tables empty on machines without OpenCL
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        std::cout << NOTE << "no OpenCL platform found, build SPIR kernels\n";
+        return createSPIRBackend(ACLConfig);
+    }
+    return createOpenCLBackend(ACLConfig);
+}
+
+int
+CompileScheduler::run(const CentaurusConfig &ACLConfig)
+{
+    if (Jobs.empty())
+        return 0;
+
+    std::unique_ptr<CompileBackend> Backend(createCompileBackend(ACLConfig));
+    if (!Backend) {
+        Jobs.clear();
+        return -1;
+    }
+
+    KernelCache Cache(ACLConfig);
+
+    // one slot per (job, target), filled by whichever thread builds it
+    const size_t NumTargets = Backend->getNumTargets();
+    const size_t NumBuilds = Jobs.size() * NumTargets;
+    std::vector<PlatformBin> Results(NumBuilds);
+    std::atomic<size_t> NextBuild(0);
+
+    auto Worker = [&]() {
+        for (size_t i = NextBuild++; i < NumBuilds; i = NextBuild++) {
+            const CompileJob &Job = Jobs[i / NumTargets];
+            Results[i] = Backend->compile(Job.Src,Job.SymbolName,Job.PrefixDef,Job.Options,
+                                          i % NumTargets,Cache);
         }
+    };
 
-        free(clPlatformIDs);
+    size_t NumThreads = ACLConfig.Jobs ? ACLConfig.Jobs : 1;
+    if (NumThreads > NumBuilds)
+        NumThreads = NumBuilds;
+
+    if (NumThreads <= 1)
+        Worker();
+    else {
+        std::vector<std::thread> Pool;
+        for (size_t t = 0; t < NumThreads; ++t)
+            Pool.push_back(std::thread(Worker));
+        for (size_t t = 0; t < NumThreads; ++t)
+            Pool[t].join();
     }
 
+    // the logs of the failed builds in job order, not as the threads ended
+    size_t NumFailed = 0;
+    for (size_t i = 0; i < NumBuilds; ++i) {
+        if (Results[i].BuildError.empty())
+            continue;
+        std::cout << Results[i].BuildError;
+        ++NumFailed;
+    }
+    if (NumFailed) {
+        std::cout << ERROR << NumFailed << " kernel build(s) failed\n";
+        Jobs.clear();
+        return -1;
+    }
+
+    // one kernel at a time, the timings must not overlap, see --autotune
+    if (ACLConfig.Autotune) {
+        size_t NumSpecs = 0;
+        size_t NumTuned = 0;
+        for (size_t i = 0; i < NumBuilds; ++i) {
+            const CompileJob &Job = Jobs[i / NumTargets];
+            if (Job.Kernel->Tune.empty())
+                continue;
+            ++NumSpecs;
+            if (Backend->autotune(Results[i],i % NumTargets,Job.Kernel->Tune,Cache))
+                ++NumTuned;
+        }
+        if (NumSpecs && !NumTuned)
+            std::cout << WARNING << "autotune: no kernel could be run by the "
+                      << Backend->getName() << " backend\n";
+    }
+
+    // deterministic output: targets in the order of the backend
+    for (size_t i = 0; i < NumBuilds; ++i)
+        Jobs[i / NumTargets].Kernel->Binary.push_back(Results[i]);
+
+    Jobs.clear();
+
     return 0;
 }
 